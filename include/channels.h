@@ -40,9 +40,40 @@
 class CoreExport Channel : public Extensible
 {
  public:
-	/** A map of Memberships on a channel keyed by User pointers
+	/** A map of Memberships on a channel keyed by User pointers.
+	 * The Membership objects are allocated from a pool shared by all channels.
 	 */
-	typedef std::map<User*, insp::aligned_storage<Membership> > MemberMap;
+	typedef std::map<User*, Membership*> MemberMap;
+
+	/** A local member of a channel, stored together with their rank so that
+	 * messages can be sent to local members without visiting remote ones.
+	 */
+	struct LocalMember
+	{
+		/** The local user who is on the channel. */
+		LocalUser* user;
+
+		/** The membership of the user. */
+		Membership* memb;
+
+		/** The rank of the member, kept in sync with Membership::getRank(). */
+		unsigned int rank;
+	};
+
+	/** A list of the local members of a channel in no particular order.
+	 */
+	typedef std::vector<LocalMember> LocalMemberList;
+
+	/** An index of channels ordered by a time, e.g. their creation time.
+	 * Adding or removing a channel does not invalidate the positions of other channels.
+	 */
+	typedef std::set<std::pair<time_t, Channel*> > TimeIndex;
+
+	/** An index of channels grouped by their user count. Group N holds the channels with
+	 * between 2^N - 1 and 2^(N+1) - 2 users so a channel only moves to another group when
+	 * its user count roughly doubles or halves. Channels within a group are in no particular order.
+	 */
+	typedef std::vector<std::vector<Channel*> > UserCountIndex;
 
  private:
 	/** Set default modes for the channel on creation
@@ -64,6 +95,33 @@ class CoreExport Channel : public Extensible
 	 */
 	void DelUser(const MemberMap::iterator& membiter);
 
+	/** The local members of the channel. Every entry is also in userlist.
+	 */
+	LocalMemberList localusers;
+
+	/** Time that the object was instantiated (used for TS calculation etc)
+	 * This is only changed by SetAge() so that the creation time index stays ordered.
+	 */
+	time_t age;
+
+	/** The position of the channel in the creation time index. */
+	TimeIndex::iterator agepos;
+
+	/** The position of the channel in the topic time index or the end of it if no topic time is set. */
+	TimeIndex::iterator topicpos;
+
+	/** The group of the user count index the channel is in and its position within it. */
+	size_t usercountgroup;
+	size_t usercountpos;
+
+	/** Moves the channel to the right group of the user count index after its user count has changed. */
+	void UpdateUserCountIndex();
+
+	/** Removes the channel from all of the indices. */
+	void RemoveFromIndices();
+
+	friend class Membership;
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -87,10 +145,6 @@ class CoreExport Channel : public Extensible
 	 */
 	std::string name;
 
-	/** Time that the object was instantiated (used for TS calculation etc)
-	*/
-	time_t age;
-
 	/** User list.
 	 */
 	MemberMap userlist;
@@ -102,6 +156,7 @@ class CoreExport Channel : public Extensible
 
 	/** Time topic was set.
 	 * If no topic was ever set, this will be equal to Channel::created
+	 * This is changed by SetTopic() which keeps the topic time index ordered.
 	 */
 	time_t topicset;
 
@@ -179,6 +234,48 @@ class CoreExport Channel : public Extensible
 	 */
 	const MemberMap& GetUsers() const { return userlist; }
 
+	/** Get the local members of this channel along with their rank.
+	 * This is a subset of GetUsers() which is cheaper to iterate when only
+	 * local users are of interest, for example when sending a message.
+	 * @return A reference to a list of local members.
+	 */
+	const LocalMemberList& GetLocalUsers() const { return localusers; }
+
+	/** Recalculates the rank stored for each local member of this channel. This
+	 * must be called when the rank of a prefix mode changes, e.g. on rehash.
+	 */
+	void UpdateLocalRanks();
+
+	/** Get the pool which the Membership objects of all channels are allocated from.
+	 * @return A reference to the Membership pool.
+	 */
+	static const insp::object_pool& GetMembershipPool();
+
+	/** Get the index of all channels ordered by their creation time. */
+	static const TimeIndex& GetAgeIndex();
+
+	/** Get the index of the channels which have a topic time ordered by their topic time. */
+	static const TimeIndex& GetTopicIndex();
+
+	/** Get the index of all channels grouped by their user count. */
+	static const UserCountIndex& GetUserCountIndex();
+
+	/** Get the group of the user count index which holds channels with the given number of users.
+	 * @param users A user count.
+	 * @return The group of the user count index for the user count.
+	 */
+	static size_t GetUserCountGroup(size_t users);
+
+	/** Retrieves the creation time of the channel.
+	 * @return The creation time of the channel.
+	 */
+	time_t GetAge() const { return age; }
+
+	/** Changes the creation time of the channel.
+	 * @param ts The new creation time.
+	 */
+	void SetAge(time_t ts);
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
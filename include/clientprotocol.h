@@ -29,6 +29,9 @@ namespace ClientProtocol
 	struct RFCEvents;
 	struct ParseOutput;
 	class TagSelection;
+
+	/** A serialized message which is shared by the send queues of all of its recipients. */
+	typedef reference<StreamSocket::SendQueue::SharedBuffer> SharedSerializedMessage;
 }
 
 /** Contains a message parsed from wire format.
@@ -53,9 +56,21 @@ struct ClientProtocol::ParseOutput
  */
 class ClientProtocol::TagSelection
 {
-	std::bitset<64> selection;
+	/** Bitmask of the selected tags, indexed by the position of the tag in the TagMap.
+	 * Kept as a plain integer so selections can be compared and ordered cheaply when
+	 * looking up serialized messages.
+	 */
+	uint64_t selection;
+
+	/** The maximum number of tags that can be selected. */
+	static const size_t MaxTags = 64;
 
  public:
+	TagSelection()
+		: selection(0)
+	{
+	}
+
 	/** Check if a tag is selected.
 	 * @param tags TagMap the tag is in. The TagMap must contain the same tags as it had when the tag
 	 * was selected with Select(), otherwise the result is not meaningful.
@@ -65,7 +80,7 @@ class ClientProtocol::TagSelection
 	bool IsSelected(const TagMap& tags, TagMap::const_iterator it) const
 	{
 		const size_t index = std::distance(tags.begin(), it);
-		return ((index < selection.size()) && (selection[index]));
+		return ((index < MaxTags) && (selection & (static_cast<uint64_t>(1) << index)));
 	}
 
 	/** Select a tag.
@@ -76,8 +91,8 @@ class ClientProtocol::TagSelection
 	void Select(const TagMap& tags, TagMap::const_iterator it)
 	{
 		const size_t index = std::distance(tags.begin(), it);
-		if (index < selection.size())
-			selection[index] = true;
+		if (index < MaxTags)
+			selection |= (static_cast<uint64_t>(1) << index);
 	}
 
 	/** Check if a TagSelection is equivalent to this object.
@@ -88,6 +103,15 @@ class ClientProtocol::TagSelection
 	{
 		return (this->selection == other.selection);
 	}
+
+	/** Provides an arbitrary but consistent ordering of TagSelection objects.
+	 * @param other Other TagSelection object to compare this with.
+	 * @return True if this object is ordered before the other one, false otherwise.
+	 */
+	bool operator<(const TagSelection& other) const
+	{
+		return (this->selection < other.selection);
+	}
 };
 
 class ClientProtocol::MessageSource
@@ -206,6 +230,17 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		{
 			return ((serializer == other.serializer) && (tagwl == other.tagwl));
 		}
+
+		/** Provides an arbitrary but consistent ordering of SerializedInfo objects.
+		 * @param other Other SerializedInfo object.
+		 * @return True if this object is ordered before the other one, false otherwise.
+		 */
+		bool operator<(const SerializedInfo& other) const
+		{
+			if (serializer != other.serializer)
+				return std::less<const Serializer*>()(serializer, other.serializer);
+			return (tagwl < other.tagwl);
+		}
 	};
 
 	class Param
@@ -282,13 +317,14 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	typedef std::vector<Param> ParamList;
 
  private:
-	typedef std::vector<std::pair<SerializedInfo, SerializedMessage> > SerializedList;
+	typedef insp::flat_map<SerializedInfo, SharedSerializedMessage> SerializedList;
 
 	ParamList params;
 	TagMap tags;
 	std::string command;
 	bool msginit_done;
 	mutable SerializedList serlist;
+	mutable SerializedList::size_type lastserialized;
 	bool sideeffect;
 
  protected:
@@ -312,6 +348,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, lastserialized(0)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -329,6 +366,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourcestr, Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, lastserialized(0)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -414,9 +452,10 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	 * @param serializeinfo Information about which exact serialized form of the message is the caller asking for
 	 * (which serializer to use and which tags to include).
 	 * @return Serialized message according to serializeinfo. The returned reference remains valid until the
-	 * next call to this method.
+	 * next call to this method. The serialized message itself can be queued on any number of sockets without
+	 * being copied.
 	 */
-	const SerializedMessage& GetSerialized(const SerializedInfo& serializeinfo) const;
+	const SharedSerializedMessage& GetSerialized(const SerializedInfo& serializeinfo) const;
 
 	/** Clear the parameter list and tags.
 	 */
@@ -713,7 +752,7 @@ class CoreExport ClientProtocol::Serializer : public DataProvider
 	 * The reference is guaranteed to be valid as long as the Message object is alive and until the same
 	 * Message is serialized for another user.
 	 */
-	const SerializedMessage& SerializeForUser(LocalUser* user, Message& msg);
+	const SharedSerializedMessage& SerializeForUser(LocalUser* user, Message& msg);
 
 	/** Serialize a high level protocol message into wire format.
 	 * @param msg High level message to serialize. Contains all necessary information about the message, including all possible tags.
@@ -59,6 +59,7 @@
 #include "flat_map.h"
 #include "compat.h"
 #include "aligned_storage.h"
+#include "object_pool.h"
 #include "typedefs.h"
 #include "convto.h"
 #include "stdalgo.h"
@@ -88,9 +89,9 @@ struct fakederef
 #include "numeric.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
@@ -151,6 +152,12 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long Recv;
+	/** Number of times a message was sent using an already serialized line
+	 */
+	unsigned long SerializeHits;
+	/** Number of times a message had to be serialized before it could be sent
+	 */
+	unsigned long SerializeMisses;
 #ifdef _WIN32
 	/** Cpu usage at last sample
 	*/
@@ -173,11 +180,141 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0),
+		SerializeHits(0), SerializeMisses(0)
 	{
 	}
 };
 
+/** Statistics about how long each phase of the main loop takes, and tracing of
+ * iterations which took longer than \<performance:slowloop>.
+ */
+class CoreExport MainLoopStats
+{
+ public:
+	/** The phases of an iteration of the main loop, in the order they run. */
+	enum Phase
+	{
+		/** Running timers and other once a second tasks. */
+		PHASE_TIMERS,
+
+		/** Dispatching trial reads and writes. */
+		PHASE_WRITES,
+
+		/** Waiting for socket events. This does not count towards the busy time. */
+		PHASE_WAIT,
+
+		/** Dispatching socket events. */
+		PHASE_EVENTS,
+
+		/** Deleting culled objects and running queued actions. */
+		PHASE_CLEANUP,
+
+		PHASE_END
+	};
+
+	/** Times the dispatch of an event to a socket handler when tracing slow iterations. */
+	class CoreExport EventTimer
+	{
+	 private:
+		/** The handler the event is being dispatched to. */
+		EventHandler* const handler;
+
+		/** The file descriptor of the handler. */
+		const int fd;
+
+		/** The time the dispatch started at or 0 if it is not being timed. */
+		const uint64_t start;
+
+	 public:
+		EventTimer(EventHandler* eh);
+		~EventTimer();
+	};
+
+	/** Times the execution of a command by a local user when tracing slow iterations. */
+	class CoreExport CommandTimer
+	{
+	 private:
+		/** The user who is executing the command. */
+		LocalUser* const user;
+
+		/** The command which is being executed. */
+		Command* const command;
+
+		/** The time the command started at or 0 if it is not being timed. */
+		const uint64_t start;
+
+	 public:
+		CommandTimer(LocalUser* u, Command* cmd);
+		~CommandTimer();
+	};
+
+	/** The duration of each phase of the main loop. */
+	DurationStats phases[PHASE_END];
+
+	/** The duration of each iteration of the main loop excluding the time spent waiting for events. */
+	DurationStats busy;
+
+	/** The number of socket events dispatched by each iteration of the main loop. Despite the
+	 * name of the type these are counts rather than nanoseconds.
+	 */
+	DurationStats events;
+
+	/** The busy time in nanoseconds above which an iteration is logged, or 0 to disable tracing. */
+	uint64_t slowthreshold;
+
+	/** The number of iterations which have exceeded the slow threshold. */
+	unsigned long slowcount;
+
+	/** A description of the last iteration which exceeded the slow threshold. */
+	std::string lastslow;
+
+	/** The time at which the last slow iteration happened. */
+	time_t lastslowtime;
+
+	MainLoopStats();
+
+	/** Starts timing a new iteration of the main loop. */
+	void StartIteration();
+
+	/** Ends the current phase of the main loop and starts timing another one.
+	 * @param phase The phase which is starting.
+	 */
+	void EnterPhase(Phase phase);
+
+	/** Finishes timing the current iteration of the main loop and logs it if it was slow.
+	 * @param eventcount The number of socket events which were dispatched.
+	 */
+	void EndIteration(int eventcount);
+
+	/** Retrieves the name of a phase of the main loop.
+	 * @param phase The phase to get the name of.
+	 */
+	static const char* GetPhaseName(Phase phase);
+
+ private:
+	/** The phase of the main loop which is currently running. */
+	Phase current;
+
+	/** The time at which the current phase started. */
+	uint64_t phasestart;
+
+	/** The time spent in each phase during the current iteration. */
+	uint64_t iteration[PHASE_END];
+
+	/** The time taken by the slowest event handler in the current iteration. */
+	uint64_t slowevent;
+
+	/** A description of the slowest event handler in the current iteration. */
+	std::string sloweventdesc;
+
+	/** The time taken by the slowest command in the current iteration. */
+	uint64_t slowcommand;
+
+	/** A description of the slowest command in the current iteration. */
+	std::string slowcommanddesc;
+};
+
 /** The main class of the irc server.
  * This class contains instances of all the other classes in this software.
  * Amongst other things, it contains a ModeParser, a DNS object, a CommandParser
@@ -268,6 +405,10 @@ class CoreExport InspIRCd
 	 */
 	serverstats stats;
 
+	/** Timing statistics for the main loop
+	 */
+	MainLoopStats LoopStats;
+
 	/**  Server Config class, holds configuration file data
 	 */
 	ServerConfig* Config;
@@ -323,6 +464,11 @@ class CoreExport InspIRCd
 	/** Update the current time. Don't call this unless you have reason to do so. */
 	void UpdateTime();
 
+	/** Get the value of a monotonic clock in nanoseconds. This is not related to
+	 * the current time and is only useful for measuring how long something takes.
+	 */
+	static uint64_t MonotonicTime();
+
 	/** Generate a random string with the given length
 	 * @param length The length in bytes
 	 * @param printable if false, the string will use characters 0-255; otherwise,
@@ -119,14 +119,107 @@ class CoreExport StreamSocket : public EventHandler
 	class SendQueue
 	{
 	 public:
-		/** One element of the queue, a continuous buffer
+		/** An immutable buffer which can be queued on any number of sockets at the same time.
+		 * Queues reference it instead of copying it; it is freed when the last queue which
+		 * references it has sent it.
 		 */
-		typedef std::string Element;
+		class SharedBuffer : public refcountbase
+		{
+			/** The contents of the buffer. */
+			std::string buffer;
+
+		 public:
+			/** Create a new shared buffer from the contents of a string.
+			 * @param data Data to put into the buffer. The string is left empty as its contents
+			 * are moved into the buffer instead of being copied.
+			 */
+			SharedBuffer(std::string& data)
+			{
+				buffer.swap(data);
+			}
+
+			/** Get the contents of the buffer.
+			 * @return The data in the buffer.
+			 */
+			const std::string& GetData() const { return buffer; }
+		};
+
+		/** One element of the queue, a continuous buffer which is either owned by
+		 * the queue or shared with the queues of other sockets.
+		 */
+		class Element
+		{
+		 public:
+			typedef std::string::size_type size_type;
+			typedef const char* const_iterator;
+
+			Element()
+				: offset(0)
+			{
+			}
+
+			Element(const std::string& newdata)
+				: owned(newdata)
+				, offset(0)
+			{
+			}
+
+			Element(const char* newdata, size_type len)
+				: owned(newdata, len)
+				, offset(0)
+			{
+			}
+
+			Element(const reference<SharedBuffer>& newdata)
+				: shared(newdata)
+				, offset(0)
+			{
+			}
+
+			/** Get a pointer to the data in this buffer which has not been sent yet. */
+			const char* data() const { return (shared ? shared->GetData().data() + offset : owned.data()); }
+
+			/** Get the number of bytes in this buffer which have not been sent yet. */
+			size_type length() const { return (shared ? shared->GetData().length() - offset : owned.length()); }
+			size_type size() const { return length(); }
+
+			/** Check whether all of the data in this buffer has been sent. */
+			bool empty() const { return (length() == 0); }
+
+			const_iterator begin() const { return data(); }
+			const_iterator end() const { return data() + length(); }
+
+		 private:
+			friend class SendQueue;
+
+			/** Remove bytes from the beginning of the buffer
+			 * @param n Number of bytes to remove
+			 */
+			void erase_front(size_type n)
+			{
+				if (shared)
+					offset += n;
+				else
+					owned.erase(0, n);
+			}
+
+			/** The data of this buffer if it is shared with other queues or NULL if it isn't. */
+			reference<SharedBuffer> shared;
+
+			/** The data of this buffer if it is not shared. */
+			std::string owned;
+
+			/** The number of bytes at the start of the shared data which have already been sent. */
+			size_type offset;
+		};
 
 		/** Sequence container of buffers in the queue
 		 */
 		typedef std::deque<Element> Container;
 
+		/** The size up to which copied data is appended to the last buffer in the queue. */
+		static const size_t COALESCE_SIZE = 4096;
+
 		/** Container iterator
 		 */
 		typedef Container::const_iterator const_iterator;
@@ -179,7 +272,7 @@ class CoreExport StreamSocket : public EventHandler
 		void erase_front(Element::size_type n)
 		{
 			nbytes -= n;
-			data.front().erase(0, n);
+			data.front().erase_front(n);
 		}
 
 		/** Insert a new buffer at the beginning of the queue
@@ -200,6 +293,19 @@ class CoreExport StreamSocket : public EventHandler
 			nbytes += newdata.length();
 		}
 
+		/** Insert a copy of a string at the end of the queue. If the last buffer in the queue
+		 * is owned by it and is small the data is appended to that instead so that many short
+		 * writes are sent using a few buffers rather than one each.
+		 * @param newdata Data to add
+		 */
+		void push_back(const std::string& newdata)
+		{
+			if ((data.empty()) || (data.back().shared) || (data.back().owned.length() + newdata.length() > COALESCE_SIZE))
+				data.push_back(Element());
+			data.back().owned.append(newdata);
+			nbytes += newdata.length();
+		}
+
 		/** Clear the queue
 		 */
 		void clear()
@@ -216,7 +322,7 @@ class CoreExport StreamSocket : public EventHandler
 		}
 
 	 private:
-		/** Private send queue. Note that individual strings may be shared.
+		/** Private send queue. Note that individual buffers may be shared.
 		 */
 		Container data;
 
@@ -340,6 +446,11 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+
+	/** Send a buffer which is shared with other sockets out the socket, either now or when
+	 * writes unblock. The buffer is referenced by the send queue instead of being copied.
+	 */
+	void WriteData(const reference<SendQueue::SharedBuffer>& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
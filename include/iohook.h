@@ -31,7 +31,8 @@ class IOHookProvider : public refcountbase, public ServiceProvider
 	enum Type
 	{
 		IOH_UNKNOWN,
-		IOH_SSL
+		IOH_SSL,
+		IOH_COMPRESSION
 	};
 
 	const Type type;
@@ -147,6 +148,12 @@ class IOHookMiddle : public IOHook
 	 */
 	const StreamSocket::SendQueue& GetSendQ() const { return sendq; }
 
+	/** Determines whether this hook still has data from an earlier read which it has not
+	 * passed up the chain yet. If it does then it is called again before anything more is
+	 * read from the hooks below it.
+	 */
+	virtual bool HasPendingRead() const { return false; }
+
 	/** Get the next IOHook in the chain
 	 * @return Next hook in the chain or NULL if this is the last hook
 	 */
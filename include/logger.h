@@ -36,6 +36,8 @@ enum LogLevel
 	LOG_NONE    = 50
 };
 
+class LogWriterThread;
+
 /** Simple wrapper providing periodic flushing to a disk-backed file.
  */
 class CoreExport FileWriter
@@ -54,10 +56,19 @@ class CoreExport FileWriter
 	 */
 	unsigned int writeops;
 
+	/** The thread which writes to the log file in the background or NULL if
+	 * lines are written to the log file as soon as they are logged.
+	 */
+	LogWriterThread* writer;
+
  public:
 	/** The constructor takes an already opened logfile.
+	 * @param logfile The file to write to.
+	 * @param flushcount The number of write operations after which the file is flushed.
+	 * @param background Whether to write to the file on a background thread so that
+	 * a slow disk does not block the main loop.
 	 */
-	FileWriter(FILE* logfile, unsigned int flushcount);
+	FileWriter(FILE* logfile, unsigned int flushcount, bool background = false);
 
 	/** Write one or more preformatted log lines.
 	 * If the data cannot be written immediately,
@@ -112,7 +123,12 @@ class CoreExport LogStream : public classbase
 	/** Changes the loglevel for this LogStream on-the-fly.
 	 * This is needed for -nofork. But other LogStreams could use it to change loglevels.
 	 */
-	void ChangeLevel(LogLevel lvl) { this->loglvl = lvl; }
+	void ChangeLevel(LogLevel lvl);
+
+	/** Gets the lowest level of messages this LogStream wants to receive.
+	 * Messages below the level of every LogStream are discarded before they are formatted.
+	 */
+	LogLevel GetLevel() const { return loglvl; }
 
 	/** Called when there is stuff to log for this particular logstream. The derived class may take no action with it, or do what it
 	 * wants with the output, basically. loglevel and type are primarily for informational purposes (the level and type of the event triggered)
@@ -147,6 +163,26 @@ class CoreExport LogManager : public fakederef<LogManager>
 	 */
 	FileLogMap FileLogs;
 
+	/** The lowest level of messages which any LogStream wants to receive.
+	 */
+	LogLevel MinLevel;
+
+	/** The lowest level of messages which any LogStream wants to receive for a type
+	 * which is not in TypeLevels.
+	 */
+	LogLevel DefaultTypeLevel;
+
+	/** The lowest level of messages which any LogStream wants to receive for each type
+	 * which has its own LogStreams or is excluded from a LogStream for all types. This
+	 * is only changed by UpdateLevels() so that logging from other threads (e.g. the
+	 * config reader thread) never modifies it.
+	 */
+	std::map<std::string, LogLevel> TypeLevels;
+
+	/** Gets the lowest level of messages which any LogStream wants to receive for a type.
+	 */
+	LogLevel GetTypeLevel(const std::string& type) const;
+
  public:
 	LogManager();
 	~LogManager();
@@ -217,6 +253,26 @@ class CoreExport LogManager : public fakederef<LogManager>
 	 */
 	bool DelLogType(const std::string &type, LogStream *l);
 
+	/** Recalculates which messages are wanted by any LogStream.
+	 * This is called automatically when a LogStream is added, removed or changes its level.
+	 */
+	void UpdateLevels();
+
+	/** Determines whether any LogStream wants to receive messages of a type at a level.
+	 * This is cheap enough to call before building a message which is expensive to build.
+	 * @param type Log message type (ex: "USERINPUT", "MODULE", ...)
+	 * @param loglevel Log message level (LOG_DEBUG, LOG_VERBOSE, LOG_DEFAULT, LOG_SPARSE, LOG_NONE)
+	 * @return True if a message of this type and level would be logged; otherwise, false.
+	 */
+	bool IsEnabled(const std::string& type, LogLevel loglevel) const
+	{
+		if (loglevel < MinLevel)
+			return false;
+
+		std::map<std::string, LogLevel>::const_iterator i = TypeLevels.find(type);
+		return loglevel >= (i == TypeLevels.end() ? DefaultTypeLevel : i->second);
+	}
+
 	/** Logs an event, sending it to all LogStreams registered for the type.
 	 * @param type Log message type (ex: "USERINPUT", "MODULE", ...)
 	 * @param loglevel Log message level (LOG_DEBUG, LOG_VERBOSE, LOG_DEFAULT, LOG_SPARSE, LOG_NONE)
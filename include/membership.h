@@ -34,6 +34,16 @@
  */
 class CoreExport Membership : public Extensible, public insp::intrusive_list_node<Membership>
 {
+	/** The index of this member in Channel::localusers if the user is local.
+	 */
+	size_t localpos;
+
+	/** Updates the rank stored in Channel::localusers after the prefix modes of this member changed.
+	 */
+	void UpdateLocalRank();
+
+	friend class Channel;
+
  public:
 	/** Type of the Membership id
 	 */
@@ -71,7 +81,7 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 * Call Channel::JoinUser() or ForceJoin() to make a user join a channel instead of constructing
 	 * Membership objects directly.
 	 */
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c) : localpos(0), user(u), chan(c) {}
 
 	/** Check if this member has a given prefix mode set
 	 * @param pm Prefix mode to check
@@ -140,6 +140,7 @@ class ModResult
 		_next = _i+1; \
 		try \
 		{ \
+			HookProfiler _profiler(*_i, I_ ## y); \
 			if (!(*_i)->dying) \
 				(*_i)->y x ; \
 		} \
@@ -164,6 +165,7 @@ do { \
 		_next = _i+1; \
 		try \
 		{ \
+			HookProfiler _profiler(*_i, I_ ## n); \
 			if (!(*_i)->dying) \
 				v = (*_i)->n args;
 
@@ -293,6 +295,7 @@ enum Implementation
 	I_OnUserKick,
 	I_OnUserMessage,
 	I_OnUserMessageBlocked,
+	I_OnUserOutputReady,
 	I_OnUserPart,
 	I_OnUserPostInit,
 	I_OnUserPostMessage,
@@ -309,6 +312,39 @@ enum Implementation
 	I_END
 };
 
+/** Statistics about how long something (e.g. a module handling an event) takes.
+ */
+struct CoreExport DurationStats
+{
+	/** The number of buckets in the histogram of durations. */
+	static const size_t BUCKETS = 32;
+
+	/** The number of durations which have been recorded. */
+	unsigned long calls;
+
+	/** The sum of all recorded durations in nanoseconds. */
+	uint64_t totaltime;
+
+	/** The longest recorded duration in nanoseconds. */
+	uint64_t maxtime;
+
+	/** Bucket N counts the durations which were at least 2^N but less than 2^(N+1) nanoseconds. */
+	unsigned long histogram[BUCKETS];
+
+	DurationStats();
+
+	/** Records a duration.
+	 * @param duration The duration in nanoseconds.
+	 */
+	void Add(uint64_t duration);
+
+	/** Estimates a percentile of the recorded durations from the histogram.
+	 * @param percent The percentile to estimate (e.g. 99).
+	 * @return The upper bound of the histogram bucket which contains the percentile in nanoseconds.
+	 */
+	uint64_t GetPercentile(unsigned int percent) const;
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -338,6 +374,12 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Timing statistics for each event this module handles, indexed by Implementation,
+	 * or NULL if hook profiling (\<performance:profilehooks>) has never been enabled
+	 * while this module was loaded.
+	 */
+	DurationStats* hookstats;
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -1037,6 +1079,14 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual ModResult OnUserWrite(LocalUser* user, ClientProtocol::Message& msg);
 
+	/** Called when the sendq of a local user who has LocalUser::outputpending set has drained
+	 * below its soft limit. This allows modules to send large replies in parts instead of
+	 * queueing all of them at once. The flag is cleared before this is called so a module
+	 * which has more to send must set it again.
+	 * @param user The user who can be sent more output.
+	 */
+	virtual void OnUserOutputReady(LocalUser* user);
+
 	/** Called when a user connection has been unexpectedly disconnected.
 	 * @param user The user who has been unexpectedly disconnected.
 	 * @param error The type of error which caused this connection failure.
@@ -1099,6 +1149,17 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	 */
 	Module::List EventHandlers[I_END];
 
+	/** Whether to record how long modules take to handle events. This is set
+	 * from \<performance:profilehooks> and read by HookProfiler.
+	 */
+	static bool ProfileHooks;
+
+	/** Get the name of an event.
+	 * @param event The event to get the name of.
+	 * @return The name of the event without the I_ prefix (e.g. "OnUserJoin").
+	 */
+	static const char* GetEventName(Implementation event);
+
 	/** List of data services keyed by name */
 	DataProviderMap DataProviders;
 
@@ -1272,3 +1333,39 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	 */
 	void DelReferent(ServiceProvider* service);
 };
+
+/** Records how long a module takes to handle an event when hook profiling is
+ * enabled. This is used by FOREACH_MOD and friends and has next to no cost
+ * when profiling is disabled.
+ */
+class CoreExport HookProfiler
+{
+	/** The module which is handling the event. */
+	Module* const mod;
+
+	/** The event which is being handled. */
+	const Implementation event;
+
+	/** The time at which the module started handling the event or 0 if not profiling. */
+	const uint64_t start;
+
+	/** Retrieves the time at which the module started handling the event. */
+	static uint64_t Begin();
+
+	/** Records the time the module took to handle the event. */
+	void End();
+
+ public:
+	HookProfiler(Module* m, Implementation i)
+		: mod(m)
+		, event(i)
+		, start(ModuleManager::ProfileHooks ? Begin() : 0)
+	{
+	}
+
+	~HookProfiler()
+	{
+		if (start)
+			End();
+	}
+};
@@ -0,0 +1,122 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "iohook.h"
+
+/** An IOHook which compresses the data sent over a socket and decompresses the data received from it.
+ *
+ * Hooks of this type start out passing all data through unchanged so that the two sides of the
+ * connection can agree to use compression in plain text. Each direction is switched over on its
+ * own: StartCompressing() makes the hook compress everything written after the data which is
+ * already queued and StartDecompressing() makes it decompress everything read from a given
+ * position in the receive queue onwards.
+ */
+class CompressIOHook : public IOHookMiddle
+{
+ public:
+	/** Counters for the data which has passed through a compression hook. */
+	struct Stats
+	{
+		/** The number of bytes which were compressed. */
+		uint64_t rawout;
+
+		/** The number of bytes the compressed data took up. */
+		uint64_t compressedout;
+
+		/** The time spent compressing data, in nanoseconds. */
+		uint64_t compresstime;
+
+		/** The number of bytes which were decompressed. */
+		uint64_t compressedin;
+
+		/** The number of bytes the decompressed data took up. */
+		uint64_t rawin;
+
+		/** The time spent decompressing data, in nanoseconds. */
+		uint64_t decompresstime;
+
+		Stats()
+			: rawout(0)
+			, compressedout(0)
+			, compresstime(0)
+			, compressedin(0)
+			, rawin(0)
+			, decompresstime(0)
+		{
+		}
+	};
+
+ protected:
+	/** Whether data written to the socket is being compressed. */
+	bool compressing;
+
+	/** Whether data read from the socket is being decompressed. */
+	bool decompressing;
+
+	/** Counters for the data which has passed through this hook. */
+	Stats stats;
+
+ public:
+	CompressIOHook(IOHookProvider* hookprov)
+		: IOHookMiddle(hookprov)
+		, compressing(false)
+		, decompressing(false)
+	{
+	}
+
+	/** Find the compression hook of a socket.
+	 * @param sock The socket to look at.
+	 * @return The compression hook of the socket or NULL if it does not have one.
+	 */
+	static CompressIOHook* Get(StreamSocket* sock)
+	{
+		for (IOHook* hook = sock->GetIOHook(); hook; )
+		{
+			if (hook->prov->type == IOHookProvider::IOH_COMPRESSION)
+				return static_cast<CompressIOHook*>(hook);
+
+			IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
+			hook = iohm ? iohm->GetNextHook() : NULL;
+		}
+		return NULL;
+	}
+
+	/** Retrieves the counters for the data which has passed through this hook. */
+	const Stats& GetStats() const { return stats; }
+
+	/** Determines whether data written to the socket is being compressed. */
+	bool IsCompressing() const { return compressing; }
+
+	/** Determines whether data read from the socket is being decompressed. */
+	bool IsDecompressing() const { return decompressing; }
+
+	/** Compress everything written to the socket after the data which is currently in its send queue.
+	 * The hook must be the first hook of the socket.
+	 * @param sock The socket this hook is attached to.
+	 */
+	virtual void StartCompressing(StreamSocket* sock) = 0;
+
+	/** Decompress everything read from the socket starting at a position in its receive queue.
+	 * @param sock The socket this hook is attached to.
+	 * @param recvq The receive queue of the socket. Data after \p pos is replaced with its decompressed form.
+	 * @param pos The position in the receive queue at which the compressed data starts.
+	 * @return True if the data was decompressed successfully; otherwise, false.
+	 */
+	virtual bool StartDecompressing(StreamSocket* sock, std::string& recvq, std::string::size_type pos) = 0;
+};
@@ -74,4 +74,98 @@ class HashProvider : public DataProvider
 	{
 		return (!block_size);
 	}
+
+	/** Determines whether comparing a password against a hash of this type is slow enough
+	 * that it should be done in the background. Compare() of a provider which returns true
+	 * is called from a thread other than the main thread so it must not modify any state.
+	 */
+	virtual bool IsExpensive() const
+	{
+		return false;
+	}
+};
+
+/** Receives the result of a password comparison which is done by a PasswordCheckAPI. */
+class PasswordCheck : public classbase
+{
+ protected:
+	/** Creates a new password check.
+	 * @param Creator The module which is checking the password.
+	 */
+	PasswordCheck(Module* Creator)
+		: creator(Creator)
+	{
+	}
+
+ public:
+	/** The module which is checking the password. */
+	const ModuleRef creator;
+
+	virtual ~PasswordCheck()
+	{
+	}
+
+	/** Called on the main thread when the password has been compared. This may be called
+	 * before PasswordCheckAPI::Compare returns. The check is deleted once this returns.
+	 * @param match Whether the password matched.
+	 */
+	virtual void OnResult(bool match) = 0;
+};
+
+class PasswordCheckAPIBase : public DataProvider
+{
+ public:
+	PasswordCheckAPIBase(Module* parent)
+		: DataProvider(parent, "m_password_hash_api")
+	{
+	}
+
+	/** Determines whether a password of the given hash type is compared in the background by
+	 * Compare. Passwords which are not are compared before Compare returns.
+	 * @param hashtype The hash type of the password from the server config.
+	 * @return True if the password is compared in the background; otherwise, false.
+	 */
+	virtual bool IsBackground(const std::string& hashtype) = 0;
+
+	/** Compares a password in the same way as InspIRCd::PassCompare but hashes which are
+	 * expensive to compute are compared in the background.
+	 * @param check The object which receives the result. Ownership is taken by the API.
+	 * @param ex The object the password is being checked for.
+	 * @param data The password from the server config.
+	 * @param input The password which was provided.
+	 * @param hashtype The hash type of the password from the server config.
+	 */
+	virtual void Compare(PasswordCheck* check, Extensible* ex, const std::string& data, const std::string& input, const std::string& hashtype) = 0;
+};
+
+/** Allows modules to compare passwords without blocking the main thread while an expensive
+ * hash is computed. If the password_hash module is not loaded passwords are compared on the
+ * main thread instead.
+ */
+class PasswordCheckAPI : public dynamic_reference_nocheck<PasswordCheckAPIBase>
+{
+ public:
+	PasswordCheckAPI(Module* parent)
+		: dynamic_reference_nocheck<PasswordCheckAPIBase>(parent, "m_password_hash_api")
+	{
+	}
+
+	/** @copydoc PasswordCheckAPIBase::IsBackground */
+	bool IsBackground(const std::string& hashtype)
+	{
+		return *this && (*this)->IsBackground(hashtype);
+	}
+
+	/** @copydoc PasswordCheckAPIBase::Compare */
+	void Compare(PasswordCheck* check, Extensible* ex, const std::string& data, const std::string& input, const std::string& hashtype)
+	{
+		if (*this)
+		{
+			(*this)->Compare(check, ex, data, input, hashtype);
+			return;
+		}
+
+		check->OnResult(ServerInstance->PassCompare(ex, data, input, hashtype));
+		delete check;
+	}
 };
@@ -48,12 +48,35 @@ public:
 	}
 };
 
+/** A set of regular expressions which can all be matched against some text in a single pass. */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Finds the regular expressions in the set which match some text.
+	 * @param text The text to match against.
+	 * @param matches The location to store the indices of the matching expressions in. These
+	 * are indices into the list the set was created from and are stored in ascending order.
+	 * @return True if the text was checked; false if the set could not check the text and
+	 * the caller must check each expression individually instead.
+	 */
+	virtual bool Matches(const std::string& text, std::vector<size_t>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Compiles a list of regular expressions into a set which can match them all in one pass.
+	 * Engines which can not do this do not need to override this method.
+	 * @param exprs The regular expressions to compile.
+	 * @return A new RegexSet or NULL if this engine does not support matching sets.
+	 */
+	virtual RegexSet* CreateSet(const std::vector<std::string>& exprs) { return NULL; }
 };
 
 class RegexException : public ModuleException
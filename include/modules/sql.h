@@ -238,6 +238,7 @@ class SQL::Provider : public DataProvider
  public:
 	Provider(Module* Creator, const std::string& Name)
 		: DataProvider(Creator, "SQL/" + Name)
+		, dbid(Name)
 	{
 	}
 
@@ -202,7 +202,8 @@ class SSLIOHook : public IOHook
 		tmp.reserve(std::min(targetsize, sendq.bytes())+1);
 		do
 		{
-			tmp.append(sendq.front());
+			const StreamSocket::SendQueue::Element& elem = sendq.front();
+			tmp.append(elem.data(), elem.length());
 			sendq.pop_front();
 		}
 		while (!sendq.empty() && tmp.length() < targetsize);
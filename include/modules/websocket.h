@@ -0,0 +1,70 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace WebSocket
+{
+	class Compressor;
+	class CompressorProvider;
+}
+
+/** The compression state of a WebSocket connection which has negotiated the
+ * permessage-deflate extension (RFC 7692).
+ */
+class WebSocket::Compressor : public classbase
+{
+ public:
+	virtual ~Compressor() { }
+
+	/** Compresses a message.
+	 * @param message The message to compress.
+	 * @param out The location to store the compressed payload in.
+	 * @return True if the message was compressed; otherwise, false.
+	 */
+	virtual bool Compress(const std::string& message, std::string& out) = 0;
+
+	/** Decompresses part of a compressed message.
+	 * @param data The compressed data.
+	 * @param len The length of the compressed data.
+	 * @param last Whether this is the end of the message.
+	 * @param maxlen The maximum number of bytes to append to \p out. Decompression stops
+	 * soon after the output passes this so a small input can not inflate without bound.
+	 * @param out The location to append the decompressed data to.
+	 * @return True if the data was decompressed and fit within \p maxlen; otherwise, false.
+	 */
+	virtual bool Decompress(const char* data, size_t len, bool last, size_t maxlen, std::string& out) = 0;
+};
+
+/** Provides the compression state for WebSocket connections. The WebSocket module
+ * looks this up when a client offers the permessage-deflate extension.
+ */
+class WebSocket::CompressorProvider : public DataProvider
+{
+ public:
+	CompressorProvider(Module* mod)
+		: DataProvider(mod, "websocket/permessage-deflate")
+	{
+	}
+
+	/** Picks the first permessage-deflate offer that can be accepted.
+	 * @param offers The value of the Sec-WebSocket-Extensions header sent by the client.
+	 * @param response The location to store the accepted extension and its parameters in.
+	 * @return The compression state for the accepted offer or NULL if no offer was accepted.
+	 */
+	virtual Compressor* Negotiate(const std::string& offers, std::string& response) = 0;
+};
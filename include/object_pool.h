@@ -0,0 +1,118 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace insp
+{
+	class object_pool;
+}
+
+/** Hands out storage for objects of a fixed size. Storage is allocated from the heap in
+ * blocks of many objects and storage which is freed is kept for reuse instead of being
+ * returned to the heap, so creating and destroying lots of objects at once does not
+ * fragment the heap. The most recently freed storage is reused first as it is the most
+ * likely to still be in the cache.
+ */
+class insp::object_pool
+{
+ public:
+	/** Creates a new object pool.
+	 * @param size The size of the objects in the pool.
+	 * @param count The number of objects to allocate storage for at once.
+	 */
+	object_pool(size_t size, size_t count = 64)
+		: objsize(size)
+		, slotsize((size + sizeof(slot_align) - 1) / sizeof(slot_align) * sizeof(slot_align))
+		, blocksize(count)
+	{
+	}
+
+	~object_pool()
+	{
+		for (std::vector<slot_align*>::const_iterator i = blocks.begin(); i != blocks.end(); ++i)
+			delete[] *i;
+	}
+
+	/** Allocates storage for an object.
+	 * @return Uninitialised storage which is large enough for an object of the pool's size.
+	 */
+	void* allocate()
+	{
+		if (unused.empty())
+		{
+			slot_align* const block = new slot_align[slotsize / sizeof(slot_align) * blocksize];
+			blocks.push_back(block);
+
+			char* const start = reinterpret_cast<char*>(block);
+			for (size_t i = blocksize; i-- > 0; )
+				unused.push_back(start + i * slotsize);
+		}
+
+		void* const storage = unused.back();
+		unused.pop_back();
+		return storage;
+	}
+
+	/** Returns storage for an object to the pool. The object must already have been destroyed.
+	 * @param storage Storage which was previously returned by allocate().
+	 */
+	void deallocate(void* storage)
+	{
+		unused.push_back(storage);
+	}
+
+	/** Retrieves the size of the objects in the pool. */
+	size_t object_size() const { return objsize; }
+
+	/** Retrieves the number of objects the pool currently has storage for. */
+	size_t capacity() const { return blocks.size() * blocksize; }
+
+	/** Retrieves the number of objects which are currently using storage from the pool. */
+	size_t used() const { return capacity() - unused.size(); }
+
+	/** Retrieves the number of bytes the pool has allocated from the heap. */
+	size_t heap_size() const { return blocks.size() * blocksize * slotsize; }
+
+ private:
+	/** A type with the strictest alignment an object in the pool can need. */
+	union slot_align
+	{
+		long double ld;
+		void* ptr;
+		uint64_t u64;
+	};
+
+	/** The size of the objects in the pool. */
+	const size_t objsize;
+
+	/** The size of the storage for each object, rounded up to keep every object aligned. */
+	const size_t slotsize;
+
+	/** The number of objects to allocate storage for at once. */
+	const size_t blocksize;
+
+	/** Blocks of storage which have been allocated from the heap. */
+	std::vector<slot_align*> blocks;
+
+	/** Storage which is not currently in use. */
+	std::vector<void*> unused;
+
+	// Pools own their storage so they can not be copied.
+	object_pool(const object_pool&);
+	object_pool& operator=(const object_pool&);
+};
@@ -287,6 +287,12 @@ class CoreExport SocketEngine
 	 */
 	static std::set<int> trials;
 
+	/** Get the number of milliseconds that DispatchEvents() should wait for events. This is zero
+	 * if a trial read or write was requested after the trials were last dispatched as they will
+	 * not be attempted until the wait has finished.
+	 */
+	static int GetWaitTimeout() { return trials.empty() ? 1000 : 0; }
+
 	/** Socket engine statistics: count of various events, bandwidth usage
 	 */
 	static Statistics stats;
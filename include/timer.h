@@ -38,8 +38,10 @@ class Module;
  * your object (which you have to override) will be called
  * at the given time.
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
+	friend class TimerManager;
+
 	/** The triggering time
 	 */
 	time_t trigger;
@@ -52,6 +54,10 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** The timer wheel slot this timer is queued in or NULL if it is not queued.
+	 */
+	insp::intrusive_list<Timer>* slot;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -122,19 +128,41 @@ class CoreExport Timer
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+	typedef insp::intrusive_list<Timer> TimerList;
+
+	/** The number of slots in the timer wheel. Timers which trigger further in
+	 * the future than this many seconds are skipped over until their time comes.
+	 */
+	static const size_t WHEEL_SIZE = 1024;
+
+	/** Pending timers, hashed by their trigger time into one slot per second.
+	 */
+	TimerList wheel[WHEEL_SIZE];
+
+	/** Timers which have been taken out of a slot by TickTimers() and not checked yet.
+	 */
+	TimerList ticking;
 
-	/** A list of all pending timers
+	/** The time that timers were last ticked for.
 	 */
-	TimerMap Timers;
+	time_t lasttick;
+
+	/** Checks the timers in a slot of the wheel, ticking the ones that are due.
+	 * @param list The slot to check.
+	 * @param TIME The current system time.
+	 */
+	void TickSlot(TimerList& list, time_t TIME);
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
 	void TickTimers(time_t TIME);
 
 	/** Add an Timer
+	 * If the timer is already queued then it is moved to its new trigger time.
 	 * @param T an Timer derived class to add
 	 */
 	void AddTimer(Timer *T);
@@ -100,11 +100,6 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	unsigned int unregistered_count;
 
-	/** Perform background user events for all local users such as PING checks, registration timeouts,
-	 * penalty management and recvq processing for users who have data in their recvq due to throttling.
-	 */
-	void DoBackgroundUserStuff();
-
 	/** Handle a client connection.
 	 * Creates a new LocalUser object, inserts it into the appropriate containers,
 	 * initializes it as not yet registered, and adds it to the socket engine.
@@ -696,6 +696,23 @@ class CoreExport User : public Extensible
 	 */
 	void PurgeEmptyChannels();
 
+	/** Allocate storage for a user from the pool for users of the same size instead of the heap.
+	 * @param size The size of the concrete type of the user being created.
+	 * @return Storage for the user.
+	 */
+	static void* operator new(size_t size);
+
+	/** Return the storage of a user to the pool it was allocated from.
+	 * @param ptr The storage of the user.
+	 * @param size The size of the concrete type of the user.
+	 */
+	static void operator delete(void* ptr, size_t size);
+
+	/** Get the pools which users are allocated from, one for each size of user.
+	 * @return A reference to a list of user pools.
+	 */
+	static const std::vector<insp::object_pool*>& GetPools();
+
 	/** Default destructor
 	 */
 	virtual ~User();
@@ -712,6 +729,13 @@ class CoreExport UserIOHandler : public StreamSocket
 {
  private:
 	size_t checked_until;
+
+	/** Checks whether data of the given length can be added to the sendq of the user.
+	 * If it can't then the user is marked for quitting due to a sendq overflow.
+	 * @param length The number of bytes that are about to be added to the sendq.
+	 * @return True if the data can be added, false if it should be dropped.
+	 */
+	bool CheckSendQ(size_t length);
  public:
 	LocalUser* const user;
 	UserIOHandler(LocalUser* me)
@@ -721,6 +745,7 @@ class CoreExport UserIOHandler : public StreamSocket
 	{
 	}
 	void OnDataReady() CXX11_OVERRIDE;
+	void OnEventHandlerWrite() CXX11_OVERRIDE;
 	bool OnSetEndPoint(const irc::sockets::sockaddrs& local, const irc::sockets::sockaddrs& remote) CXX11_OVERRIDE;
 	void OnError(BufferedSocketError error) CXX11_OVERRIDE;
 
@@ -731,18 +756,45 @@ class CoreExport UserIOHandler : public StreamSocket
 	 */
 	void AddWriteBuf(const std::string &data);
 
+	/** Adds a buffer which is shared with other users to the user's write buffer.
+	 * The buffer is referenced by the write buffer instead of being copied into it.
+	 * The same sendq limits apply as for AddWriteBuf(const std::string&).
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SendQueue::SharedBuffer>& data);
+
 	/** Swaps the internals of this UserIOHandler with another one.
 	 * @param other A UserIOHandler to swap internals with.
 	 */
 	void SwapInternals(UserIOHandler& other);
 };
 
+/** Runs the timed checks of a local user such as flood penalty management,
+ * registration timeouts and PING checks. Instead of every user being checked
+ * once a second the timer is only queued for when the next check is due.
+ */
+class CoreExport UserTimer : public Timer
+{
+	/** The user this timer belongs to. */
+	LocalUser* const user;
+
+ public:
+	UserTimer(LocalUser* u);
+
+	/** Ensures that the user will be checked no later than the specified time.
+	 * @param when The time at which the user needs to be checked.
+	 */
+	void Schedule(time_t when);
+
+	bool Tick(time_t TIME) CXX11_OVERRIDE;
+};
+
 class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
 {
 	/** Add a serialized message to the send queue of the user.
-	 * @param serialized Bytes to add.
+	 * @param serialized Bytes to add. They are shared with every other recipient of the message.
 	 */
-	void Write(const ClientProtocol::SerializedMessage& serialized);
+	void Write(const reference<StreamSocket::SendQueue::SharedBuffer>& serialized);
 
 	/** Send a protocol event to the user, consisting of one or more messages.
 	 * @param protoev Event to send, may contain any number of messages.
@@ -820,6 +872,11 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	unsigned int exempt:1;
 
+	/** Whether a module is waiting for the sendq of this user to drain so it can send more
+	 * output. See Module::OnUserOutputReady.
+	 */
+	unsigned int outputpending:1;
+
 	/** The time at which this user should be pinged next. */
 	time_t nextping;
 
@@ -832,6 +889,9 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** Timer which runs the background checks for this user. */
+	UserTimer timer;
+
 	already_sent_t already_sent;
 
 	/** Check if the user matches a G- or K-line, and disconnect them if they do.
@@ -123,6 +123,14 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Retrieves the host part of the mask of this xline if it only ever
+	 * matches against the real host or IP address of a user. This is used
+	 * by the XLineManager to index lines so that it does not have to check
+	 * every line against every user.
+	 * @return The host part of the mask or NULL if this line can not be indexed.
+	 */
+	virtual const std::string* GetHostMask() { return NULL; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -189,6 +197,8 @@ class CoreExport KLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	bool IsBurstable() CXX11_OVERRIDE;
 
 	/** Ident mask (ident part only)
@@ -235,6 +245,8 @@ class CoreExport GLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -279,6 +291,8 @@ class CoreExport ELine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -320,6 +334,8 @@ class CoreExport ZLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -402,6 +418,148 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** XLineIndex holds a set of xlines arranged so that the lines which may match a user can
+ * be found without checking every line. Lines with a host mask which is an IP address or
+ * a CIDR range are stored by network prefix; a lookup only has to probe the prefix lengths
+ * which are in use. Lines with a glob host mask are stored by the literal text at the end
+ * (e.g. *.example.com) or, failing that, the start (e.g. 192.0.2.*) of the mask. All other
+ * lines are kept in a separate list which must be checked in full. The candidates found by
+ * the index must still be checked with XLine::Matches.
+ */
+class CoreExport XLineIndex
+{
+ public:
+	/** Orders xlines the same way as an XLineLookup so that when several lines match a
+	 * user the one that is picked does not depend on where the lines are stored. Lines
+	 * with the same mask are ordered by type as an index may hold more than one type.
+	 */
+	struct LookupOrder
+	{
+		bool operator()(XLine* one, XLine* two) const
+		{
+			irc::insensitive_swo compare;
+			if (compare(one->Displayable(), two->Displayable()))
+				return true;
+			if (compare(two->Displayable(), one->Displayable()))
+				return false;
+			if (one->type != two->type)
+				return one->type < two->type;
+			return one < two;
+		}
+	};
+
+	/** A list of xlines found by the index. */
+	typedef std::vector<XLine*> LineList;
+
+	/** A set of xlines which can not be indexed. */
+	typedef std::set<XLine*, LookupOrder> LineSet;
+
+ private:
+	typedef std::map<irc::sockets::cidr_mask, LineList> CIDRMap;
+	typedef insp::flat_map<unsigned char, size_t> PrefixCount;
+
+	/** The part of a host mask that a line is indexed by. */
+	enum LiteralType
+	{
+		/** The mask can not be indexed by its literal text. */
+		LITERAL_NONE,
+
+		/** The mask contains no wildcards. */
+		LITERAL_EXACT,
+
+		/** The mask starts with literal text. */
+		LITERAL_PREFIX,
+
+		/** The mask ends with literal text. */
+		LITERAL_SUFFIX
+	};
+
+	/** Lines indexed by a lowercase literal part of their host mask. */
+	struct LiteralMap
+	{
+		typedef TR1NS::unordered_map<std::string, LineList> LineMap;
+		typedef insp::flat_map<size_t, size_t> LengthCount;
+
+		/** The lines which are indexed, by literal text. */
+		LineMap lines;
+
+		/** The number of keys of each length in lines. */
+		LengthCount lengths;
+	};
+
+	/** Lines which are indexed by the network prefix of their host mask. */
+	CIDRMap cidrlines;
+
+	/** The number of IPv4 masks of each prefix length in cidrlines. */
+	PrefixCount v4prefixes;
+
+	/** The number of IPv6 masks of each prefix length in cidrlines. */
+	PrefixCount v6prefixes;
+
+	/** Lines with a host mask which contains no wildcards. */
+	LiteralMap exactlines;
+
+	/** Lines which are indexed by the literal start of their host mask. */
+	LiteralMap prefixlines;
+
+	/** Lines which are indexed by the literal end of their host mask. */
+	LiteralMap suffixlines;
+
+	/** Lines which can not be indexed. */
+	LineSet unindexed;
+
+	/** Retrieves the network prefix that an xline is indexed by.
+	 * @param line The xline to retrieve the network prefix of.
+	 * @param mask The location to store the network prefix in.
+	 * @return True if the line can be indexed by network prefix; otherwise, false.
+	 */
+	static bool GetCIDR(XLine* line, irc::sockets::cidr_mask& mask);
+
+	/** Retrieves the literal text that an xline is indexed by.
+	 * @param line The xline to retrieve the literal text of.
+	 * @param key The location to store the lowercase literal text in.
+	 * @return The part of the host mask that key was taken from.
+	 */
+	static LiteralType GetLiteral(XLine* line, std::string& key);
+
+	/** Retrieves the map that lines with the specified literal type are stored in. */
+	LiteralMap* GetLiteralMap(LiteralType type);
+
+	/** Retrieves the prefix counts for the specified address family. */
+	PrefixCount* GetPrefixCount(unsigned char family);
+
+	/** Adds the lines which are indexed under a prefix of the specified address to a list. */
+	void FindCIDR(const irc::sockets::sockaddrs& sa, LineList& out);
+
+	/** Adds the lines which are indexed under the literal text of the specified host to a list. */
+	void FindLiteral(const std::string& host, LineList& out);
+
+ public:
+	/** Adds an xline to the index.
+	 * @param line The xline to add.
+	 */
+	void Add(XLine* line);
+
+	/** Removes an xline from the index.
+	 * @param line The xline to remove.
+	 */
+	void Remove(XLine* line);
+
+	/** Removes all xlines from the index. */
+	void Clear();
+
+	/** Finds the indexed lines which may match a user. Lines which can not be indexed
+	 * are not included and should be retrieved with GetUnindexed() instead.
+	 * @param user The user to find lines for.
+	 * @param out The list to store the candidate lines in. Each line is only added once
+	 * and the lines that are added are sorted by LookupOrder.
+	 */
+	void Find(User* user, LineList& out);
+
+	/** Retrieves the lines which are not indexed. */
+	const LineSet& GetUnindexed() const { return unindexed; }
+};
+
 /** XLineManager is a class used to manage G-lines, K-lines, E-lines, Z-lines and Q-lines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -424,6 +582,17 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the lines in lookup_lines, by line type.
+	 */
+	std::map<std::string, XLineIndex> line_index;
+
+	/** Finds the lines of a type which may match a user.
+	 * @param type The type of line to look up.
+	 * @param user The user to look up lines for.
+	 * @param out The list to store the candidate lines in.
+	 */
+	void FindCandidates(const std::string& type, User* user, XLineIndex::LineList& out);
+
  public:
 
 	/** Constructor
@@ -31,13 +31,97 @@
 namespace
 {
 	ChanModeReference ban(NULL, "ban");
+
+	/** Hands out storage for Membership objects. Memberships are allocated in
+	 * blocks and reused once freed to avoid a heap allocation on every join.
+	 */
+	insp::object_pool membershippool(sizeof(Membership));
+
+	/** Indices of all channels which allow LIST to find channels without visiting every one. */
+	Channel::TimeIndex ageindex;
+	Channel::TimeIndex topicindex;
+	Channel::UserCountIndex usercountindex;
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: age(ts), name(cname), topicset(0)
 {
 	if (!ServerInstance->chanlist.insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
+
+	agepos = ageindex.insert(std::make_pair(age, this)).first;
+	topicpos = topicindex.end();
+
+	if (usercountindex.empty())
+		usercountindex.resize(1);
+	usercountgroup = 0;
+	usercountpos = usercountindex[0].size();
+	usercountindex[0].push_back(this);
+}
+
+void Channel::SetAge(time_t ts)
+{
+	if (age == ts)
+		return;
+
+	age = ts;
+	ageindex.erase(agepos);
+	agepos = ageindex.insert(std::make_pair(age, this)).first;
+}
+
+size_t Channel::GetUserCountGroup(size_t users)
+{
+	size_t group = 0;
+	for (size_t bound = users + 1; bound > 1; bound >>= 1)
+		group++;
+	return group;
+}
+
+void Channel::UpdateUserCountIndex()
+{
+	const size_t newgroup = GetUserCountGroup(userlist.size());
+	if (newgroup == usercountgroup)
+		return;
+
+	// Move the last channel in the group into the slot of the one being removed.
+	std::vector<Channel*>& oldchans = usercountindex[usercountgroup];
+	oldchans[usercountpos] = oldchans.back();
+	oldchans[usercountpos]->usercountpos = usercountpos;
+	oldchans.pop_back();
+
+	if (usercountindex.size() <= newgroup)
+		usercountindex.resize(newgroup + 1);
+	std::vector<Channel*>& newchans = usercountindex[newgroup];
+	usercountgroup = newgroup;
+	usercountpos = newchans.size();
+	newchans.push_back(this);
+}
+
+void Channel::RemoveFromIndices()
+{
+	ageindex.erase(agepos);
+	if (topicpos != topicindex.end())
+		topicindex.erase(topicpos);
+
+	std::vector<Channel*>& chans = usercountindex[usercountgroup];
+	chans[usercountpos] = chans.back();
+	chans[usercountpos]->usercountpos = usercountpos;
+	chans.pop_back();
+}
+
+const Channel::TimeIndex& Channel::GetAgeIndex()
+{
+	return ageindex;
+}
+
+const Channel::TimeIndex& Channel::GetTopicIndex()
+{
+	return topicindex;
+}
+
+const Channel::UserCountIndex& Channel::GetUserCountIndex()
+{
+	return usercountindex;
 }
 
 void Channel::SetMode(ModeHandler* mh, bool on)
@@ -60,18 +144,37 @@ void Channel::SetTopic(User* u, const std::string& ntopic, time_t topicts, const
 	if (!setter)
 		setter = ServerInstance->Config->FullHostInTopic ? &u->GetFullHost() : &u->nick;
 	this->setby.assign(*setter, 0, ServerInstance->Config->Limits.GetMaxMask());
+	if (topicpos != topicindex.end())
+		topicindex.erase(topicpos);
 	this->topicset = topicts;
+	topicpos = topicts ? topicindex.insert(std::make_pair(topicts, this)).first : topicindex.end();
 
 	FOREACH_MOD(OnPostTopicChange, (u, this, this->topic));
 }
 
+const insp::object_pool& Channel::GetMembershipPool()
+{
+	return membershippool;
+}
+
 Membership* Channel::AddUser(User* user)
 {
-	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, insp::aligned_storage<Membership>()));
+	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, static_cast<Membership*>(NULL)));
 	if (!ret.second)
 		return NULL;
 
-	Membership* memb = new(ret.first->second) Membership(user, this);
+	Membership* memb = new(membershippool.allocate()) Membership(user, this);
+	ret.first->second = memb;
+
+	LocalUser* localuser = IS_LOCAL(user);
+	if (localuser)
+	{
+		memb->localpos = localusers.size();
+		LocalMember member = { localuser, memb, 0 };
+		localusers.push_back(member);
+	}
+
+	UpdateUserCountIndex();
 	return memb;
 }
 
@@ -99,15 +202,26 @@ void Channel::CheckDestroy()
 
 	FOREACH_MOD(OnChannelDelete, (this));
 	ServerInstance->chanlist.erase(iter);
+	RemoveFromIndices();
 	ServerInstance->GlobalCulls.AddItem(this);
 }
 
 void Channel::DelUser(const MemberMap::iterator& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+	{
+		// Move the last local member into the slot of the one being removed.
+		localusers[memb->localpos] = localusers.back();
+		localusers[memb->localpos].memb->localpos = memb->localpos;
+		localusers.pop_back();
+	}
+
 	memb->cull();
 	memb->~Membership();
+	membershippool.deallocate(memb);
 	userlist.erase(membiter);
+	UpdateUserCountIndex();
 
 	// If this channel became empty then it should be removed
 	CheckDestroy();
@@ -426,17 +540,17 @@ void Channel::Write(ClientProtocol::Event& protoev, char status, const CUList& e
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
+	for (LocalMemberList::const_iterator i = localusers.begin(); i != localusers.end(); ++i)
 	{
-		LocalUser* user = IS_LOCAL(i->first);
-		if ((user) && (!except_list.count(user)))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
-				continue;
+		/* User doesn't have the status we're after */
+		if (i->rank < minrank)
+			continue;
 
-			user->Send(protoev);
-		}
+		LocalUser* user = i->user;
+		if (!except_list.empty() && except_list.count(user))
+			continue;
+
+		user->Send(protoev);
 	}
 }
 
@@ -542,6 +656,18 @@ unsigned int Channel::GetPrefixValue(User* user)
 	return m->second->getRank();
 }
 
+void Channel::UpdateLocalRanks()
+{
+	for (LocalMemberList::iterator i = localusers.begin(); i != localusers.end(); ++i)
+		i->rank = i->memb->getRank();
+}
+
+void Membership::UpdateLocalRank()
+{
+	if (IS_LOCAL(user))
+		chan->localusers[localpos].rank = getRank();
+}
+
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
 	char prefix = delta_mh->GetModeChar();
@@ -554,11 +680,15 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
+			UpdateLocalRank();
 			return adding != (mchar == prefix);
 		}
 	}
 	if (adding)
+	{
 		modes.push_back(prefix);
+		UpdateLocalRank();
+	}
 	return adding;
 }
 
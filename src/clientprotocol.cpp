@@ -59,7 +59,7 @@ ClientProtocol::TagSelection ClientProtocol::Serializer::MakeTagWhitelist(LocalU
 	return tagwl;
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
+const ClientProtocol::SharedSerializedMessage& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
 {
 	if (!msg.msginit_done)
 	{
@@ -69,19 +69,35 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeFo
 	return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
+const ClientProtocol::SharedSerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
 {
-	// First check if the serialized line they're asking for is in the cache
-	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
+	// Recipients with the same capabilities tend to come one after another so check the
+	// line that was handed out last before searching the cache.
+	if (lastserialized < serlist.size())
 	{
-		const SerializedInfo& curr = i->first;
-		if (curr == serializeinfo)
-			return i->second;
+		SerializedList::const_iterator last = serlist.begin() + lastserialized;
+		if (last->first == serializeinfo)
+		{
+			ServerInstance->stats.SerializeHits++;
+			return last->second;
+		}
+	}
+
+	// Check if the serialized line they're asking for is in the cache
+	SerializedList::const_iterator it = serlist.find(serializeinfo);
+	if (it != serlist.end())
+	{
+		ServerInstance->stats.SerializeHits++;
+		lastserialized = it - serlist.begin();
+		return it->second;
 	}
 
 	// Not cached, generate it and put it in the cache for later use
-	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
-	return serlist.back().second;
+	ServerInstance->stats.SerializeMisses++;
+	std::string serialized = serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl);
+	std::pair<SerializedList::iterator, bool> res = serlist.insert(std::make_pair(serializeinfo, SharedSerializedMessage(new StreamSocket::SendQueue::SharedBuffer(serialized))));
+	lastserialized = res.first - serlist.begin();
+	return res.first->second;
 }
 
 void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& messagelist)
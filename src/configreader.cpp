@@ -384,6 +384,8 @@ void ServerConfig::Fill()
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getUInt("somaxconn", SOMAXCONN);
 	TimeSkipWarn = ConfValue("performance")->getDuration("timeskipwarn", 2, 0, 30);
+	ModuleManager::ProfileHooks = ConfValue("performance")->getBool("profilehooks");
+	ServerInstance->LoopStats.slowthreshold = static_cast<uint64_t>(ConfValue("performance")->getUInt("slowloop", 0, 0, 60000)) * 1000000;
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = server->getString("description", "Configure Me", 1);
 	Network = server->getString("network", "Network", 1);
@@ -98,7 +98,7 @@ CmdResult CommandInvite::Handle(User* user, const Params& parameters)
 
 			// Drop the invite if our channel TS is lower
 			time_t RemoteTS = ConvToNum<time_t>(parameters[2]);
-			if (c->age < RemoteTS)
+			if (c->GetAge() < RemoteTS)
 				return CMD_FAILURE;
 		}
 
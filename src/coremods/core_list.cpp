@@ -26,9 +26,185 @@
 
 #include "inspircd.h"
 
+// The maximum number of channels to examine before giving other users a turn.
+static const size_t LIST_BATCH_SIZE = 1000;
+
+/** The state of a LIST request which is sent to a user in parts as their sendq drains.
+ */
+class ListCursor
+{
+ public:
+	/** Where the channels to list are found. */
+	enum Source
+	{
+		// Walk the creation time index.
+		SOURCE_AGE,
+
+		// Walk the topic time index.
+		SOURCE_TOPIC,
+
+		// Look up the channels which were picked from the user count index when the request was started.
+		SOURCE_NAMES
+	};
+
+	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
+	// to search for a channel creation time that is lower or higher than val
+	// respectively.
+	time_t mincreationtime;
+	time_t maxcreationtime;
+
+	// M: Searching based on mask.
+	std::string match;
+
+	// N: Searching based on !mask.
+	std::string notmatch;
+
+	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
+	// search for a topic time that is lower or higher than val respectively.
+	time_t mintopictime;
+	time_t maxtopictime;
+
+	// U: Searching based on user count within the channel, via the "<val" and
+	// ">val" modifiers to search for a channel that has less than or more than
+	// val users respectively.
+	size_t minusers;
+	size_t maxusers;
+
+	// Whether the user can see secret channels.
+	bool has_privs;
+
+	// Where the channels to list are found.
+	Source source;
+
+	// The last position in the index which was examined. Positions are compared by value so
+	// the channel at this position may no longer exist.
+	Channel::TimeIndex::value_type last;
+
+	// Whether any channels have been examined yet.
+	bool started;
+
+	// The names of the channels to list when using SOURCE_NAMES and the next one to examine.
+	std::vector<std::string> names;
+	size_t nextname;
+
+	ListCursor()
+		: mincreationtime(0)
+		, maxcreationtime(0)
+		, mintopictime(0)
+		, maxtopictime(0)
+		, minusers(0)
+		, maxusers(0)
+		, has_privs(false)
+		, source(SOURCE_AGE)
+		, last(0, static_cast<Channel*>(NULL))
+		, started(false)
+		, nextname(0)
+	{
+	}
+
+	/** Picks the index which has to be walked to find the fewest channels which might match. */
+	void PickSource()
+	{
+		// Most channels only have a few users so searches for a minimum user count are usually
+		// the most selective. The groups of the user count index are too coarse to help with
+		// searching for a maximum user count as that usually matches most channels.
+		if (minusers)
+		{
+			const Channel::UserCountIndex& index = Channel::GetUserCountIndex();
+			size_t candidates = 0;
+			for (size_t group = Channel::GetUserCountGroup(minusers + 1); group < index.size(); ++group)
+				candidates += index[group].size();
+
+			if (candidates < ServerInstance->GetChans().size() / 2)
+			{
+				names.reserve(candidates);
+				for (size_t group = Channel::GetUserCountGroup(minusers + 1); group < index.size(); ++group)
+				{
+					for (std::vector<Channel*>::const_iterator i = index[group].begin(); i != index[group].end(); ++i)
+					{
+						if ((*i)->GetUserCounter() > minusers)
+							names.push_back((*i)->name);
+					}
+				}
+				source = SOURCE_NAMES;
+				return;
+			}
+		}
+
+		if (mincreationtime || maxcreationtime || (!mintopictime && !maxtopictime))
+		{
+			source = SOURCE_AGE;
+			last.first = mincreationtime ? mincreationtime + 1 : 0;
+		}
+		else
+		{
+			source = SOURCE_TOPIC;
+			last.first = mintopictime ? mintopictime + 1 : 1;
+		}
+	}
+
+	/** Retrieves the next channel which might match or NULL if there are no more. */
+	Channel* Next()
+	{
+		if (source == SOURCE_NAMES)
+		{
+			while (nextname < names.size())
+			{
+				Channel* chan = ServerInstance->FindChan(names[nextname++]);
+				if (chan)
+					return chan;
+			}
+			return NULL;
+		}
+
+		const Channel::TimeIndex& index = (source == SOURCE_AGE) ? Channel::GetAgeIndex() : Channel::GetTopicIndex();
+		Channel::TimeIndex::const_iterator pos = started ? index.upper_bound(last) : index.lower_bound(last);
+		if (pos == index.end())
+			return NULL;
+
+		// The index is ordered so nothing after this can match.
+		const time_t maxtime = (source == SOURCE_AGE) ? maxcreationtime : maxtopictime;
+		if (maxtime && pos->first >= maxtime)
+			return NULL;
+
+		started = true;
+		last = *pos;
+		return pos->second;
+	}
+
+	/** Determines whether a channel matches the search. */
+	bool Matches(Channel* chan) const
+	{
+		// Check the user count if a search has been specified.
+		const size_t users = chan->GetUserCounter();
+		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
+			return false;
+
+		// Check the creation ts if a search has been specified.
+		const time_t creationtime = chan->GetAge();
+		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
+			return false;
+
+		// Check the topic ts if a search has been specified.
+		const time_t topictime = chan->topicset;
+		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
+			return false;
+
+		// Attempt to match a glob pattern.
+		if (!match.empty() && !InspIRCd::Match(chan->name, match) && !InspIRCd::Match(chan->topic, match))
+			return false;
+
+		// Attempt to match an inverted glob pattern.
+		if (!notmatch.empty() && (InspIRCd::Match(chan->name, notmatch) || InspIRCd::Match(chan->topic, notmatch)))
+			return false;
+
+		return true;
+	}
+};
+
 /** Handle /LIST.
  */
-class CommandList : public Command
+class CommandList : public SplitCommand
 {
  private:
 	ChanModeReference secretmode;
@@ -50,51 +226,100 @@ class CommandList : public Command
 	// Whether to show modes in the LIST response.
 	bool showmodes;
 
+	// The LIST requests which are still being sent.
+	SimpleExtItem<ListCursor> cursors;
+
 	CommandList(Module* parent)
-		: Command(parent,"LIST", 0, 0)
+		: SplitCommand(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, cursors("list-cursor", ExtensionItem::EXT_USER, parent)
 	{
 		allow_empty_last_param = false;
 		Penalty = 5;
 	}
 
+	/** Sends more of a LIST response to a user. This stops once the sendq of the user has
+	 * reached its soft limit and continues when it has drained.
+	 * @param user The user to send the response to.
+	 * @param cursor The state of the LIST request.
+	 * @return True if the whole response has been sent; otherwise, false.
+	 */
+	bool Continue(LocalUser* user, ListCursor& cursor);
+
 	/** Handle command.
 	 * @param parameters The parameters to the command
 	 * @param user The user issuing the command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
-	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE;
 };
 
-
-/** Handle /LIST
- */
-CmdResult CommandList::Handle(User* user, const Params& parameters)
+bool CommandList::Continue(LocalUser* user, ListCursor& cursor)
 {
-	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
-	// to search for a channel creation time that is lower or higher than val
-	// respectively.
-	time_t mincreationtime = 0;
-	time_t maxcreationtime = 0;
+	const unsigned long sendqmax = user->MyClass->GetSendqSoftMax();
+	for (size_t examined = 0; ; ++examined)
+	{
+		// The rest of the response would be discarded.
+		if (user->quitting)
+			return true;
 
-	// M: Searching based on mask.
-	std::string match;
+		if (examined >= LIST_BATCH_SIZE || user->eh.getSendQSize() >= sendqmax)
+		{
+			// Continue from OnUserOutputReady once the sendq has drained. The trial write makes
+			// sure that this happens even if nothing was sent this time.
+			user->outputpending = true;
+			SocketEngine::ChangeEventMask(&user->eh, FD_ADD_TRIAL_WRITE);
+			return false;
+		}
 
-	// N: Searching based on !mask.
-	std::string notmatch;
+		Channel* const chan = cursor.Next();
+		if (!chan)
+			break;
 
-	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
-	// search for a topic time that is lower or higher than val respectively.
-	time_t mintopictime = 0;
-	time_t maxtopictime = 0;
+		if (!cursor.Matches(chan))
+			continue;
 
-	// U: Searching based on user count within the channel, via the "<val" and
-	// ">val" modifiers to search for a channel that has less than or more than
-	// val users respectively.
-	size_t minusers = 0;
-	size_t maxusers = 0;
+		// if the channel is not private/secret, OR the user is on the channel anyway
+		bool n = (cursor.has_privs || chan->HasUser(user));
 
+		// If we're not in the channel and +s is set on it, we want to ignore it
+		if ((n) || (!chan->IsModeSet(secretmode)))
+		{
+			const size_t users = chan->GetUserCounter();
+			if ((!n) && (chan->IsModeSet(privatemode)))
+			{
+				// Channel is private (+p) and user is outside/not privileged
+				user->WriteNumeric(RPL_LIST, '*', users, "");
+			}
+			else if (showmodes)
+			{
+				// Show the list response with the modes and topic.
+				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
+			}
+			else
+			{
+				// Show the list response with just the modes.
+				user->WriteNumeric(RPL_LIST, chan->name, users, chan->topic);
+			}
+		}
+	}
+	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	return true;
+}
+
+/** Handle /LIST
+ */
+CmdResult CommandList::HandleLocal(LocalUser* user, const Params& parameters)
+{
+	// Finish the previous response if the user did not wait for it.
+	if (cursors.get(user))
+	{
+		user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+		cursors.unset(user);
+	}
+
+	ListCursor* cursor = new ListCursor;
 	if (!parameters.empty())
 	{
 		irc::commasepstream constraints(parameters[0]);
@@ -102,96 +327,49 @@ CmdResult CommandList::Handle(User* user, const Params& parameters)
 		{
 			if (constraint[0] == '<')
 			{
-				maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
+				cursor->maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
 			}
 			else if (constraint[0] == '>')
 			{
-				minusers = ConvToNum<size_t>(constraint.c_str() + 1);
+				cursor->minusers = ConvToNum<size_t>(constraint.c_str() + 1);
 			}
 			else if (!constraint.compare(0, 2, "C<", 2) || !constraint.compare(0, 2, "c<", 2))
 			{
-				mincreationtime = ParseMinutes(constraint);
+				cursor->mincreationtime = ParseMinutes(constraint);
 			}
 			else if (!constraint.compare(0, 2, "C>", 2) || !constraint.compare(0, 2, "c>", 2))
 			{
-				maxcreationtime = ParseMinutes(constraint);
+				cursor->maxcreationtime = ParseMinutes(constraint);
 			}
 			else if (!constraint.compare(0, 2, "T<", 2) || !constraint.compare(0, 2, "t<", 2))
 			{
-				mintopictime = ParseMinutes(constraint);
+				cursor->mintopictime = ParseMinutes(constraint);
 			}
 			else if (!constraint.compare(0, 2, "T>", 2) || !constraint.compare(0, 2, "t>", 2))
 			{
-				maxtopictime = ParseMinutes(constraint);
+				cursor->maxtopictime = ParseMinutes(constraint);
 			}
 			else if (constraint[0] == '!')
 			{
 				// Ensure that the user didn't just run "LIST !".
 				if (constraint.length() > 2)
-					notmatch = constraint.substr(1);
+					cursor->notmatch = constraint.substr(1);
 			}
 			else
 			{
-				match = constraint;
+				cursor->match = constraint;
 			}
 		}
 	}
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
+	cursor->has_privs = user->HasPrivPermission("channels/auspex");
+	cursor->PickSource();
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-	{
-		Channel* const chan = i->second;
-
-		// Check the user count if a search has been specified.
-		const size_t users = chan->GetUserCounter();
-		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
-			continue;
-
-		// Check the creation ts if a search has been specified.
-		const time_t creationtime = chan->age;
-		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
-			continue;
-
-		// Check the topic ts if a search has been specified.
-		const time_t topictime = chan->topicset;
-		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
-			continue;
-
-		// Attempt to match a glob pattern.
-		if (!match.empty() && !InspIRCd::Match(chan->name, match) && !InspIRCd::Match(chan->topic, match))
-			continue;
-
-		// Attempt to match an inverted glob pattern.
-		if (!notmatch.empty() && (InspIRCd::Match(chan->name, notmatch) || InspIRCd::Match(chan->topic, notmatch)))
-			continue;
-
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (has_privs || chan->HasUser(user));
-
-		// If we're not in the channel and +s is set on it, we want to ignore it
-		if ((n) || (!chan->IsModeSet(secretmode)))
-		{
-			if ((!n) && (chan->IsModeSet(privatemode)))
-			{
-				// Channel is private (+p) and user is outside/not privileged
-				user->WriteNumeric(RPL_LIST, '*', users, "");
-			}
-			else if (showmodes)
-			{
-				// Show the list response with the modes and topic.
-				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
-			}
-			else
-			{
-				// Show the list response with just the modes.
-				user->WriteNumeric(RPL_LIST, chan->name, users, chan->topic);
-			}
-		}
-	}
-	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	if (Continue(user, *cursor))
+		delete cursor;
+	else
+		cursors.set(user, cursor);
 
 	return CMD_SUCCESS;
 }
@@ -213,6 +391,13 @@ class CoreModList : public Module
 		cmd.showmodes = tag->getBool("modesinlist", true);
 	}
 
+	void OnUserOutputReady(LocalUser* user) CXX11_OVERRIDE
+	{
+		ListCursor* cursor = cmd.cursors.get(user);
+		if (cursor && cmd.Continue(user, *cursor))
+			cmd.cursors.unset(user);
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["ELIST"] = "CMNTU";
@@ -28,34 +28,91 @@
 #include "inspircd.h"
 #include "core_oper.h"
 
+namespace
+{
+	class OperPasswordCheck : public PasswordCheck
+	{
+	 private:
+		CommandOper& cmd;
+		const std::string uuid;
+		const std::string login;
+		const reference<OperInfo> oper;
+		const bool match_hosts;
+
+	 public:
+		OperPasswordCheck(Module* mod, CommandOper& c, LocalUser* user, const std::string& name, OperInfo* ifo, bool hosts)
+			: PasswordCheck(mod)
+			, cmd(c)
+			, uuid(user->uuid)
+			, login(name)
+			, oper(ifo)
+			, match_hosts(hosts)
+		{
+		}
+
+		void OnResult(bool match) CXX11_OVERRIDE
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(uuid));
+			if (!user || user->quitting)
+				return;
+
+			cmd.checking.unset(user);
+
+			// The oper block may have been removed or replaced by a rehash while the password was being checked.
+			ServerConfig::OperIndex::const_iterator i = ServerInstance->Config->oper_blocks.find(login);
+			OperInfo* ifo = oper;
+			if (i == ServerInstance->Config->oper_blocks.end() || i->second != ifo)
+				ifo = NULL;
+			cmd.OnChecked(user, login, ifo, match, match_hosts);
+		}
+	};
+}
+
 CommandOper::CommandOper(Module* parent)
 	: SplitCommand(parent, "OPER", 2, 2)
+	, passwordcheck(parent)
+	, checking("oper-checking", ExtensionItem::EXT_USER, parent)
 {
 	syntax = "<username> <password>";
 }
 
 CmdResult CommandOper::HandleLocal(LocalUser* user, const Params& parameters)
 {
-	bool match_login = false;
-	bool match_pass = false;
-	bool match_hosts = false;
+	if (checking.get(user))
+	{
+		user->WriteNotice("*** Your previous oper attempt is still being checked.");
+		return CMD_FAILURE;
+	}
 
 	ServerConfig::OperIndex::const_iterator i = ServerInstance->Config->oper_blocks.find(parameters[0]);
-	if (i != ServerInstance->Config->oper_blocks.end())
+	if (i == ServerInstance->Config->oper_blocks.end())
+		return OnChecked(user, parameters[0], NULL, false, false);
+
+	const std::string userHost = user->ident + "@" + user->GetRealHost();
+	const std::string userIP = user->ident + "@" + user->GetIPString();
+	OperInfo* ifo = i->second;
+	ConfigTag* tag = ifo->oper_block;
+	const bool match_hosts = InspIRCd::MatchMask(tag->getString("host"), userHost, userIP);
+
+	const std::string password = tag->getString("password");
+	const std::string hash = tag->getString("hash");
+	if (!passwordcheck.IsBackground(hash))
+		return OnChecked(user, parameters[0], ifo, ServerInstance->PassCompare(user, password, parameters[1], hash), match_hosts);
+
+	// Expensive password hashes are checked in the background and the attempt is finished
+	// in OnChecked once they have been. Until then the attempt has not succeeded.
+	checking.set(user, 1);
+	passwordcheck.Compare(new OperPasswordCheck(creator, *this, user, parameters[0], ifo, match_hosts), user, password, parameters[1], hash);
+	return CMD_FAILURE;
+}
+
+CmdResult CommandOper::OnChecked(LocalUser* user, const std::string& login, OperInfo* ifo, bool match_pass, bool match_hosts)
+{
+	const bool match_login = (ifo != NULL);
+	if (match_login && match_pass && match_hosts)
 	{
-		const std::string userHost = user->ident + "@" + user->GetRealHost();
-		const std::string userIP = user->ident + "@" + user->GetIPString();
-		OperInfo* ifo = i->second;
-		ConfigTag* tag = ifo->oper_block;
-		match_login = true;
-		match_pass = ServerInstance->PassCompare(user, tag->getString("password"), parameters[1], tag->getString("hash"));
-		match_hosts = InspIRCd::MatchMask(tag->getString("host"), userHost, userIP);
-
-		if (match_pass && match_hosts)
-		{
-			user->Oper(ifo);
-			return CMD_SUCCESS;
-		}
+		user->Oper(ifo);
+		return CMD_SUCCESS;
 	}
 
 	std::string fields;
@@ -71,6 +128,6 @@ CmdResult CommandOper::HandleLocal(LocalUser* user, const Params& parameters)
 	user->WriteNumeric(ERR_NOOPERHOST, "Invalid oper credentials");
 	user->CommandFloodPenalty += 10000;
 
-	ServerInstance->SNO->WriteGlobalSno('o', "WARNING! Failed oper attempt by %s using login '%s': The following fields do not match: %s", user->GetFullRealHost().c_str(), parameters[0].c_str(), fields.c_str());
+	ServerInstance->SNO->WriteGlobalSno('o', "WARNING! Failed oper attempt by %s using login '%s': The following fields do not match: %s", user->GetFullRealHost().c_str(), login.c_str(), fields.c_str());
 	return CMD_FAILURE;
 }
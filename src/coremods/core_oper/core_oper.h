@@ -22,6 +22,7 @@
 #pragma once
 
 #include "inspircd.h"
+#include "modules/hash.h"
 
 namespace DieRestart
 {
@@ -86,11 +87,27 @@ class CommandKill : public Command
  */
 class CommandOper : public SplitCommand
 {
+ private:
+	PasswordCheckAPI passwordcheck;
+
  public:
+	/** Whether a user has an oper attempt which is still having its password checked. */
+	LocalIntExt checking;
+
 	/** Constructor for oper.
 	 */
 	CommandOper(Module* parent);
 
+	/** Opers a user up or tells them why they could not be once their password has been checked.
+	 * @param user The user who is trying to oper up.
+	 * @param login The name of the oper account.
+	 * @param ifo The oper account or NULL if it does not exist.
+	 * @param match_pass Whether the password matched.
+	 * @param match_hosts Whether the user's host matched.
+	 * @return A value from CmdResult to indicate whether the user was opered up.
+	 */
+	CmdResult OnChecked(LocalUser* user, const std::string& login, OperInfo* ifo, bool match_pass, bool match_hosts);
+
 	/** Handle command.
 	 * @param user User issuing the command
 	 * @param parameters Parameters to the command
@@ -80,6 +80,115 @@ static void GenerateStatsLl(Stats::Context& stats)
 	}
 }
 
+namespace
+{
+	struct HookStatsEntry
+	{
+		Module* mod;
+		Implementation event;
+
+		bool operator<(const HookStatsEntry& other) const
+		{
+			// Sort the handlers which have used the most time first.
+			return mod->hookstats[event].totaltime > other.mod->hookstats[other.event].totaltime;
+		}
+	};
+}
+
+static void GenerateStatsH(Stats::Context& stats)
+{
+	if (!ModuleManager::ProfileHooks)
+		stats.AddRow(249, "Hook profiling is disabled; set <performance:profilehooks> to enable it");
+
+	std::vector<HookStatsEntry> entries;
+	const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+	for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+	{
+		Module* mod = i->second;
+		if (!mod->hookstats)
+			continue;
+
+		for (int event = 0; event != I_END; ++event)
+		{
+			if (!mod->hookstats[event].calls)
+				continue;
+
+			HookStatsEntry entry = { mod, static_cast<Implementation>(event) };
+			entries.push_back(entry);
+		}
+	}
+
+	std::sort(entries.begin(), entries.end());
+	for (std::vector<HookStatsEntry>::const_iterator i = entries.begin(); i != entries.end(); ++i)
+	{
+		const DurationStats& hs = i->mod->hookstats[i->event];
+		stats.AddRow(249, InspIRCd::Format("%s %s calls %lu total %.0fus avg %.2fus p50 %.2fus p99 %.2fus max %.2fus",
+			i->mod->ModuleSourceFile.c_str(), ModuleManager::GetEventName(i->event), hs.calls, hs.totaltime / 1000.0,
+			hs.totaltime / 1000.0 / hs.calls, hs.GetPercentile(50) / 1000.0, hs.GetPercentile(99) / 1000.0,
+			hs.maxtime / 1000.0));
+	}
+}
+
+static void GeneratePoolStats(Stats::Context& stats, const std::string& name, const insp::object_pool& pool)
+{
+	stats.AddRow(249, InspIRCd::Format("%-25s %lu of %lu in use (%lu bytes each, %luK allocated)", name.c_str(),
+		static_cast<unsigned long>(pool.used()), static_cast<unsigned long>(pool.capacity()),
+		static_cast<unsigned long>(pool.object_size()), static_cast<unsigned long>(pool.heap_size() / 1024)));
+}
+
+static std::string GetUserPoolName(size_t size)
+{
+	// Users are pooled by size so types which are the same size share a pool.
+	std::string types;
+	if (size == sizeof(LocalUser))
+		types.append("/local");
+	if (size == sizeof(RemoteUser))
+		types.append("/remote");
+	if (size == sizeof(FakeUser))
+		types.append("/server");
+
+	if (types.empty())
+		return "Other user pool:";
+
+	types[1] = toupper(types[1]);
+	return types.substr(1) + " user pool:";
+}
+
+static void GenerateStatsR(Stats::Context& stats)
+{
+	const MainLoopStats& ls = ServerInstance->LoopStats;
+	for (int phase = 0; phase != MainLoopStats::PHASE_END; ++phase)
+	{
+		const DurationStats& ds = ls.phases[phase];
+		stats.AddRow(249, InspIRCd::Format("%s iterations %lu total %.0fus avg %.2fus p50 %.2fus p99 %.2fus max %.2fus",
+			MainLoopStats::GetPhaseName(static_cast<MainLoopStats::Phase>(phase)), ds.calls, ds.totaltime / 1000.0,
+			ds.calls ? ds.totaltime / 1000.0 / ds.calls : 0.0, ds.GetPercentile(50) / 1000.0, ds.GetPercentile(99) / 1000.0,
+			ds.maxtime / 1000.0));
+	}
+
+	const DurationStats& busy = ls.busy;
+	stats.AddRow(249, InspIRCd::Format("busy iterations %lu total %.0fus avg %.2fus p50 %.2fus p99 %.2fus max %.2fus",
+		busy.calls, busy.totaltime / 1000.0, busy.calls ? busy.totaltime / 1000.0 / busy.calls : 0.0,
+		busy.GetPercentile(50) / 1000.0, busy.GetPercentile(99) / 1000.0, busy.maxtime / 1000.0));
+
+	const DurationStats& events = ls.events;
+	stats.AddRow(249, InspIRCd::Format("events per iteration avg %.2f p50 %lu p99 %lu max %lu",
+		events.calls ? static_cast<double>(events.totaltime) / events.calls : 0.0,
+		static_cast<unsigned long>(events.GetPercentile(50)), static_cast<unsigned long>(events.GetPercentile(99)),
+		static_cast<unsigned long>(events.maxtime)));
+
+	if (!ls.slowthreshold)
+	{
+		stats.AddRow(249, "Slow iteration logging is disabled; set <performance:slowloop> to enable it");
+		return;
+	}
+
+	stats.AddRow(249, InspIRCd::Format("%lu iterations took longer than %lums", ls.slowcount,
+		static_cast<unsigned long>(ls.slowthreshold / 1000000)));
+	if (ls.slowcount)
+		stats.AddRow(249, "Last at " + InspIRCd::TimeString(ls.lastslowtime) + ": " + ls.lastslow);
+}
+
 void CommandStats::DoStats(Stats::Context& stats)
 {
 	User* const user = stats.GetSource();
@@ -246,6 +355,16 @@ void CommandStats::DoStats(Stats::Context& stats)
 		}
 		break;
 
+		/* stats h (time spent by modules handling events) */
+		case 'h':
+			GenerateStatsH(stats);
+		break;
+
+		/* stats r (time taken by each phase of the main loop) */
+		case 'r':
+			GenerateStatsR(stats);
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
@@ -253,6 +372,14 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "Channels: "+ConvToStr(ServerInstance->GetChans().size()));
 			stats.AddRow(249, "Commands: "+ConvToStr(ServerInstance->Parser.GetCommands().size()));
 
+			const std::vector<insp::object_pool*>& userpools = User::GetPools();
+			for (std::vector<insp::object_pool*>::const_iterator i = userpools.begin(); i != userpools.end(); ++i)
+			{
+				const insp::object_pool* pool = *i;
+				GeneratePoolStats(stats, GetUserPoolName(pool->object_size()), *pool);
+			}
+			GeneratePoolStats(stats, "Membership pool:", Channel::GetMembershipPool());
+
 			float kbitpersec_in, kbitpersec_out, kbitpersec_total;
 			SocketEngine::GetStats().GetBandwidth(kbitpersec_in, kbitpersec_out, kbitpersec_total);
 
@@ -333,6 +460,7 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "connection count "+ConvToStr(ServerInstance->stats.Connects));
 			stats.AddRow(249, InspIRCd::Format("bytes sent %5.2fK recv %5.2fK",
 				ServerInstance->stats.Sent / 1024.0, ServerInstance->stats.Recv / 1024.0));
+			stats.AddRow(249, "serialized lines reused "+ConvToStr(ServerInstance->stats.SerializeHits)+" created "+ConvToStr(ServerInstance->stats.SerializeMisses));
 		}
 		break;
 
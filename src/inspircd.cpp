@@ -642,6 +642,179 @@ void InspIRCd::UpdateTime()
 #endif
 }
 
+uint64_t InspIRCd::MonotonicTime()
+{
+#if defined HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#elif defined _WIN32
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return static_cast<uint64_t>(counter.QuadPart * (1000000000.0 / ServerInstance->stats.QPFrequency.QuadPart));
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+MainLoopStats::MainLoopStats()
+	: slowthreshold(0)
+	, slowcount(0)
+	, lastslowtime(0)
+	, current(PHASE_TIMERS)
+	, phasestart(0)
+	, slowevent(0)
+	, slowcommand(0)
+{
+	std::fill(iteration, iteration + PHASE_END, 0);
+}
+
+void MainLoopStats::StartIteration()
+{
+	std::fill(iteration, iteration + PHASE_END, 0);
+	current = PHASE_TIMERS;
+	phasestart = InspIRCd::MonotonicTime();
+
+	slowevent = 0;
+	slowcommand = 0;
+}
+
+void MainLoopStats::EnterPhase(Phase phase)
+{
+	const uint64_t now = InspIRCd::MonotonicTime();
+	iteration[current] += now - phasestart;
+	current = phase;
+	phasestart = now;
+}
+
+void MainLoopStats::EndIteration(int eventcount)
+{
+	iteration[current] += InspIRCd::MonotonicTime() - phasestart;
+
+	uint64_t busytime = 0;
+	for (int phase = 0; phase != PHASE_END; ++phase)
+	{
+		phases[phase].Add(iteration[phase]);
+		if (phase != PHASE_WAIT)
+			busytime += iteration[phase];
+	}
+	busy.Add(busytime);
+	events.Add(std::max(eventcount, 0));
+
+	if (!slowthreshold || busytime < slowthreshold)
+		return;
+
+	std::string message = InspIRCd::Format("Main loop iteration took %.2fms (timers %.2fms, writes %.2fms, events %.2fms, cleanup %.2fms) and dispatched %d events",
+		busytime / 1000000.0, iteration[PHASE_TIMERS] / 1000000.0, iteration[PHASE_WRITES] / 1000000.0,
+		iteration[PHASE_EVENTS] / 1000000.0, iteration[PHASE_CLEANUP] / 1000000.0, eventcount);
+	if (slowevent)
+		message.append(InspIRCd::Format("; slowest event: %s took %.2fms", sloweventdesc.c_str(), slowevent / 1000000.0));
+	if (slowcommand)
+		message.append(InspIRCd::Format("; slowest command: %s took %.2fms", slowcommanddesc.c_str(), slowcommand / 1000000.0));
+
+	ServerInstance->Logs->Log("MAINLOOP", LOG_DEFAULT, message);
+	slowcount++;
+	lastslow.swap(message);
+	lastslowtime = ServerInstance->Time();
+}
+
+const char* MainLoopStats::GetPhaseName(Phase phase)
+{
+	switch (phase)
+	{
+		case PHASE_TIMERS:
+			return "timers";
+		case PHASE_WRITES:
+			return "writes";
+		case PHASE_WAIT:
+			return "wait";
+		case PHASE_EVENTS:
+			return "events";
+		case PHASE_CLEANUP:
+			return "cleanup";
+		default:
+			return "unknown";
+	}
+}
+
+MainLoopStats::EventTimer::EventTimer(EventHandler* eh)
+	: handler(eh)
+	, fd(eh->GetFd())
+	, start(ServerInstance->LoopStats.slowthreshold ? InspIRCd::MonotonicTime() : 0)
+{
+}
+
+MainLoopStats::EventTimer::~EventTimer()
+{
+	if (!start)
+		return;
+
+	MainLoopStats& stats = ServerInstance->LoopStats;
+	const uint64_t duration = InspIRCd::MonotonicTime() - start;
+	if (duration <= stats.slowevent)
+		return;
+
+	stats.slowevent = duration;
+	stats.sloweventdesc = InspIRCd::Format("fd %d", fd);
+	if (duration < stats.slowthreshold)
+		return;
+
+	// This event alone made the iteration slow so it is worth the cost of finding out
+	// what the handler belongs to. We can't use RTTI so compare against the handlers
+	// of local users and listeners instead.
+	if (SocketEngine::GetRef(fd) != handler)
+	{
+		// The handler closed its socket and may have been deleted.
+		stats.sloweventdesc.append(" (closed)");
+		return;
+	}
+
+	const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+	for (UserManager::LocalList::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		LocalUser* user = *i;
+		if (&user->eh == handler)
+		{
+			stats.sloweventdesc.append(" (user " + user->GetFullRealHost() + ")");
+			return;
+		}
+	}
+
+	for (std::vector<ListenSocket*>::const_iterator i = ServerInstance->ports.begin(); i != ServerInstance->ports.end(); ++i)
+	{
+		ListenSocket* ls = *i;
+		if (ls == handler)
+		{
+			stats.sloweventdesc.append(" (listener " + ls->bind_sa.str() + ")");
+			return;
+		}
+	}
+}
+
+MainLoopStats::CommandTimer::CommandTimer(LocalUser* u, Command* cmd)
+	: user(u)
+	, command(cmd)
+	, start(ServerInstance->LoopStats.slowthreshold ? InspIRCd::MonotonicTime() : 0)
+{
+}
+
+MainLoopStats::CommandTimer::~CommandTimer()
+{
+	if (!start)
+		return;
+
+	MainLoopStats& stats = ServerInstance->LoopStats;
+	const uint64_t duration = InspIRCd::MonotonicTime() - start;
+	if (duration <= stats.slowcommand)
+		return;
+
+	// Users which quit are culled rather than deleted so this is safe.
+	stats.slowcommand = duration;
+	stats.slowcommanddesc = InspIRCd::Format("%s from %s", command->name.c_str(), user->GetFullRealHost().c_str());
+}
+
 void InspIRCd::Run()
 {
 	UpdateTime();
@@ -649,6 +822,8 @@ void InspIRCd::Run()
 
 	while (true)
 	{
+		LoopStats.StartIteration();
+
 		/* Check if there is a config thread which has finished executing but has not yet been freed */
 		if (this->ConfigThread && this->ConfigThread->IsDone())
 		{
@@ -680,7 +855,6 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnGarbageCollect, ());
 
 			Timers.TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
@@ -696,12 +870,18 @@ void InspIRCd::Run()
 		 * This will cause any read or write events to be
 		 * dispatched to their handlers.
 		 */
+		LoopStats.EnterPhase(MainLoopStats::PHASE_WRITES);
 		SocketEngine::DispatchTrialWrites();
-		SocketEngine::DispatchEvents();
+
+		// The socket engine enters PHASE_EVENTS itself once it has finished waiting.
+		LoopStats.EnterPhase(MainLoopStats::PHASE_WAIT);
+		const int eventcount = SocketEngine::DispatchEvents();
 
 		/* if any users were quit, take them out */
+		LoopStats.EnterPhase(MainLoopStats::PHASE_CLEANUP);
 		GlobalCulls.Apply();
 		AtomicActions.Run();
+		LoopStats.EndIteration(eventcount);
 
 		if (s_signal)
 		{
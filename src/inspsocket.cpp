@@ -155,7 +155,7 @@ int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
 		return ReadToRecvQ(rq);
 
 	IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
-	if (iohm)
+	if ((iohm) && (!iohm->HasPendingRead()))
 	{
 		// Call the next hook to put data into the recvq of the current hook
 		const int ret = HookChainRead(iohm->GetNextHook(), iohm->GetRecvQ());
@@ -384,6 +384,21 @@ void StreamSocket::WriteData(const std::string &data)
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const reference<SendQueue::SharedBuffer>& data)
+{
+	if (!HasFd())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->GetData().c_str());
+		return;
+	}
+
+	/* Reference the data from the back of the queue ready for writing */
+	sendq.push_back(SendQueue::Element(data));
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
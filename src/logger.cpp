@@ -58,8 +58,91 @@
 const char LogStream::LogHeader[] =
 	"Log started for " INSPIRCD_VERSION;
 
+/** Writes log lines to a file on a background thread so that a slow disk never blocks the main loop.
+ */
+class LogWriterThread CXX11_FINAL : public QueuedThread
+{
+ private:
+	/** The file to write to. */
+	FILE* const log;
+
+	/** Lines which have been logged but not written yet. Protected by the queue lock. */
+	std::string pending;
+
+	/** The number of lines which were dropped since the last write. Protected by the queue lock. */
+	unsigned long dropped;
+
+ public:
+	/** The maximum number of bytes which can wait to be written before new lines are dropped. */
+	static const size_t MAX_PENDING = 16 * 1024 * 1024;
+
+	LogWriterThread(FILE* logfile)
+		: log(logfile)
+		, dropped(0)
+	{
+	}
+
+	/** Queues a line to be written to the log file. Called from the main thread.
+	 */
+	void Add(const std::string& line)
+	{
+		LockQueue();
+		if (pending.length() + line.length() > MAX_PENDING)
+		{
+			dropped++;
+			UnlockQueue();
+			return;
+		}
+
+		// The writer only needs waking up if it has run out of lines to write.
+		const bool wakeup = pending.empty();
+		pending.append(line);
+		if (wakeup)
+			UnlockQueueWakeup();
+		else
+			UnlockQueue();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		std::string writing;
+		LockQueue();
+		for (;;)
+		{
+			while (pending.empty() && !GetExitFlag())
+				WaitForQueue();
+
+			// Everything is written out before exiting.
+			if (pending.empty())
+				break;
+
+			writing.swap(pending);
+			const unsigned long lost = dropped;
+			dropped = 0;
+			UnlockQueue();
+
+			fwrite(writing.data(), 1, writing.length(), log);
+			if (lost)
+				fprintf(log, "*** %lu log lines were dropped as they could not be written quickly enough\n", lost);
+			fflush(log);
+			writing.clear();
+
+			LockQueue();
+		}
+		UnlockQueue();
+	}
+};
+
+void LogStream::ChangeLevel(LogLevel lvl)
+{
+	this->loglvl = lvl;
+	ServerInstance->Logs->UpdateLevels();
+}
+
 LogManager::LogManager()
 	: Logging(false)
+	, MinLevel(LOG_NONE)
+	, DefaultTypeLevel(LOG_NONE)
 {
 }
 
@@ -121,7 +204,7 @@ void LogManager::OpenFileLogs()
 			struct tm *mytime = gmtime(&time);
 			strftime(realtarget, sizeof(realtarget), target.c_str(), mytime);
 			FILE* f = fopen(realtarget, "a");
-			fw = new FileWriter(f, tag->getUInt("flush", 20, 1, UINT_MAX));
+			fw = new FileWriter(f, tag->getUInt("flush", 20, 1, UINT_MAX), tag->getBool("async"));
 			logmap.insert(std::make_pair(target, fw));
 		}
 		else
@@ -148,6 +231,7 @@ void LogManager::CloseLogs()
 	}
 
 	AllLogStreams.clear();
+	UpdateLevels();
 }
 
 void LogManager::AddLogTypes(const std::string &types, LogStream* l, bool autoclose)
@@ -189,6 +273,7 @@ void LogManager::AddLogTypes(const std::string &types, LogStream* l, bool autocl
 	{
 		gi->second.swap(excludes); // Swap with the vector in the hash.
 	}
+	UpdateLevels();
 }
 
 bool LogManager::AddLogType(const std::string &type, LogStream *l, bool autoclose)
@@ -201,6 +286,7 @@ bool LogManager::AddLogType(const std::string &type, LogStream *l, bool autoclos
 	if (autoclose)
 		AllLogStreams[l]++;
 
+	UpdateLevels();
 	return true;
 }
 
@@ -215,6 +301,7 @@ void LogManager::DelLogStream(LogStream* l)
 	}
 
 	GlobalLogStreams.erase(l);
+	UpdateLevels();
 
 	std::map<LogStream*, int>::iterator ai = AllLogStreams.begin();
 	if (ai == AllLogStreams.end())
@@ -252,6 +339,7 @@ bool LogManager::DelLogType(const std::string &type, LogStream *l)
 	{
 		return false;
 	}
+	UpdateLevels();
 
 	std::map<LogStream*, int>::iterator ai = AllLogStreams.find(l);
 	if (ai == AllLogStreams.end())
@@ -268,9 +356,52 @@ bool LogManager::DelLogType(const std::string &type, LogStream *l)
 	return true;
 }
 
+void LogManager::UpdateLevels()
+{
+	DefaultTypeLevel = LOG_NONE;
+	TypeLevels.clear();
+
+	// Types which are not mentioned by any LogStream are only wanted by the LogStreams for all types.
+	for (std::map<LogStream*, std::vector<std::string> >::const_iterator gi = GlobalLogStreams.begin(); gi != GlobalLogStreams.end(); ++gi)
+	{
+		DefaultTypeLevel = std::min(DefaultTypeLevel, gi->first->GetLevel());
+		for (std::vector<std::string>::const_iterator type = gi->second.begin(); type != gi->second.end(); ++type)
+			TypeLevels.insert(std::make_pair(*type, LOG_NONE));
+	}
+
+	for (std::map<std::string, std::vector<LogStream*> >::const_iterator i = LogStreams.begin(); i != LogStreams.end(); ++i)
+		TypeLevels.insert(std::make_pair(i->first, LOG_NONE));
+
+	MinLevel = DefaultTypeLevel;
+	for (std::map<std::string, LogLevel>::iterator i = TypeLevels.begin(); i != TypeLevels.end(); ++i)
+	{
+		i->second = GetTypeLevel(i->first);
+		MinLevel = std::min(MinLevel, i->second);
+	}
+}
+
+LogLevel LogManager::GetTypeLevel(const std::string& type) const
+{
+	LogLevel level = LOG_NONE;
+	for (std::map<LogStream*, std::vector<std::string> >::const_iterator gi = GlobalLogStreams.begin(); gi != GlobalLogStreams.end(); ++gi)
+	{
+		if (!stdalgo::isin(gi->second, type))
+			level = std::min(level, gi->first->GetLevel());
+	}
+
+	std::map<std::string, std::vector<LogStream*> >::const_iterator i = LogStreams.find(type);
+	if (i != LogStreams.end())
+	{
+		for (std::vector<LogStream*>::const_iterator it = i->second.begin(); it != i->second.end(); ++it)
+			level = std::min(level, (*it)->GetLevel());
+	}
+	return level;
+}
+
 void LogManager::Log(const std::string &type, LogLevel loglevel, const char *fmt, ...)
 {
-	if (Logging)
+	// Avoid formatting messages which nothing wants.
+	if ((Logging) || (!IsEnabled(type, loglevel)))
 		return;
 
 	std::string buf;
@@ -280,7 +411,7 @@ void LogManager::Log(const std::string &type, LogLevel loglevel, const char *fmt
 
 void LogManager::Log(const std::string &type, LogLevel loglevel, const std::string &msg)
 {
-	if (Logging)
+	if ((Logging) || (!IsEnabled(type, loglevel)))
 	{
 		return;
 	}
@@ -310,11 +441,17 @@ void LogManager::Log(const std::string &type, LogLevel loglevel, const std::stri
 }
 
 
-FileWriter::FileWriter(FILE* logfile, unsigned int flushcount)
+FileWriter::FileWriter(FILE* logfile, unsigned int flushcount, bool background)
 	: log(logfile)
 	, flush(flushcount)
 	, writeops(0)
+	, writer(NULL)
 {
+	if ((log) && (background))
+	{
+		writer = new LogWriterThread(log);
+		ServerInstance->Threads.Start(writer);
+	}
 }
 
 void FileWriter::WriteLogLine(const std::string &line)
@@ -324,6 +461,12 @@ void FileWriter::WriteLogLine(const std::string &line)
 // XXX: For now, just return. Don't throw an exception. It'd be nice to find out if this is happening, but I'm terrified of breaking so close to final release. -- w00t
 //		throw CoreException("FileWriter::WriteLogLine called with a closed logfile");
 
+	if (writer)
+	{
+		writer->Add(line);
+		return;
+	}
+
 	fputs(line.c_str(), log);
 	if (++writeops % flush == 0)
 	{
@@ -333,6 +476,13 @@ void FileWriter::WriteLogLine(const std::string &line)
 
 FileWriter::~FileWriter()
 {
+	if (writer)
+	{
+		// Stopping the thread waits for it to write everything that is still queued.
+		ServerInstance->Threads.Stop(writer);
+		delete writer;
+	}
+
 	if (log)
 	{
 		fflush(log);
@@ -221,10 +221,17 @@ ModeAction PrefixMode::OnModeChange(User* source, User*, Channel* chan, std::str
 
 void PrefixMode::Update(unsigned int rank, unsigned int setrank, unsigned int unsetrank, bool selfrm)
 {
-	prefixrank = rank;
 	ranktoset = setrank;
 	ranktounset = unsetrank;
 	selfremove = selfrm;
+	if (rank == prefixrank)
+		return;
+
+	// The rank of local members is cached by their channel so it has to be recalculated.
+	prefixrank = rank;
+	const chan_hash& chans = ServerInstance->GetChans();
+	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		i->second->UpdateLocalRanks();
 }
 
 ModeAction ParamModeBase::OnModeChange(User* source, User*, Channel* chan, std::string& parameter, bool adding)
@@ -60,6 +60,7 @@ Version::Version(const std::string &desc, int flags, const std::string& linkdata
 Module::Module()
 	: ModuleDLLManager(NULL)
 	, dying(false)
+	, hookstats(NULL)
 {
 }
 
@@ -72,6 +73,53 @@ CullResult Module::cull()
 
 Module::~Module()
 {
+	delete[] hookstats;
+}
+
+DurationStats::DurationStats()
+	: calls(0)
+	, totaltime(0)
+	, maxtime(0)
+{
+	std::fill(histogram, histogram + BUCKETS, 0);
+}
+
+void DurationStats::Add(uint64_t duration)
+{
+	calls++;
+	totaltime += duration;
+	maxtime = std::max(maxtime, duration);
+
+	size_t bucket = 0;
+	for (uint64_t remaining = duration >> 1; remaining && bucket < BUCKETS - 1; remaining >>= 1)
+		bucket++;
+	histogram[bucket]++;
+}
+
+uint64_t DurationStats::GetPercentile(unsigned int percent) const
+{
+	const unsigned long target = (static_cast<uint64_t>(calls) * percent + 99) / 100;
+	unsigned long seen = 0;
+	for (size_t bucket = 0; bucket < BUCKETS - 1; ++bucket)
+	{
+		seen += histogram[bucket];
+		if (seen >= target)
+			return std::min(static_cast<uint64_t>(2) << bucket, maxtime);
+	}
+	return maxtime;
+}
+
+uint64_t HookProfiler::Begin()
+{
+	return InspIRCd::MonotonicTime();
+}
+
+void HookProfiler::End()
+{
+	const uint64_t duration = InspIRCd::MonotonicTime() - start;
+	if (!mod->hookstats)
+		mod->hookstats = new DurationStats[I_END];
+	mod->hookstats[event].Add(duration);
 }
 
 void Module::DetachEvent(Implementation i)
@@ -152,6 +200,7 @@ void		Module::OnSetUserIP(LocalUser*) { DetachEvent(I_OnSetUserIP); }
 void		Module::OnServiceAdd(ServiceProvider&) { DetachEvent(I_OnServiceAdd); }
 void		Module::OnServiceDel(ServiceProvider&) { DetachEvent(I_OnServiceDel); }
 ModResult	Module::OnUserWrite(LocalUser*, ClientProtocol::Message&) { DetachEvent(I_OnUserWrite); return MOD_RES_PASSTHRU; }
+void		Module::OnUserOutputReady(LocalUser*) { DetachEvent(I_OnUserOutputReady); }
 ModResult	Module::OnConnectionFail(LocalUser*, BufferedSocketError) { DetachEvent(I_OnConnectionFail); return MOD_RES_PASSTHRU; }
 void		Module::OnShutdown(const std::string& reason) { DetachEvent(I_OnShutdown); }
 
@@ -188,10 +237,103 @@ const char* ServiceProvider::GetTypeString() const
 	return "unknown service";
 }
 
+bool ModuleManager::ProfileHooks = false;
+
 ModuleManager::ModuleManager()
 {
 }
 
+namespace
+{
+	// The names of the module events. This must be kept in the same order as the Implementation enum.
+	const char* const EventNames[] = {
+		"On005Numeric",
+		"OnAcceptConnection",
+		"OnAddLine",
+		"OnBackgroundTimer",
+		"OnBuildNeighborList",
+		"OnChangeHost",
+		"OnChangeIdent",
+		"OnChangeRealHost",
+		"OnChangeRealName",
+		"OnChannelDelete",
+		"OnChannelPreDelete",
+		"OnCheckBan",
+		"OnCheckChannelBan",
+		"OnCheckInvite",
+		"OnCheckKey",
+		"OnCheckLimit",
+		"OnCheckReady",
+		"OnCommandBlocked",
+		"OnConnectionFail",
+		"OnDecodeMetaData",
+		"OnDelLine",
+		"OnExpireLine",
+		"OnExtBanCheck",
+		"OnGarbageCollect",
+		"OnKill",
+		"OnLoadModule",
+		"OnMode",
+		"OnModuleRehash",
+		"OnNumeric",
+		"OnOper",
+		"OnPassCompare",
+		"OnPostChangeRealHost",
+		"OnPostCommand",
+		"OnPostConnect",
+		"OnPostDeoper",
+		"OnPostJoin",
+		"OnPostOper",
+		"OnPostTopicChange",
+		"OnPreChangeHost",
+		"OnPreChangeRealName",
+		"OnPreCommand",
+		"OnPreMode",
+		"OnPreRehash",
+		"OnPreTopicChange",
+		"OnRawMode",
+		"OnSendSnotice",
+		"OnServiceAdd",
+		"OnServiceDel",
+		"OnSetConnectClass",
+		"OnSetUserIP",
+		"OnShutdown",
+		"OnUnloadModule",
+		"OnUserConnect",
+		"OnUserDisconnect",
+		"OnUserInit",
+		"OnUserInvite",
+		"OnUserJoin",
+		"OnUserKick",
+		"OnUserMessage",
+		"OnUserMessageBlocked",
+		"OnUserOutputReady",
+		"OnUserPart",
+		"OnUserPostInit",
+		"OnUserPostMessage",
+		"OnUserPostNick",
+		"OnUserPreInvite",
+		"OnUserPreJoin",
+		"OnUserPreKick",
+		"OnUserPreMessage",
+		"OnUserPreNick",
+		"OnUserPreQuit",
+		"OnUserQuit",
+		"OnUserRegister",
+		"OnUserWrite",
+	};
+
+	// Fails to compile if an event is added to or removed from the Implementation enum without updating EventNames.
+	typedef char EventNamesMatchImplementation[sizeof(EventNames) / sizeof(EventNames[0]) == I_END ? 1 : -1];
+}
+
+const char* ModuleManager::GetEventName(Implementation event)
+{
+	if (event >= I_END)
+		return "unknown";
+	return EventNames[event];
+}
+
 ModuleManager::~ModuleManager()
 {
 }
@@ -171,6 +171,11 @@ class HashArgon2 : public HashProvider
 		return raw;
 	}
 
+	bool IsExpensive() const CXX11_OVERRIDE
+	{
+		return true;
+	}
+
 	HashArgon2(Module* parent, const std::string& hashName, Argon2_type type)
 		: HashProvider(parent, hashName)
 		, argon2Type(type)
@@ -57,6 +57,7 @@
 #include "inspircd.h"
 #include <mysql.h>
 #include "modules/sql.h"
+#include "modules/stats.h"
 
 #ifdef __GNUC__
 # pragma GCC diagnostic pop
@@ -74,21 +75,19 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asynchronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via class Thread, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
- * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
- * worker thread wakes up, and checks if there is a request at the head of its queue.
- * If there is, it processes this request, blocking the worker thread but leaving the ircd
- * thread to go about its business as usual. During this period, the ircd thread is able
- * to insert further pending requests into the queue.
+ * Each <database> tag is a pool of connections and every connection in the pool has its own
+ * worker thread. Queries are added to the queue of the pool they are for and whenever one of
+ * the pool's workers is idle the query at the head of the queue is handed to it. The worker
+ * performs the query, blocking the worker thread but leaving the ircd thread to go about its
+ * business as usual, and then signals the ircd thread (via a loopback socket) that a result
+ * is available.
  *
- * Once the processing of a request is complete, it is removed from the incoming queue to
- * an outgoing queue, and initialized as a 'response'. The worker thread then signals the
- * ircd thread (via a loopback socket) of the fact a result is available, by sending the
- * connection ID through the connection.
+ * The ircd thread then takes the result from the worker, sends it on its way to the original
+ * calling module and hands the worker the next query from the queue.
  *
- * The ircd thread then mutexes the queue once more, reads the outbound response off the head
- * of the queue, and sends it on its way to the original calling module.
+ * The queues are only ever touched by the ircd thread so the only thing a worker shares with
+ * it is the query it is executing and its result. As each database has its own workers a slow
+ * database only holds up the queries which are sent to it.
  *
  * XXX: You might be asking "why doesnt it just send the response from within the worker thread?"
  * The answer to this is simple. The majority of InspIRCd, and in fact most ircd's are not
@@ -100,77 +99,48 @@
  * guaranteed threadsafe!)
  */
 
-class SQLConnection;
+class DatabasePool;
 class MySQLresult;
 class DispatcherThread;
 
 struct QueryQueueItem
 {
-	// An SQL database which this query is executed on.
-	SQLConnection* connection;
-
 	// An object which handles the result of the query.
 	SQL::Query* query;
 
 	// The SQL query which is to be executed.
 	std::string querystr;
 
-	QueryQueueItem(SQL::Query* q, const std::string& s, SQLConnection* c)
-		: connection(c)
-		, query(q)
-		, querystr(s)
-	{
-	}
-};
+	// The time at which the query was submitted.
+	uint64_t submitted;
 
-struct ResultQueueItem
-{
-	// An object which handles the result of the query.
-	SQL::Query* query;
-
-	// The result returned from executing the MySQL query.
-	MySQLresult* result;
-
-	ResultQueueItem(SQL::Query* q, MySQLresult* r)
+	QueryQueueItem(SQL::Query* q, const std::string& s)
 		: query(q)
-		, result(r)
+		, querystr(s)
+		, submitted(InspIRCd::MonotonicTime())
 	{
 	}
 };
 
-typedef insp::flat_map<std::string, SQLConnection*> ConnMap;
+typedef insp::flat_map<std::string, DatabasePool*> PoolMap;
 typedef std::deque<QueryQueueItem> QueryQueue;
-typedef std::deque<ResultQueueItem> ResultQueue;
 
 /** MySQL module
  *  */
-class ModuleSQL : public Module
+class ModuleSQL : public Module, public Stats::EventListener
 {
  public:
-	DispatcherThread* Dispatcher;
-	QueryQueue qq;       // MUST HOLD MUTEX
-	ResultQueue rq;      // MUST HOLD MUTEX
-	ConnMap connections; // main thread only
+	PoolMap pools; // main thread only
 
 	ModuleSQL();
 	void init() CXX11_OVERRIDE;
 	~ModuleSQL();
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
 };
 
-class DispatcherThread : public SocketThread
-{
- private:
-	ModuleSQL* const Parent;
- public:
-	DispatcherThread(ModuleSQL* CreatorModule) : Parent(CreatorModule) { }
-	~DispatcherThread() { }
-	void Run() CXX11_OVERRIDE;
-	void OnNotify() CXX11_OVERRIDE;
-};
-
 /** Represents a mysql result set
  */
 class MySQLresult : public SQL::Result
@@ -286,42 +256,18 @@ class MySQLresult : public SQL::Result
 
 /** Represents a connection to a mysql database
  */
-class SQLConnection : public SQL::Provider
+class SQLConnection
 {
- private:
-	bool EscapeString(SQL::Query* query, const std::string& in, std::string& out)
-	{
-		// In the worst case each character may need to be encoded as using two bytes and one
-		// byte is the NUL terminator.
-		std::vector<char> buffer(in.length() * 2 + 1);
-
-		// The return value of mysql_escape_string() is either an error or the length of the
-		// encoded string not including the NUL terminator.
-		//
-		// Unfortunately, someone genius decided that mysql_escape_string should return an
-		// unsigned type even though -1 is returned on error so checking whether an error
-		// happened is a bit cursed.
-		unsigned long escapedsize = mysql_escape_string(&buffer[0], in.c_str(), in.length());
-		if (escapedsize == static_cast<unsigned long>(-1))
-		{
-			SQL::Error err(SQL::QSEND_FAIL, InspIRCd::Format("%u: %s", mysql_errno(connection), mysql_error(connection)));
-			query->OnError(err);
-			return false;
-		}
-
-		out.append(&buffer[0], escapedsize);
-		return true;
-	}
-
  public:
 	reference<ConfigTag> config;
 	MYSQL *connection;
-	Mutex lock;
+
+	// The reason the last attempt to connect failed.
+	std::string error;
 
 	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
-	SQLConnection(Module* p, ConfigTag* tag)
-		: SQL::Provider(p, tag->getString("id"))
-		, config(tag)
+	SQLConnection(ConfigTag* tag)
+		: config(tag)
 		, connection(NULL)
 	{
 	}
@@ -332,7 +278,7 @@ class SQLConnection : public SQL::Provider
 	}
 
 	// This method connects to the database using the credentials supplied to the constructor, and returns
-	// true upon success.
+	// true upon success. It is called from the worker thread so it can not log the reason it failed.
 	bool Connect()
 	{
 		connection = mysql_init(connection);
@@ -349,8 +295,7 @@ class SQLConnection : public SQL::Provider
 		unsigned int port = config->getUInt("port", 3306, 1, 65535);
 		if (!mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, CLIENT_IGNORE_SIGPIPE))
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to connect to the %s MySQL server: %s",
-				GetId().c_str(), mysql_error(connection));
+			error = InspIRCd::Format("Unable to connect: %s", mysql_error(connection));
 			return false;
 		}
 
@@ -358,33 +303,45 @@ class SQLConnection : public SQL::Provider
 		const std::string charset = config->getString("charset");
 		if (!charset.empty() && mysql_set_character_set(connection, charset.c_str()))
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Could not set character set for %s to \"%s\": %s",
-				GetId().c_str(), charset.c_str(), mysql_error(connection));
+			error = InspIRCd::Format("Could not set character set to \"%s\": %s", charset.c_str(), mysql_error(connection));
 			return false;
 		}
 
+		// Limit how long the server may spend executing a query. MySQL calls this max_execution_time
+		// and only applies it to SELECT queries; MariaDB calls it max_statement_time. Servers which
+		// support neither only have the time a query waits for a connection limited.
+		const unsigned long querytimeout = config->getDuration("querytimeout", 0);
+		if (querytimeout)
+		{
+			const std::string mysqltimeout = InspIRCd::Format("SET SESSION max_execution_time = %lu", querytimeout * 1000);
+			if (mysql_real_query(connection, mysqltimeout.data(), mysqltimeout.length()))
+			{
+				const std::string mariadbtimeout = InspIRCd::Format("SET SESSION max_statement_time = %lu", querytimeout);
+				mysql_real_query(connection, mariadbtimeout.data(), mariadbtimeout.length());
+			}
+		}
+
 		// Execute the initial SQL query.
 		const std::string initialquery = config->getString("initialquery");
 		if (!initialquery.empty() && mysql_real_query(connection, initialquery.data(), initialquery.length()))
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Could not execute initial query \"%s\" for %s: %s",
-				initialquery.c_str(), name.c_str(), mysql_error(connection));
+			error = InspIRCd::Format("Could not execute initial query \"%s\": %s", initialquery.c_str(), mysql_error(connection));
 			return false;
 		}
 
 		return true;
 	}
 
-	ModuleSQL* Parent()
-	{
-		return (ModuleSQL*)(Module*)creator;
-	}
-
 	MySQLresult* DoBlockingQuery(const std::string& query)
 	{
+		if (!CheckConnection())
+		{
+			SQL::Error e(SQL::BAD_CONN, error);
+			return new MySQLresult(e);
+		}
 
 		/* Parse the command string and dispatch it to mysql */
-		if (CheckConnection() && !mysql_real_query(connection, query.data(), query.length()))
+		if (!mysql_real_query(connection, query.data(), query.length()))
 		{
 			/* Successful query */
 			MYSQL_RES* res = mysql_use_result(connection);
@@ -406,13 +363,348 @@ class SQLConnection : public SQL::Provider
 			return Connect();
 		return true;
 	}
+};
+
+/** A worker thread which executes queries on one connection of a pool.
+ */
+class DispatcherThread : public SocketThread
+{
+ private:
+	DatabasePool* const Pool;
+
+	// The connection queries are executed on. Worker thread only.
+	SQLConnection connection;
+
+	// The query which the worker has been asked to execute. MUST HOLD MUTEX
+	std::string querystr;
+
+	// Whether querystr is waiting to be executed. MUST HOLD MUTEX
+	bool pending;
+
+	// The result of the last query which was executed. MUST HOLD MUTEX
+	MySQLresult* result;
+
+ public:
+	// Whether the worker is executing a query. Main thread only.
+	bool busy;
+
+	// The query the worker is executing. Its query is NULL if the module that submitted
+	// it has been unloaded. Main thread only.
+	QueryQueueItem inprogress;
+
+	DispatcherThread(DatabasePool* pool, ConfigTag* tag)
+		: Pool(pool)
+		, connection(tag)
+		, pending(false)
+		, result(NULL)
+		, busy(false)
+		, inprogress(NULL, "")
+	{
+	}
+
+	~DispatcherThread()
+	{
+		delete result;
+	}
+
+	/** Hands a query to the worker. Called from the main thread. */
+	void Execute(const QueryQueueItem& item)
+	{
+		busy = true;
+		inprogress = item;
+		this->LockQueue();
+		querystr = item.querystr;
+		pending = true;
+		this->UnlockQueueWakeup();
+	}
+
+	/** Takes the result of the last query from the worker. Called from the main thread. */
+	MySQLresult* TakeResult()
+	{
+		this->LockQueue();
+		MySQLresult* res = result;
+		result = NULL;
+		this->UnlockQueue();
+		return res;
+	}
+
+	void Run() CXX11_OVERRIDE;
+	void OnNotify() CXX11_OVERRIDE;
+};
+
+/** Represents a database: a pool of connections which share a queue of queries.
+ */
+class DatabasePool : public SQL::Provider
+{
+ private:
+	/** Fails queries which have waited longer than the pool allows. */
+	class ExpireTimer : public Timer
+	{
+	 private:
+		DatabasePool* const pool;
+
+	 public:
+		ExpireTimer(DatabasePool* p)
+			: Timer(1, true)
+			, pool(p)
+		{
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			pool->ExpireQueries();
+			return true;
+		}
+	};
+
+	/** Counters which are shown in /STATS Q. */
+	struct PoolStats
+	{
+		// The number of queries which were executed successfully.
+		unsigned long completed;
+
+		// The number of queries which were executed and failed.
+		unsigned long failed;
+
+		// The number of queries which were not executed before their deadline.
+		unsigned long expired;
+
+		// The number of queries which were rejected because the queue was full.
+		unsigned long rejected;
+
+		// The total and longest time taken to execute queries, including the time spent queued.
+		uint64_t totaltime;
+		uint64_t maxtime;
+
+		// The most queries which have been queued at once.
+		size_t maxqueued;
+
+		PoolStats()
+			: completed(0)
+			, failed(0)
+			, expired(0)
+			, rejected(0)
+			, totaltime(0)
+			, maxtime(0)
+			, maxqueued(0)
+		{
+		}
+	};
+
+	// The workers which execute queries for this database.
+	std::vector<DispatcherThread*> workers;
+
+	// Queries which are waiting for a worker.
+	QueryQueue queue;
+
+	// The maximum number of queries which can wait for a worker.
+	const size_t maxqueue;
+
+	// The time after which a query which is still waiting for a worker fails, in nanoseconds, or 0 to wait forever.
+	const uint64_t timeout;
+
+	ExpireTimer expiretimer;
+	PoolStats poolstats;
+
+	bool EscapeString(SQL::Query* query, const std::string& in, std::string& out)
+	{
+		// In the worst case each character may need to be encoded as using two bytes and one
+		// byte is the NUL terminator.
+		std::vector<char> buffer(in.length() * 2 + 1);
+
+		// The return value of mysql_escape_string() is either an error or the length of the
+		// encoded string not including the NUL terminator.
+		//
+		// Unfortunately, someone genius decided that mysql_escape_string should return an
+		// unsigned type even though -1 is returned on error so checking whether an error
+		// happened is a bit cursed.
+		unsigned long escapedsize = mysql_escape_string(&buffer[0], in.c_str(), in.length());
+		if (escapedsize == static_cast<unsigned long>(-1))
+		{
+			SQL::Error err(SQL::QSEND_FAIL, "Unable to escape a query parameter");
+			query->OnError(err);
+			delete query;
+			return false;
+		}
+
+		out.append(&buffer[0], escapedsize);
+		return true;
+	}
+
+	void FailQuery(const QueryQueueItem& item, SQL::Error& err)
+	{
+		item.query->OnError(err);
+		delete item.query;
+	}
+
+ public:
+	DatabasePool(Module* p, ConfigTag* tag)
+		: SQL::Provider(p, tag->getString("id"))
+		, maxqueue(tag->getUInt("maxqueue", 1000, 1))
+		, timeout(static_cast<uint64_t>(tag->getDuration("querytimeout", 0)) * 1000000000)
+		, expiretimer(this)
+	{
+		const unsigned long poolsize = tag->getUInt("poolsize", 1, 1, 64);
+		for (unsigned long i = 0; i < poolsize; ++i)
+		{
+			DispatcherThread* worker = new DispatcherThread(this, tag);
+			ServerInstance->Threads.Start(worker);
+			workers.push_back(worker);
+		}
+
+		if (timeout)
+			ServerInstance->Timers.AddTimer(&expiretimer);
+	}
+
+	~DatabasePool()
+	{
+		// Ask every worker to stop before waiting for any of them so that they all
+		// finish the query they are executing at the same time.
+		for (std::vector<DispatcherThread*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+			(*i)->SetExitFlag();
+
+		SQL::Error err(SQL::BAD_DBID);
+		for (std::vector<DispatcherThread*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			DispatcherThread* worker = *i;
+			worker->join();
+			if (worker->busy && worker->inprogress.query)
+				FailQuery(worker->inprogress, err);
+			delete worker;
+		}
+
+		QueryQueue failed;
+		failed.swap(queue);
+		for (QueryQueue::const_iterator i = failed.begin(); i != failed.end(); ++i)
+			FailQuery(*i, err);
+	}
+
+	/** Hands queries to the workers which are idle. */
+	void Dispatch()
+	{
+		if (timeout)
+			ExpireQueries();
+
+		for (std::vector<DispatcherThread*>::const_iterator i = workers.begin(); i != workers.end() && !queue.empty(); ++i)
+		{
+			DispatcherThread* worker = *i;
+			if (!worker->busy)
+			{
+				worker->Execute(queue.front());
+				queue.pop_front();
+			}
+		}
+	}
+
+	/** Fails the queries which have waited for a worker for longer than the timeout. */
+	void ExpireQueries()
+	{
+		const uint64_t now = InspIRCd::MonotonicTime();
+		while (!queue.empty() && now - queue.front().submitted >= timeout)
+		{
+			QueryQueueItem item = queue.front();
+			queue.pop_front();
+			poolstats.expired++;
+
+			SQL::Error err(SQL::QSEND_FAIL, "The query was not executed before its deadline");
+			FailQuery(item, err);
+		}
+	}
+
+	/** Sends the result of a query to the module which submitted it and gives the worker its next query. */
+	void OnResult(DispatcherThread* worker, MySQLresult* res)
+	{
+		QueryQueueItem item = worker->inprogress;
+		worker->busy = false;
+		worker->inprogress.query = NULL;
+
+		if (res->err.code == SQL::BAD_CONN)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to use the %s MySQL server: %s",
+				GetId().c_str(), res->err.ToString());
+		}
+
+		if (item.query)
+		{
+			const uint64_t elapsed = InspIRCd::MonotonicTime() - item.submitted;
+			poolstats.totaltime += elapsed;
+			poolstats.maxtime = std::max(poolstats.maxtime, elapsed);
+
+			if (res->err.code == SQL::SUCCESS)
+			{
+				poolstats.completed++;
+				item.query->OnResult(*res);
+			}
+			else
+			{
+				poolstats.failed++;
+				item.query->OnError(res->err);
+			}
+			delete item.query;
+		}
+		delete res;
+
+		Dispatch();
+	}
+
+	/** Fails the queries which were submitted by a module. */
+	void RemoveQueries(Module* mod)
+	{
+		SQL::Error err(SQL::BAD_DBID);
+		for (std::vector<DispatcherThread*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			// The result will be discarded when the worker finishes executing the query.
+			DispatcherThread* worker = *i;
+			if (worker->busy && worker->inprogress.query && worker->inprogress.query->creator == mod)
+			{
+				FailQuery(worker->inprogress, err);
+				worker->inprogress.query = NULL;
+			}
+		}
+
+		for (size_t j = queue.size(); j > 0; j--)
+		{
+			size_t k = j - 1;
+			if (queue[k].query->creator == mod)
+			{
+				QueryQueueItem item = queue[k];
+				queue.erase(queue.begin() + k);
+				FailQuery(item, err);
+			}
+		}
+	}
+
+	void AddStats(Stats::Context& stats)
+	{
+		size_t busy = 0;
+		for (std::vector<DispatcherThread*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			if ((*i)->busy)
+				busy++;
+		}
+
+		const unsigned long executed = poolstats.completed + poolstats.failed;
+		stats.AddRow(249, InspIRCd::Format("%s (mysql) %lu/%lu connections busy, %lu/%lu queued (max %lu), %lu completed, %lu failed, %lu expired, %lu rejected, latency %.1fms avg %.1fms max",
+			GetId().c_str(), static_cast<unsigned long>(busy), static_cast<unsigned long>(workers.size()),
+			static_cast<unsigned long>(queue.size()), static_cast<unsigned long>(maxqueue), static_cast<unsigned long>(poolstats.maxqueued),
+			poolstats.completed, poolstats.failed, poolstats.expired, poolstats.rejected,
+			executed ? poolstats.totaltime / 1000000.0 / executed : 0.0, poolstats.maxtime / 1000000.0));
+	}
 
 	void Submit(SQL::Query* q, const std::string& qs) CXX11_OVERRIDE
 	{
+		if (queue.size() >= maxqueue)
+		{
+			poolstats.rejected++;
+			SQL::Error err(SQL::QSEND_FAIL, "Too many queries are waiting to be executed");
+			FailQuery(QueryQueueItem(q, qs), err);
+			return;
+		}
+
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Executing MySQL query: " + qs);
-		Parent()->Dispatcher->LockQueue();
-		Parent()->qq.push_back(QueryQueueItem(q, qs, this));
-		Parent()->Dispatcher->UnlockQueueWakeup();
+		queue.push_back(QueryQueueItem(q, qs));
+		poolstats.maxqueued = std::max(poolstats.maxqueued, queue.size());
+		Dispatch();
 	}
 
 	void Submit(SQL::Query* call, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
@@ -454,7 +746,7 @@ class SQLConnection : public SQL::Provider
 };
 
 ModuleSQL::ModuleSQL()
-	: Dispatcher(NULL)
+	: Stats::EventListener(this)
 {
 }
 
@@ -462,21 +754,11 @@ void ModuleSQL::init()
 {
 	if (mysql_library_init(0, NULL, NULL))
 		throw ModuleException("Unable to initialise the MySQL library!");
-
-	Dispatcher = new DispatcherThread(this);
-	ServerInstance->Threads.Start(Dispatcher);
 }
 
 ModuleSQL::~ModuleSQL()
 {
-	if (Dispatcher)
-	{
-		Dispatcher->join();
-		Dispatcher->OnNotify();
-		delete Dispatcher;
-	}
-
-	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+	for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
 	{
 		delete i->second;
 	}
@@ -486,79 +768,53 @@ ModuleSQL::~ModuleSQL()
 
 void ModuleSQL::ReadConfig(ConfigStatus& status)
 {
-	ConnMap conns;
+	PoolMap newpools;
 	ConfigTagList tags = ServerInstance->Config->ConfTags("database");
 	for(ConfigIter i = tags.first; i != tags.second; i++)
 	{
 		if (!stdalgo::string::equalsci(i->second->getString("module"), "mysql"))
 			continue;
 		std::string id = i->second->getString("id");
-		ConnMap::iterator curr = connections.find(id);
-		if (curr == connections.end())
+		PoolMap::iterator curr = pools.find(id);
+		if (curr == pools.end())
 		{
-			SQLConnection* conn = new SQLConnection(this, i->second);
-			conns.insert(std::make_pair(id, conn));
-			ServerInstance->Modules->AddService(*conn);
+			DatabasePool* pool = new DatabasePool(this, i->second);
+			newpools.insert(std::make_pair(id, pool));
+			ServerInstance->Modules->AddService(*pool);
 		}
 		else
 		{
-			conns.insert(*curr);
-			connections.erase(curr);
+			newpools.insert(*curr);
+			pools.erase(curr);
 		}
 	}
 
-	// now clean up the deleted databases
-	Dispatcher->LockQueue();
-	SQL::Error err(SQL::BAD_DBID);
-	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+	// now clean up the deleted databases. This waits for any queries they are
+	// executing to complete and fails the queries which are still queued.
+	for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
 	{
 		ServerInstance->Modules->DelService(*i->second);
-		// it might be running a query on this database. Wait for that to complete
-		i->second->lock.Lock();
-		i->second->lock.Unlock();
-		// now remove all active queries to this DB
-		for (size_t j = qq.size(); j > 0; j--)
-		{
-			size_t k = j - 1;
-			if (qq[k].connection == i->second)
-			{
-				qq[k].query->OnError(err);
-				delete qq[k].query;
-				qq.erase(qq.begin() + k);
-			}
-		}
-		// finally, nuke the connection
 		delete i->second;
 	}
-	Dispatcher->UnlockQueue();
-	connections.swap(conns);
+	pools.swap(newpools);
 }
 
 void ModuleSQL::OnUnloadModule(Module* mod)
 {
-	SQL::Error err(SQL::BAD_DBID);
-	Dispatcher->LockQueue();
-	unsigned int i = qq.size();
-	while (i > 0)
-	{
-		i--;
-		if (qq[i].query->creator == mod)
-		{
-			if (i == 0)
-			{
-				// need to wait until the query is done
-				// (the result will be discarded)
-				qq[i].connection->lock.Lock();
-				qq[i].connection->lock.Unlock();
-			}
-			qq[i].query->OnError(err);
-			delete qq[i].query;
-			qq.erase(qq.begin() + i);
-		}
-	}
-	Dispatcher->UnlockQueue();
-	// clean up any result queue entries
-	Dispatcher->OnNotify();
+	for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
+		i->second->RemoveQueries(mod);
+}
+
+ModResult ModuleSQL::OnStats(Stats::Context& stats)
+{
+	if (stats.GetSymbol() != 'Q')
+		return MOD_RES_PASSTHRU;
+
+	for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
+		i->second->AddStats(stats);
+
+	// Other SQL modules add their databases to this too.
+	return MOD_RES_PASSTHRU;
 }
 
 Version ModuleSQL::GetVersion()
@@ -571,36 +827,22 @@ void DispatcherThread::Run()
 	this->LockQueue();
 	while (!this->GetExitFlag())
 	{
-		if (!Parent->qq.empty())
+		if (pending)
 		{
-			QueryQueueItem i = Parent->qq.front();
-			i.connection->lock.Lock();
+			std::string query;
+			query.swap(querystr);
+			pending = false;
 			this->UnlockQueue();
-			MySQLresult* res = i.connection->DoBlockingQuery(i.querystr);
-			i.connection->lock.Unlock();
 
-			/*
-			 * At this point, the main thread could be working on:
-			 *  Rehash - delete i.connection out from under us. We don't care about that.
-			 *  UnloadModule - delete i.query and the qq item. Need to avoid reporting results.
-			 */
+			MySQLresult* res = connection.DoBlockingQuery(query);
 
 			this->LockQueue();
-			if (!Parent->qq.empty() && Parent->qq.front().query == i.query)
-			{
-				Parent->qq.pop_front();
-				Parent->rq.push_back(ResultQueueItem(i.query, res));
-				NotifyParent();
-			}
-			else
-			{
-				// UnloadModule ate the query
-				delete res;
-			}
+			result = res;
+			NotifyParent();
 		}
 		else
 		{
-			/* We know the queue is empty, we can safely hang this thread until
+			/* We know there is nothing to do, we can safely hang this thread until
 			 * something happens
 			 */
 			this->WaitForQueue();
@@ -611,20 +853,9 @@ void DispatcherThread::Run()
 
 void DispatcherThread::OnNotify()
 {
-	// this could unlock during the dispatch, but OnResult isn't expected to take that long
-	this->LockQueue();
-	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
-	{
-		MySQLresult* res = i->result;
-		if (res->err.code == SQL::SUCCESS)
-			i->query->OnResult(*res);
-		else
-			i->query->OnError(res->err);
-		delete i->query;
-		delete i->result;
-	}
-	Parent->rq.clear();
-	this->UnlockQueue();
+	MySQLresult* res = TakeResult();
+	if (res)
+		Pool->OnResult(this, res);
 }
 
 MODULE_INIT(ModuleSQL)
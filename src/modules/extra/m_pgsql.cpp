@@ -41,6 +41,7 @@
 #include <cstdlib>
 #include <libpq-fe.h>
 #include "modules/sql.h"
+#include "modules/stats.h"
 
 /* SQLConn rewritten by peavey to
  * use EventHandler instead of
@@ -49,11 +50,17 @@
  * and delete of resources.
  */
 
+/* Each <database> tag is a pool of connections which share a queue of
+ * queries. Whenever a connection in the pool is idle it takes the query
+ * at the head of the queue so one slow query does not hold up the rest.
+ */
+
 /* Forward declare, so we can have the typedef neatly at the top */
 class SQLConn;
+class SQLPool;
 class ModulePgSQL;
 
-typedef insp::flat_map<std::string, SQLConn*> ConnMap;
+typedef insp::flat_map<std::string, SQLPool*> PoolMap;
 
 enum SQLstatus
 {
@@ -88,7 +95,8 @@ struct QueueItem
 {
 	SQL::Query* c;
 	std::string q;
-	QueueItem(SQL::Query* C, const std::string& Q) : c(C), q(Q) {}
+	uint64_t submitted;
+	QueueItem(SQL::Query* C, const std::string& Q) : c(C), q(Q), submitted(InspIRCd::MonotonicTime()) {}
 };
 
 /** PgSQLresult is a subclass of the mostly-pure-virtual class SQLresult.
@@ -181,17 +189,17 @@ class PgSQLresult : public SQL::Result
 
 /** SQLConn represents one SQL session.
  */
-class SQLConn : public SQL::Provider, public EventHandler
+class SQLConn : public EventHandler
 {
  public:
+	SQLPool* const pool;		/* The pool this connection belongs to */
 	reference<ConfigTag> conf;	/* The <database> entry */
-	std::deque<QueueItem> queue;
 	PGconn*			sql;		/* PgSQL database connection handle */
 	SQLstatus		status;		/* PgSQL database connection status */
 	QueueItem		qinprog;	/* If there is currently a query in progress */
 
-	SQLConn(Module* Creator, ConfigTag* tag)
-		: SQL::Provider(Creator, tag->getString("id"))
+	SQLConn(SQLPool* Pool, ConfigTag* tag)
+		: pool(Pool)
 		, conf(tag)
 		, sql(NULL)
 		, status(CWRITE)
@@ -201,27 +209,14 @@ class SQLConn : public SQL::Provider, public EventHandler
 			DelayReconnect();
 	}
 
-	CullResult cull() CXX11_OVERRIDE
-	{
-		this->SQL::Provider::cull();
-		ServerInstance->Modules->DelService(*this);
-		return this->EventHandler::cull();
-	}
-
 	~SQLConn()
 	{
-		SQL::Error err(SQL::BAD_DBID);
 		if (qinprog.c)
 		{
+			SQL::Error err(SQL::BAD_DBID);
 			qinprog.c->OnError(err);
 			delete qinprog.c;
 		}
-		for(std::deque<QueueItem>::iterator i = queue.begin(); i != queue.end(); i++)
-		{
-			SQL::Query* q = i->c;
-			q->OnError(err);
-			delete q;
-		}
 		Close();
 	}
 
@@ -265,13 +260,18 @@ class SQLConn : public SQL::Provider, public EventHandler
 		else
 			conninfo << " sslmode = 'disable'";
 
+		// Limit how long the server may spend executing a query.
+		const unsigned long querytimeout = conf->getDuration("querytimeout", 0);
+		if (querytimeout)
+			conninfo << " options = '-c statement_timeout=" << querytimeout * 1000 << "'";
+
 		return conninfo.str();
 	}
 
 	bool HandleConnectError(const char* reason)
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Could not connect to the \"%s\" database: %s",
-			GetId().c_str(), reason);
+			conf->getString("id").c_str(), reason);
 		return false;
 	}
 
@@ -330,102 +330,349 @@ class SQLConn : public SQL::Provider, public EventHandler
 		}
 	}
 
-	void DoConnectedPoll()
+	/** Determines whether this connection can execute a query right now. */
+	bool IsIdle() const
 	{
-restart:
-		while (qinprog.q.empty() && !queue.empty())
+		return (status == WREAD || status == WWRITE) && qinprog.q.empty();
+	}
+
+	/** Starts executing the next query from the pool if there is nothing in progress. */
+	void TakeQuery();
+
+	void DoConnectedPoll();
+
+	void DelayReconnect();
+
+	void DoEvent()
+	{
+		if((status == CREAD) || (status == CWRITE))
 		{
-			/* There's no query currently in progress, and there's queries in the queue. */
-			DoQuery(queue.front());
-			queue.pop_front();
+			DoPoll();
+		}
+		else if (status == WREAD || status == WWRITE)
+		{
+			DoConnectedPoll();
+		}
+	}
+
+	bool DoQuery(const QueueItem& req)
+	{
+		if (status != WREAD && status != WWRITE)
+		{
+			// whoops, not connected...
+			SQL::Error err(SQL::BAD_CONN);
+			req.c->OnError(err);
+			delete req.c;
+			return false;
 		}
 
-		if (PQconsumeInput(sql))
+		if(PQsendQuery(sql, req.q.c_str()))
 		{
-			if (PQisBusy(sql))
+			qinprog = req;
+			return true;
+		}
+		else
+		{
+			SQL::Error err(SQL::QSEND_FAIL, PQerrorMessage(sql));
+			req.c->OnError(err);
+			delete req.c;
+			return false;
+		}
+	}
+
+	void Close()
+	{
+		status = DEAD;
+
+		if (HasFd() && SocketEngine::HasFd(GetFd()))
+			SocketEngine::DelFd(this);
+
+		if(sql)
+		{
+			PQfinish(sql);
+			sql = NULL;
+		}
+	}
+};
+
+/** SQLPool represents a database: a pool of sessions which share a queue of queries.
+ */
+class SQLPool : public SQL::Provider
+{
+ private:
+	/** Fails queries which have waited longer than the pool allows. */
+	class ExpireTimer : public Timer
+	{
+	 private:
+		SQLPool* const pool;
+
+	 public:
+		ExpireTimer(SQLPool* p)
+			: Timer(1, true)
+			, pool(p)
+		{
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			pool->ExpireQueries();
+			return true;
+		}
+	};
+
+	/** Counters which are shown in /STATS Q. */
+	struct PoolStats
+	{
+		// The number of queries which were executed successfully.
+		unsigned long completed;
+
+		// The number of queries which were executed and failed.
+		unsigned long failed;
+
+		// The number of queries which were not executed before their deadline.
+		unsigned long expired;
+
+		// The number of queries which were rejected because the queue was full.
+		unsigned long rejected;
+
+		// The total and longest time taken to execute queries, including the time spent queued.
+		uint64_t totaltime;
+		uint64_t maxtime;
+
+		// The most queries which have been queued at once.
+		size_t maxqueued;
+
+		PoolStats()
+			: completed(0)
+			, failed(0)
+			, expired(0)
+			, rejected(0)
+			, totaltime(0)
+			, maxtime(0)
+			, maxqueued(0)
+		{
+		}
+	};
+
+	// The sessions which are connected or connecting to the database.
+	std::vector<SQLConn*> conns;
+
+	// Queries which are waiting for a session.
+	std::deque<QueueItem> queue;
+
+	// The number of sessions the pool should have.
+	const unsigned long poolsize;
+
+	// The maximum number of queries which can wait for a session.
+	const size_t maxqueue;
+
+	// The time after which a query which is still waiting for a session fails, in nanoseconds, or 0 to wait forever.
+	const uint64_t timeout;
+
+	ExpireTimer expiretimer;
+	PoolStats poolstats;
+
+	void Escape(const std::string& parm, std::string& out)
+	{
+		// Escaping depends on the settings of the server so use a session if there is one.
+		PGconn* escconn = NULL;
+		for (std::vector<SQLConn*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			if ((*i)->sql && ((*i)->status == WREAD || (*i)->status == WWRITE))
 			{
-				/* Nothing happens here */
+				escconn = (*i)->sql;
+				break;
 			}
-			else if (qinprog.c)
-			{
-				/* Fetch the result.. */
-				PGresult* result = PQgetResult(sql);
-
-				/* PgSQL would allow a query string to be sent which has multiple
-				 * queries in it, this isn't portable across database backends and
-				 * we don't want modules doing it. But just in case we make sure we
-				 * drain any results there are and just use the last one.
-				 * If the module devs are behaving there will only be one result.
-				 */
-				while (PGresult* temp = PQgetResult(sql))
-				{
-					PQclear(result);
-					result = temp;
-				}
+		}
 
-				/* ..and the result */
-				PgSQLresult reply(result);
-				switch(PQresultStatus(result))
-				{
-					case PGRES_EMPTY_QUERY:
-					case PGRES_BAD_RESPONSE:
-					case PGRES_FATAL_ERROR:
-					{
-						SQL::Error err(SQL::QREPLY_FAIL, PQresultErrorMessage(result));
-						qinprog.c->OnError(err);
-						break;
-					}
-					default:
-						/* Other values are not errors */
-						qinprog.c->OnResult(reply);
-				}
+		std::vector<char> buffer(parm.length() * 2 + 1);
+		int error = 0;
+		size_t escapedsize;
+		if (escconn)
+			escapedsize = PQescapeStringConn(escconn, &buffer[0], parm.data(), parm.length(), &error);
+		else
+			escapedsize = PQescapeString(&buffer[0], parm.data(), parm.length());
+		if (error)
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
+		out.append(&buffer[0], escapedsize);
+	}
 
-				delete qinprog.c;
-				qinprog = QueueItem(NULL, "");
-				goto restart;
-			}
-			else
+	void FailQuery(const QueueItem& item, SQL::Error& err)
+	{
+		item.c->OnError(err);
+		delete item.c;
+	}
+
+ public:
+	reference<ConfigTag> conf;	/* The <database> entry */
+
+	SQLPool(Module* Creator, ConfigTag* tag)
+		: SQL::Provider(Creator, tag->getString("id"))
+		, poolsize(tag->getUInt("poolsize", 1, 1, 64))
+		, maxqueue(tag->getUInt("maxqueue", 1000, 1))
+		, timeout(static_cast<uint64_t>(tag->getDuration("querytimeout", 0)) * 1000000000)
+		, expiretimer(this)
+		, conf(tag)
+	{
+		if (timeout)
+			ServerInstance->Timers.AddTimer(&expiretimer);
+	}
+
+	~SQLPool()
+	{
+		// Sessions fail the query they are executing when they are deleted.
+		std::vector<SQLConn*> closing;
+		closing.swap(conns);
+		for (std::vector<SQLConn*>::const_iterator i = closing.begin(); i != closing.end(); ++i)
+		{
+			(*i)->cull();
+			delete *i;
+		}
+
+		SQL::Error err(SQL::BAD_DBID);
+		std::deque<QueueItem> failed;
+		failed.swap(queue);
+		for (std::deque<QueueItem>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+			FailQuery(*i, err);
+	}
+
+	/** Opens new sessions until the pool has as many as it should. */
+	void Fill()
+	{
+		while (conns.size() < poolsize)
+		{
+			SQLConn* conn = new SQLConn(this, conf);
+			if (conn->status == DEAD)
 			{
-				qinprog.q.clear();
+				// The session has already been queued for culling at the end of the main
+				// loop and will be replaced when the reconnect timer ticks.
+				break;
 			}
+			conns.push_back(conn);
 		}
-		else
+	}
+
+	/** Forgets about a session which has died. */
+	void RemoveConnection(SQLConn* conn)
+	{
+		stdalgo::vector::swaperase(conns, conn);
+	}
+
+	/** Hands queries to the sessions which are idle. */
+	void Dispatch()
+	{
+		for (std::vector<SQLConn*>::const_iterator i = conns.begin(); i != conns.end() && !queue.empty(); ++i)
 		{
-			/* I think we'll assume this means the server died...it might not,
-			 * but I think that any error serious enough we actually get here
-			 * deserves to reconnect [/excuse]
-			 * Returning true so the core doesn't try and close the connection.
-			 */
-			DelayReconnect();
+			if ((*i)->IsIdle())
+				(*i)->TakeQuery();
 		}
 	}
 
-	void DelayReconnect();
+	/** Retrieves the next query a session should execute.
+	 * @param item The location to store the query in.
+	 * @return True if there was a query waiting; otherwise, false.
+	 */
+	bool NextQuery(QueueItem& item)
+	{
+		if (timeout)
+			ExpireQueries();
 
-	void DoEvent()
+		if (queue.empty())
+			return false;
+
+		item = queue.front();
+		queue.pop_front();
+		return true;
+	}
+
+	/** Fails the queries which have waited for a session for longer than the timeout. */
+	void ExpireQueries()
 	{
-		if((status == CREAD) || (status == CWRITE))
+		const uint64_t now = InspIRCd::MonotonicTime();
+		while (!queue.empty() && now - queue.front().submitted >= timeout)
 		{
-			DoPoll();
+			QueueItem item = queue.front();
+			queue.pop_front();
+			poolstats.expired++;
+
+			SQL::Error err(SQL::QSEND_FAIL, "The query was not executed before its deadline");
+			FailQuery(item, err);
 		}
-		else if (status == WREAD || status == WWRITE)
+	}
+
+	/** Records that a query has been executed. */
+	void RecordResult(const QueueItem& item, bool success)
+	{
+		const uint64_t elapsed = InspIRCd::MonotonicTime() - item.submitted;
+		poolstats.totaltime += elapsed;
+		poolstats.maxtime = std::max(poolstats.maxtime, elapsed);
+		if (success)
+			poolstats.completed++;
+		else
+			poolstats.failed++;
+	}
+
+	/** Fails the queries which were submitted by a module. */
+	void RemoveQueries(Module* mod)
+	{
+		SQL::Error err(SQL::BAD_DBID);
+		for (std::vector<SQLConn*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
 		{
-			DoConnectedPoll();
+			SQLConn* conn = *i;
+			if (conn->qinprog.c && conn->qinprog.c->creator == mod)
+			{
+				FailQuery(conn->qinprog, err);
+				conn->qinprog.c = NULL;
+			}
+		}
+
+		std::deque<QueueItem>::iterator j = queue.begin();
+		while (j != queue.end())
+		{
+			SQL::Query* q = j->c;
+			if (q->creator == mod)
+			{
+				q->OnError(err);
+				delete q;
+				j = queue.erase(j);
+			}
+			else
+				j++;
 		}
 	}
 
-	void Submit(SQL::Query *req, const std::string& q) CXX11_OVERRIDE
+	void AddStats(Stats::Context& stats)
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Executing PostgreSQL query: " + q);
-		if (qinprog.q.empty())
+		size_t busy = 0;
+		for (std::vector<SQLConn*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
 		{
-			DoQuery(QueueItem(req,q));
+			if (!(*i)->qinprog.q.empty())
+				busy++;
 		}
-		else
+
+		const unsigned long executed = poolstats.completed + poolstats.failed;
+		stats.AddRow(249, InspIRCd::Format("%s (pgsql) %lu/%lu connections busy, %lu/%lu queued (max %lu), %lu completed, %lu failed, %lu expired, %lu rejected, latency %.1fms avg %.1fms max",
+			GetId().c_str(), static_cast<unsigned long>(busy), static_cast<unsigned long>(conns.size()),
+			static_cast<unsigned long>(queue.size()), static_cast<unsigned long>(maxqueue), static_cast<unsigned long>(poolstats.maxqueued),
+			poolstats.completed, poolstats.failed, poolstats.expired, poolstats.rejected,
+			executed ? poolstats.totaltime / 1000000.0 / executed : 0.0, poolstats.maxtime / 1000000.0));
+	}
+
+	void Submit(SQL::Query *req, const std::string& q) CXX11_OVERRIDE
+	{
+		if (queue.size() >= maxqueue)
 		{
-			// wait your turn.
-			queue.push_back(QueueItem(req,q));
+			poolstats.rejected++;
+			SQL::Error err(SQL::QSEND_FAIL, "Too many queries are waiting to be executed");
+			FailQuery(QueueItem(req, q), err);
+			return;
 		}
+
+		// wait your turn.
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Executing PostgreSQL query: " + q);
+		queue.push_back(QueueItem(req,q));
+		poolstats.maxqueued = std::max(poolstats.maxqueued, queue.size());
+		Dispatch();
 	}
 
 	void Submit(SQL::Query *req, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
@@ -439,15 +686,7 @@ restart:
 			else
 			{
 				if (param < p.size())
-				{
-					std::string parm = p[param++];
-					std::vector<char> buffer(parm.length() * 2 + 1);
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-					res.append(&buffer[0], escapedsize);
-				}
+					Escape(p[param++], res);
 			}
 		}
 		Submit(req, res);
@@ -470,73 +709,107 @@ restart:
 
 				SQL::ParamMap::const_iterator it = p.find(field);
 				if (it != p.end())
-				{
-					std::string parm = it->second;
-					std::vector<char> buffer(parm.length() * 2 + 1);
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-					res.append(&buffer[0], escapedsize);
-				}
+					Escape(it->second, res);
 			}
 		}
 		Submit(req, res);
 	}
+};
 
-	void DoQuery(const QueueItem& req)
+void SQLConn::TakeQuery()
+{
+	QueueItem item(NULL, "");
+	while (qinprog.q.empty() && pool->NextQuery(item))
 	{
-		if (status != WREAD && status != WWRITE)
+		if (!DoQuery(item))
+			pool->RecordResult(item, false);
+	}
+}
+
+void SQLConn::DoConnectedPoll()
+{
+restart:
+	/* If there's no query currently in progress, start the next one in the queue. */
+	TakeQuery();
+
+	if (PQconsumeInput(sql))
+	{
+		if (PQisBusy(sql))
 		{
-			// whoops, not connected...
-			SQL::Error err(SQL::BAD_CONN);
-			req.c->OnError(err);
-			delete req.c;
-			return;
+			/* Nothing happens here */
 		}
-
-		if(PQsendQuery(sql, req.q.c_str()))
+		else if (qinprog.c)
 		{
-			qinprog = req;
+			/* Fetch the result.. */
+			PGresult* result = PQgetResult(sql);
+
+			/* PgSQL would allow a query string to be sent which has multiple
+			 * queries in it, this isn't portable across database backends and
+			 * we don't want modules doing it. But just in case we make sure we
+			 * drain any results there are and just use the last one.
+			 * If the module devs are behaving there will only be one result.
+			 */
+			while (PGresult* temp = PQgetResult(sql))
+			{
+				PQclear(result);
+				result = temp;
+			}
+
+			/* ..and the result */
+			PgSQLresult reply(result);
+			switch(PQresultStatus(result))
+			{
+				case PGRES_EMPTY_QUERY:
+				case PGRES_BAD_RESPONSE:
+				case PGRES_FATAL_ERROR:
+				{
+					pool->RecordResult(qinprog, false);
+					SQL::Error err(SQL::QREPLY_FAIL, PQresultErrorMessage(result));
+					qinprog.c->OnError(err);
+					break;
+				}
+				default:
+					/* Other values are not errors */
+					pool->RecordResult(qinprog, true);
+					qinprog.c->OnResult(reply);
+			}
+
+			delete qinprog.c;
+			qinprog = QueueItem(NULL, "");
+			goto restart;
 		}
 		else
 		{
-			SQL::Error err(SQL::QSEND_FAIL, PQerrorMessage(sql));
-			req.c->OnError(err);
-			delete req.c;
+			qinprog.q.clear();
 		}
 	}
-
-	void Close()
+	else
 	{
-		status = DEAD;
-
-		if (HasFd() && SocketEngine::HasFd(GetFd()))
-			SocketEngine::DelFd(this);
-
-		if(sql)
-		{
-			PQfinish(sql);
-			sql = NULL;
-		}
+		/* I think we'll assume this means the server died...it might not,
+		 * but I think that any error serious enough we actually get here
+		 * deserves to reconnect [/excuse]
+		 * Returning true so the core doesn't try and close the connection.
+		 */
+		DelayReconnect();
 	}
-};
+}
 
-class ModulePgSQL : public Module
+class ModulePgSQL : public Module, public Stats::EventListener
 {
  public:
-	ConnMap connections;
+	PoolMap pools;
 	ReconnectTimer* retimer;
 
 	ModulePgSQL()
-		: retimer(NULL)
+		: Stats::EventListener(this)
+		, retimer(NULL)
 	{
 	}
 
 	~ModulePgSQL()
 	{
 		delete retimer;
-		ClearAllConnections();
+		ClearAllPools();
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -546,71 +819,61 @@ class ModulePgSQL : public Module
 
 	void ReadConf()
 	{
-		ConnMap conns;
+		PoolMap newpools;
 		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
 		for(ConfigIter i = tags.first; i != tags.second; i++)
 		{
 			if (!stdalgo::string::equalsci(i->second->getString("module"), "pgsql"))
 				continue;
 			std::string id = i->second->getString("id");
-			ConnMap::iterator curr = connections.find(id);
-			if (curr == connections.end())
+			PoolMap::iterator curr = pools.find(id);
+			SQLPool* pool;
+			if (curr == pools.end())
 			{
-				SQLConn* conn = new SQLConn(this, i->second);
-				if (conn->status != DEAD)
-				{
-					conns.insert(std::make_pair(id, conn));
-					ServerInstance->Modules->AddService(*conn);
-				}
-				// If the connection is dead it has already been queued for culling
-				// at the end of the main loop so we don't need to delete it here.
+				pool = new SQLPool(this, i->second);
+				newpools.insert(std::make_pair(id, pool));
+				ServerInstance->Modules->AddService(*pool);
 			}
 			else
 			{
-				conns.insert(*curr);
-				connections.erase(curr);
+				pool = curr->second;
+				newpools.insert(*curr);
+				pools.erase(curr);
 			}
+
+			// Replace any sessions which have died.
+			pool->Fill();
 		}
-		ClearAllConnections();
-		conns.swap(connections);
+		ClearAllPools();
+		newpools.swap(pools);
 	}
 
-	void ClearAllConnections()
+	void ClearAllPools()
 	{
-		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
 		{
-			i->second->cull();
+			ServerInstance->Modules->DelService(*i->second);
 			delete i->second;
 		}
-		connections.clear();
+		pools.clear();
 	}
 
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		SQL::Error err(SQL::BAD_DBID);
-		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
-		{
-			SQLConn* conn = i->second;
-			if (conn->qinprog.c && conn->qinprog.c->creator == mod)
-			{
-				conn->qinprog.c->OnError(err);
-				delete conn->qinprog.c;
-				conn->qinprog.c = NULL;
-			}
-			std::deque<QueueItem>::iterator j = conn->queue.begin();
-			while (j != conn->queue.end())
-			{
-				SQL::Query* q = j->c;
-				if (q->creator == mod)
-				{
-					q->OnError(err);
-					delete q;
-					j = conn->queue.erase(j);
-				}
-				else
-					j++;
-			}
-		}
+		for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
+			i->second->RemoveQueries(mod);
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'Q')
+			return MOD_RES_PASSTHRU;
+
+		for(PoolMap::iterator i = pools.begin(); i != pools.end(); i++)
+			i->second->AddStats(stats);
+
+		// Other SQL modules add their databases to this too.
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -630,11 +893,9 @@ bool ReconnectTimer::Tick(time_t time)
 void SQLConn::DelayReconnect()
 {
 	status = DEAD;
-	ModulePgSQL* mod = (ModulePgSQL*)(Module*)creator;
+	pool->RemoveConnection(this);
 
-	ConnMap::iterator it = mod->connections.find(conf->getString("id"));
-	if (it != mod->connections.end())
-		mod->connections.erase(it);
+	ModulePgSQL* mod = (ModulePgSQL*)(Module*)pool->creator;
 	ServerInstance->GlobalCulls.AddItem((EventHandler*)this);
 	if (!mod->retimer)
 	{
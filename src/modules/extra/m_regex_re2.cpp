@@ -43,6 +43,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 #ifdef __GNUC__
 # pragma GCC diagnostic pop
@@ -67,6 +68,42 @@ class RE2Regex : public Regex
 	}
 };
 
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set regexset;
+	std::vector<int> results;
+
+ public:
+	RE2RegexSet(const std::vector<std::string>& exprs)
+		: regexset(RE2::Quiet, RE2::ANCHOR_BOTH)
+	{
+		for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+		{
+			std::string error;
+			if (regexset.Add(*i, &error) < 0)
+				throw RegexException(*i, error);
+		}
+
+		if (!regexset.Compile())
+			throw ModuleException("Unable to compile a set of " + ConvToStr(exprs.size()) + " regular expressions: out of memory");
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		RE2::Set::ErrorInfo error;
+		if (!regexset.Match(text, &results, &error))
+		{
+			// If the DFA ran out of memory we can't tell whether anything matched.
+			return (error.kind == RE2::Set::kNoError);
+		}
+
+		std::sort(results.begin(), results.end());
+		matches.assign(results.begin(), results.end());
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -75,6 +112,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(exprs);
+	}
 };
 
 class ModuleRegexRE2 : public Module
@@ -58,18 +58,110 @@
 # pragma comment(lib, "sqlite3.lib")
 #endif
 
+/* SQLite executes queries in the thread which asks for them so running them in the main thread
+ * would stop the server from doing anything else until each query finishes. Instead this module
+ * works the same way as the MySQL module: queries are added to a queue which a dispatcher thread
+ * works through, and the results are added to another queue which the main thread is told about
+ * through a socket so it can send them to the modules which asked for them.
+ *
+ * Compiling a query takes about as long as executing a simple one so each database keeps the
+ * compiled form of the queries it has executed recently. Parameters which make up the whole of
+ * a string literal (e.g. '$nick') are bound to the compiled query instead of being written into
+ * it so queries which only differ in their parameters can share it.
+ */
+
 class SQLConn;
+class SQLite3Result;
+class DispatcherThread;
+
+struct QueryQueueItem
+{
+	// An SQL database which this query is executed on.
+	SQLConn* connection;
+
+	// An object which handles the result of the query.
+	SQL::Query* query;
+
+	// The SQL query which is to be executed.
+	std::string querystr;
+
+	// The values of the parameters of the query.
+	std::vector<std::string> params;
+
+	QueryQueueItem(SQL::Query* q, const std::string& s, SQLConn* c)
+		: connection(c)
+		, query(q)
+		, querystr(s)
+	{
+	}
+};
+
+struct ResultQueueItem
+{
+	// An object which handles the result of the query.
+	SQL::Query* query;
+
+	// The result returned from executing the SQLite query.
+	SQLite3Result* result;
+
+	ResultQueueItem(SQL::Query* q, SQLite3Result* r)
+		: query(q)
+		, result(r)
+	{
+	}
+};
+
 typedef insp::flat_map<std::string, SQLConn*> ConnMap;
+typedef std::deque<QueryQueueItem> QueryQueue;
+typedef std::deque<ResultQueueItem> ResultQueue;
+
+class ModuleSQLite3 : public Module
+{
+ public:
+	DispatcherThread* Dispatcher;
+	QueryQueue qq;  // MUST HOLD MUTEX
+	ResultQueue rq; // MUST HOLD MUTEX
+	ConnMap conns;  // main thread only
+
+	ModuleSQLite3();
+	void init() CXX11_OVERRIDE;
+	~ModuleSQLite3();
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	Version GetVersion() CXX11_OVERRIDE;
+};
+
+class DispatcherThread : public SocketThread
+{
+ private:
+	ModuleSQLite3* const Parent;
+ public:
+	DispatcherThread(ModuleSQLite3* CreatorModule) : Parent(CreatorModule) { }
+	~DispatcherThread() { }
+	void Run() CXX11_OVERRIDE;
+	void OnNotify() CXX11_OVERRIDE;
+};
 
 class SQLite3Result : public SQL::Result
 {
  public:
+	SQL::Error err;
 	int currentrow;
 	int rows;
 	std::vector<std::string> columns;
 	std::vector<SQL::Row> fieldlists;
 
-	SQLite3Result() : currentrow(0), rows(0)
+	SQLite3Result()
+		: err(SQL::SUCCESS)
+		, currentrow(0)
+		, rows(0)
+	{
+	}
+
+	SQLite3Result(const SQL::Error& e)
+		: err(e)
+		, currentrow(0)
+		, rows(0)
 	{
 	}
 
@@ -114,12 +206,183 @@ class SQLite3Result : public SQL::Result
 
 class SQLConn : public SQL::Provider
 {
+ private:
+	/** A compiled query which can be executed again. */
+	struct CachedStatement
+	{
+		// The compiled query.
+		sqlite3_stmt* stmt;
+
+		// The value of the use counter when this query was last executed.
+		unsigned long lastused;
+	};
+	typedef std::map<std::string, CachedStatement> StatementCache;
+
+	/** A parameter in a query which has not been filled in yet. */
+	struct Placeholder
+	{
+		// The position in the query at which the placeholder starts.
+		std::string::size_type start;
+
+		// The position in the query after the end of the placeholder.
+		std::string::size_type end;
+
+		// The value of the parameter or NULL if there is no value for it.
+		const std::string* value;
+
+		Placeholder(std::string::size_type s, std::string::size_type e, const std::string* v)
+			: start(s)
+			, end(e)
+			, value(v)
+		{
+		}
+	};
+	typedef std::vector<Placeholder> PlaceholderList;
+
+	// The handle of the database or NULL if it could not be opened.
 	sqlite3* conn;
-	reference<ConfigTag> config;
+
+	// The queries which have been compiled recently. Only used by the dispatcher thread.
+	StatementCache statements;
+
+	// Incremented whenever a cached query is used.
+	unsigned long usecounter;
+
+	// The maximum number of compiled queries to keep.
+	size_t maxstatements;
+
+	/** Retrieves the compiled form of a query, compiling it if it has not been compiled recently.
+	 * @param q The query to compile.
+	 * @return The compiled query or NULL if it could not be compiled.
+	 */
+	sqlite3_stmt* GetStatement(const std::string& q)
+	{
+		StatementCache::iterator it = statements.find(q);
+		if (it != statements.end())
+		{
+			it->second.lastused = ++usecounter;
+			return it->second.stmt;
+		}
+
+		sqlite3_stmt* stmt;
+		if (sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL) != SQLITE_OK)
+			return NULL;
+
+		if (statements.size() >= maxstatements)
+		{
+			// Make room by throwing away the query which has gone unused for the longest.
+			StatementCache::iterator oldest = statements.begin();
+			for (StatementCache::iterator i = statements.begin(); i != statements.end(); ++i)
+			{
+				if (i->second.lastused < oldest->second.lastused)
+					oldest = i;
+			}
+			sqlite3_finalize(oldest->second.stmt);
+			statements.erase(oldest);
+		}
+
+		CachedStatement& cached = statements[q];
+		cached.stmt = stmt;
+		cached.lastused = ++usecounter;
+		return stmt;
+	}
+
+	/** Throws away all of the compiled queries. */
+	void ClearStatements()
+	{
+		for (StatementCache::iterator i = statements.begin(); i != statements.end(); ++i)
+			sqlite3_finalize(i->second.stmt);
+		statements.clear();
+	}
+
+	/** Fills in the parameters of a query and submits it.
+	 * @param query The object which handles the result of the query.
+	 * @param q The query with the placeholders still in it.
+	 * @param placeholders The placeholders in the query in the order they appear.
+	 */
+	void SubmitPlaceholders(SQL::Query* query, const std::string& q, const PlaceholderList& placeholders)
+	{
+		// Parameters can only be bound to the compiled query if each of them makes up the whole
+		// of a string literal. Two quotes inside a literal are an escaped quote, not its end.
+		bool bindable = true;
+		bool inliteral = false;
+		std::string::size_type literalstart = 0;
+		std::string::size_type scanpos = 0;
+		for (PlaceholderList::const_iterator i = placeholders.begin(); bindable && i != placeholders.end(); ++i)
+		{
+			for (; scanpos < i->start; ++scanpos)
+			{
+				if (q[scanpos] != '\'')
+					continue;
+
+				if (!inliteral)
+				{
+					inliteral = true;
+					literalstart = scanpos;
+				}
+				else if (scanpos + 1 < q.length() && q[scanpos + 1] == '\'')
+					scanpos++;
+				else
+					inliteral = false;
+			}
+
+			const bool opens = inliteral && literalstart + 1 == i->start;
+			const bool closes = i->end < q.length() && q[i->end] == '\'' && (i->end + 1 >= q.length() || q[i->end + 1] != '\'');
+			bindable = opens && closes;
+			scanpos = i->end;
+		}
+
+		std::string res;
+		std::vector<std::string> params;
+		std::string::size_type pos = 0;
+		for (PlaceholderList::const_iterator i = placeholders.begin(); i != placeholders.end(); ++i)
+		{
+			if (bindable)
+			{
+				res.append(q, pos, i->start - 1 - pos);
+				res.push_back('?');
+				params.push_back(i->value ? *i->value : std::string());
+				pos = i->end + 1;
+			}
+			else
+			{
+				res.append(q, pos, i->start - pos);
+				if (i->value)
+				{
+					char* escaped = sqlite3_mprintf("%q", i->value->c_str());
+					res.append(escaped);
+					sqlite3_free(escaped);
+				}
+				pos = i->end;
+			}
+		}
+		res.append(q, pos, std::string::npos);
+
+		QueryQueueItem item(query, res, this);
+		item.params.swap(params);
+		Enqueue(item);
+	}
+
+	/** Adds a query to the queue of the dispatcher thread.
+	 * @param item The query to add. Its parameters are moved into the queue.
+	 */
+	void Enqueue(QueryQueueItem& item)
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Executing SQLite3 query: " + item.querystr);
+		Parent()->Dispatcher->LockQueue();
+		Parent()->qq.push_back(QueryQueueItem(item.query, item.querystr, this));
+		Parent()->qq.back().params.swap(item.params);
+		Parent()->Dispatcher->UnlockQueueWakeup();
+	}
 
  public:
+	reference<ConfigTag> config;
+	Mutex lock;
+
 	SQLConn(Module* Parent, ConfigTag* tag)
 		: SQL::Provider(Parent, tag->getString("id"))
+		, usecounter(0)
+		, maxstatements(tag->getUInt("statementcache", 32, 1))
 		, config(tag)
 	{
 		std::string host = tag->getString("hostname");
@@ -134,6 +397,8 @@ class SQLConn : public SQL::Provider
 
 	~SQLConn()
 	{
+		ClearStatements();
+
 		if (conn)
 		{
 			sqlite3_interrupt(conn);
@@ -141,149 +406,293 @@ class SQLConn : public SQL::Provider
 		}
 	}
 
-	void Query(SQL::Query* query, const std::string& q)
+	/** Applies the settings from a rehash to a database which has been kept open.
+	 * @param tag The new \<database> tag of the database.
+	 */
+	void Reconfigure(ConfigTag* tag)
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
-		{
-			SQL::Error error(SQL::QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
-			return;
-		}
+		// The dispatcher thread holds the lock while it is using the compiled queries.
+		lock.Lock();
+		ClearStatements();
+		maxstatements = tag->getUInt("statementcache", 32, 1);
+		config = tag;
+		lock.Unlock();
+	}
+
+	ModuleSQLite3* Parent()
+	{
+		return (ModuleSQLite3*)(Module*)creator;
+	}
+
+	SQLite3Result* DoBlockingQuery(const QueryQueueItem& item)
+	{
+		if (!conn)
+			return new SQLite3Result(SQL::Error(SQL::BAD_CONN, "The database could not be opened"));
+
+		sqlite3_stmt* stmt = GetStatement(item.querystr);
+		if (!stmt)
+			return new SQLite3Result(SQL::Error(SQL::QSEND_FAIL, sqlite3_errmsg(conn)));
+
+		// The values of the parameters stay alive until the query has been reset.
+		for (size_t i = 0; i < item.params.size(); ++i)
+			sqlite3_bind_text(stmt, i + 1, item.params[i].data(), item.params[i].length(), SQLITE_STATIC);
+
+		SQLite3Result* res = new SQLite3Result;
 		int cols = sqlite3_column_count(stmt);
-		res.columns.resize(cols);
+		res->columns.resize(cols);
 		for(int i=0; i < cols; i++)
 		{
-			res.columns[i] = sqlite3_column_name(stmt, i);
+			res->columns[i] = sqlite3_column_name(stmt, i);
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
-				res.fieldlists.resize(res.rows + 1);
-				res.fieldlists[res.rows].resize(cols);
+				res->fieldlists.resize(res->rows + 1);
+				res->fieldlists[res->rows].resize(cols);
 				for(int i=0; i < cols; i++)
 				{
 					const char* txt = (const char*)sqlite3_column_text(stmt, i);
 					if (txt)
-						res.fieldlists[res.rows][i] = SQL::Field(txt);
+						res->fieldlists[res->rows][i] = SQL::Field(txt);
 				}
-				res.rows++;
+				res->rows++;
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQL::Error error(SQL::QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				delete res;
+				res = new SQLite3Result(SQL::Error(SQL::QREPLY_FAIL, sqlite3_errmsg(conn)));
 				break;
 			}
 		}
-		sqlite3_finalize(stmt);
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		return res;
 	}
 
 	void Submit(SQL::Query* query, const std::string& q) CXX11_OVERRIDE
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Executing SQLite3 query: " + q);
-		Query(query, q);
-		delete query;
+		QueryQueueItem item(query, q, this);
+		Enqueue(item);
 	}
 
 	void Submit(SQL::Query* query, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
 	{
-		std::string res;
+		PlaceholderList placeholders;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
-			if (q[i] != '?')
-				res.push_back(q[i]);
-			else
-			{
-				if (param < p.size())
-				{
-					char* escaped = sqlite3_mprintf("%q", p[param++].c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
-				}
-			}
+			if (q[i] == '?')
+				placeholders.push_back(Placeholder(i, i + 1, param < p.size() ? &p[param++] : NULL));
 		}
-		Submit(query, res);
+		SubmitPlaceholders(query, q, placeholders);
 	}
 
 	void Submit(SQL::Query* query, const std::string& q, const SQL::ParamMap& p) CXX11_OVERRIDE
 	{
-		std::string res;
+		PlaceholderList placeholders;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
-			if (q[i] != '$')
-				res.push_back(q[i]);
-			else
+			if (q[i] == '$')
 			{
 				std::string field;
-				i++;
+				std::string::size_type start = i++;
 				while (i < q.length() && isalnum(q[i]))
 					field.push_back(q[i++]);
-				i--;
 
 				SQL::ParamMap::const_iterator it = p.find(field);
-				if (it != p.end())
-				{
-					char* escaped = sqlite3_mprintf("%q", it->second.c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
-				}
+				placeholders.push_back(Placeholder(start, i, it != p.end() ? &it->second : NULL));
+				i--;
 			}
 		}
-		Submit(query, res);
+		SubmitPlaceholders(query, q, placeholders);
 	}
 };
 
-class ModuleSQLite3 : public Module
+ModuleSQLite3::ModuleSQLite3()
+	: Dispatcher(NULL)
 {
-	ConnMap conns;
+}
 
- public:
-	~ModuleSQLite3()
+void ModuleSQLite3::init()
+{
+	if (!sqlite3_threadsafe())
+		throw ModuleException("The SQLite library was built without support for threads!");
+
+	Dispatcher = new DispatcherThread(this);
+	ServerInstance->Threads.Start(Dispatcher);
+}
+
+ModuleSQLite3::~ModuleSQLite3()
+{
+	if (Dispatcher)
 	{
-		ClearConns();
+		Dispatcher->join();
+		Dispatcher->OnNotify();
+		delete Dispatcher;
 	}
 
-	void ClearConns()
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+		delete i->second;
+	}
+}
+
+void ModuleSQLite3::ReadConfig(ConfigStatus& status)
+{
+	ConnMap newconns;
+	std::vector<SQLConn*> added;
+	ConfigTagList tags = ServerInstance->Config->ConfTags("database");
+	for(ConfigIter i = tags.first; i != tags.second; i++)
+	{
+		if (!stdalgo::string::equalsci(i->second->getString("module"), "sqlite"))
+			continue;
+
+		// Databases which have not moved are kept so their queued queries are not lost.
+		std::string id = i->second->getString("id");
+		ConnMap::iterator curr = conns.find(id);
+		if (curr != conns.end() && curr->second->config->getString("hostname") == i->second->getString("hostname"))
 		{
-			SQLConn* conn = i->second;
-			ServerInstance->Modules->DelService(*conn);
-			delete conn;
+			curr->second->Reconfigure(i->second);
+			newconns.insert(*curr);
+			conns.erase(curr);
+		}
+		else
+		{
+			SQLConn* conn = new SQLConn(this, i->second);
+			newconns.insert(std::make_pair(id, conn));
+			added.push_back(conn);
 		}
-		conns.clear();
 	}
 
-	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	// now clean up the deleted databases
+	Dispatcher->LockQueue();
+	SQL::Error err(SQL::BAD_DBID);
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		ClearConns();
-		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
-		for(ConfigIter i = tags.first; i != tags.second; i++)
+		ServerInstance->Modules->DelService(*i->second);
+		// it might be running a query on this database. Wait for that to complete
+		i->second->lock.Lock();
+		i->second->lock.Unlock();
+		// now remove all active queries to this DB
+		for (size_t j = qq.size(); j > 0; j--)
 		{
-			if (!stdalgo::string::equalsci(i->second->getString("module"), "sqlite"))
-				continue;
-			SQLConn* conn = new SQLConn(this, i->second);
-			conns.insert(std::make_pair(i->second->getString("id"), conn));
-			ServerInstance->Modules->AddService(*conn);
+			size_t k = j - 1;
+			if (qq[k].connection == i->second)
+			{
+				qq[k].query->OnError(err);
+				delete qq[k].query;
+				qq.erase(qq.begin() + k);
+			}
 		}
+		// finally, nuke the connection
+		delete i->second;
 	}
+	Dispatcher->UnlockQueue();
+	conns.swap(newconns);
+
+	// Replacements for databases which moved can only be registered once the old ones are gone.
+	for (std::vector<SQLConn*>::const_iterator i = added.begin(); i != added.end(); ++i)
+		ServerInstance->Modules->AddService(**i);
+}
 
-	Version GetVersion() CXX11_OVERRIDE
+void ModuleSQLite3::OnUnloadModule(Module* mod)
+{
+	SQL::Error err(SQL::BAD_DBID);
+	Dispatcher->LockQueue();
+	unsigned int i = qq.size();
+	while (i > 0)
 	{
-		return Version("Provides the ability for SQL modules to query a SQLite 3 database.", VF_VENDOR);
+		i--;
+		if (qq[i].query->creator == mod)
+		{
+			if (i == 0)
+			{
+				// need to wait until the query is done
+				// (the result will be discarded)
+				qq[i].connection->lock.Lock();
+				qq[i].connection->lock.Unlock();
+			}
+			qq[i].query->OnError(err);
+			delete qq[i].query;
+			qq.erase(qq.begin() + i);
+		}
 	}
-};
+	Dispatcher->UnlockQueue();
+	// clean up any result queue entries
+	Dispatcher->OnNotify();
+}
+
+Version ModuleSQLite3::GetVersion()
+{
+	return Version("Provides the ability for SQL modules to query a SQLite 3 database.", VF_VENDOR);
+}
+
+void DispatcherThread::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (!Parent->qq.empty())
+		{
+			QueryQueueItem i = Parent->qq.front();
+			i.connection->lock.Lock();
+			this->UnlockQueue();
+			SQLite3Result* res = i.connection->DoBlockingQuery(i);
+			i.connection->lock.Unlock();
+
+			/*
+			 * At this point, the main thread could be working on:
+			 *  Rehash - delete i.connection out from under us. We don't care about that.
+			 *  UnloadModule - delete i.query and the qq item. Need to avoid reporting results.
+			 */
+
+			this->LockQueue();
+			if (!Parent->qq.empty() && Parent->qq.front().query == i.query)
+			{
+				Parent->qq.pop_front();
+				Parent->rq.push_back(ResultQueueItem(i.query, res));
+				NotifyParent();
+			}
+			else
+			{
+				// UnloadModule ate the query
+				delete res;
+			}
+		}
+		else
+		{
+			/* We know the queue is empty, we can safely hang this thread until
+			 * something happens
+			 */
+			this->WaitForQueue();
+		}
+	}
+	this->UnlockQueue();
+}
+
+void DispatcherThread::OnNotify()
+{
+	// this could unlock during the dispatch, but OnResult isn't expected to take that long
+	this->LockQueue();
+	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
+	{
+		SQLite3Result* res = i->result;
+		if (res->err.code == SQL::SUCCESS)
+			i->query->OnResult(*res);
+		else
+			i->query->OnError(res->err);
+		delete i->query;
+		delete i->result;
+	}
+	Parent->rq.clear();
+	this->UnlockQueue();
+}
 
 MODULE_INIT(ModuleSQLite3)
@@ -0,0 +1,309 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/// $CompilerFlags: find_compiler_flags("zlib" "")
+/// $LinkerFlags: find_linker_flags("zlib" "-lz")
+
+/// $PackageInfo: require_system("alpine") zlib-dev pkgconf
+/// $PackageInfo: require_system("arch") pkgconf zlib
+/// $PackageInfo: require_system("centos") pkgconfig zlib-devel
+/// $PackageInfo: require_system("darwin") pkg-config zlib
+/// $PackageInfo: require_system("debian") pkg-config zlib1g-dev
+/// $PackageInfo: require_system("ubuntu") pkg-config zlib1g-dev
+
+
+#include "inspircd.h"
+#include "modules/websocket.h"
+
+#include <zlib.h>
+
+struct DeflateConfig
+{
+	// The zlib compression level to use for outgoing messages.
+	int level;
+
+	// The maximum amount of memory the compression state of a connection may use.
+	unsigned long memory;
+};
+
+class DeflateCompressor : public WebSocket::Compressor
+{
+ private:
+	// The amount of space to reserve at a time when inflating a message.
+	static const size_t INFLATE_CHUNK_SIZE = 4096;
+
+	// The compression state.
+	z_stream deflater;
+
+	// The decompression state.
+	z_stream inflater;
+
+	// Whether the compression state is reset after every message (server_no_context_takeover).
+	bool deflatereset;
+
+ public:
+	DeflateCompressor(bool reset)
+		: deflatereset(reset)
+	{
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+	}
+
+	~DeflateCompressor()
+	{
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+	}
+
+	/** Initialises the compression state.
+	 * @param level The zlib compression level to use.
+	 * @param deflatebits The size of the window to compress with.
+	 * @param memlevel The amount of memory to use for the internal compression state.
+	 * @param inflatebits The size of the window to decompress with.
+	 * @return True if the compression state was initialised; otherwise, false.
+	 */
+	bool Init(int level, int deflatebits, int memlevel, int inflatebits)
+	{
+		return deflateInit2(&deflater, level, Z_DEFLATED, -deflatebits, memlevel, Z_DEFAULT_STRATEGY) == Z_OK
+			&& inflateInit2(&inflater, -inflatebits) == Z_OK;
+	}
+
+	bool Compress(const std::string& message, std::string& out) CXX11_OVERRIDE
+	{
+		deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+		deflater.avail_in = message.length();
+
+		size_t outlen = 0;
+		out.resize(message.length() + 16);
+		do
+		{
+			if (outlen == out.length())
+				out.resize(out.length() * 2);
+
+			deflater.next_out = reinterpret_cast<Bytef*>(&out[outlen]);
+			deflater.avail_out = out.length() - outlen;
+			const int ret = deflate(&deflater, Z_SYNC_FLUSH);
+			outlen = out.length() - deflater.avail_out;
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				// The client has already seen every complete message so it is safe
+				// to start again with an empty window.
+				deflateReset(&deflater);
+				return false;
+			}
+		}
+		while (!deflater.avail_out);
+
+		// RFC 7692 requires the empty block that Z_SYNC_FLUSH ends with to be removed.
+		if (outlen >= 4 && !memcmp(&out[outlen - 4], "\x00\x00\xff\xff", 4))
+			outlen -= 4;
+		out.resize(outlen);
+
+		if (deflatereset)
+			deflateReset(&deflater);
+		return true;
+	}
+
+	bool Decompress(const char* data, size_t len, bool last, size_t maxlen, std::string& out) CXX11_OVERRIDE
+	{
+		const size_t startlen = out.length();
+		if (!Inflate(data, len, startlen + maxlen, out))
+			return false;
+
+		// The empty block removed by the client has to be added back to the end of the message.
+		return !last || Inflate("\x00\x00\xff\xff", 4, startlen + maxlen, out);
+	}
+
+	bool Inflate(const char* data, size_t len, size_t maxlen, std::string& out)
+	{
+		inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		inflater.avail_in = len;
+		do
+		{
+			const size_t outpos = out.length();
+			out.resize(outpos + INFLATE_CHUNK_SIZE);
+			inflater.next_out = reinterpret_cast<Bytef*>(&out[outpos]);
+			inflater.avail_out = INFLATE_CHUNK_SIZE;
+
+			const int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			out.resize(outpos + INFLATE_CHUNK_SIZE - inflater.avail_out);
+
+			// Stop as soon as the message gets too big to avoid decompression bombs.
+			if (out.length() > maxlen)
+				return false;
+
+			if (ret == Z_STREAM_END)
+				inflateReset(&inflater); // The client may end the stream at the end of a message.
+			else if (ret == Z_BUF_ERROR)
+				break; // All of the input has been consumed.
+			else if (ret != Z_OK)
+				return false;
+		}
+		while (inflater.avail_in || !inflater.avail_out);
+		return true;
+	}
+};
+
+class DeflateProvider : public WebSocket::CompressorProvider
+{
+ private:
+	static size_t GetDeflateMemory(int windowbits, int memlevel)
+	{
+		// From the memory usage notes in zconf.h.
+		return (1 << (windowbits + 2)) + (1 << (memlevel + 9));
+	}
+
+	static size_t GetInflateMemory(int windowbits)
+	{
+		// From the memory usage notes in zconf.h.
+		return (1 << windowbits) + 7168;
+	}
+
+	static bool ParseWindowBits(const std::string& value, int& windowbits)
+	{
+		// Quoted values are permitted by the extension syntax in RFC 6455.
+		std::string unquoted(value);
+		if (unquoted.length() >= 2 && unquoted[0] == '"' && unquoted[unquoted.length() - 1] == '"')
+			unquoted = unquoted.substr(1, unquoted.length() - 2);
+
+		if (unquoted.empty() || unquoted.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		windowbits = ConvToNum<int>(unquoted);
+		return windowbits >= 8 && windowbits <= 15;
+	}
+
+ public:
+	DeflateConfig config;
+
+	DeflateProvider(Module* mod)
+		: WebSocket::CompressorProvider(mod)
+	{
+	}
+
+	WebSocket::Compressor* Negotiate(const std::string& offers, std::string& response) CXX11_OVERRIDE
+	{
+		irc::commasepstream offerstream(offers);
+		for (std::string offer; offerstream.GetToken(offer); )
+		{
+			irc::sepstream paramstream(offer, ';');
+			std::string extname;
+			paramstream.GetToken(extname);
+			extname.erase(std::remove_if(extname.begin(), extname.end(), ::isspace), extname.end());
+			if (!stdalgo::string::equalsci(extname, "permessage-deflate"))
+				continue;
+
+			bool valid = true;
+			bool servernocontext = false;
+			int servermaxbits = 0;
+			int clientmaxbits = 0;
+			for (std::string param; valid && paramstream.GetToken(param); )
+			{
+				param.erase(std::remove_if(param.begin(), param.end(), ::isspace), param.end());
+
+				std::string value;
+				const std::string::size_type eqpos = param.find('=');
+				if (eqpos != std::string::npos)
+				{
+					value.assign(param, eqpos + 1, std::string::npos);
+					param.erase(eqpos);
+				}
+
+				if (stdalgo::string::equalsci(param, "server_no_context_takeover"))
+					servernocontext = true;
+				else if (stdalgo::string::equalsci(param, "client_no_context_takeover"))
+					continue; // We can always accept this.
+				else if (stdalgo::string::equalsci(param, "server_max_window_bits"))
+				{
+					// zlib can not compress with an 8 bit window so we have to decline that.
+					valid = ParseWindowBits(value, servermaxbits) && servermaxbits > 8;
+				}
+				else if (stdalgo::string::equalsci(param, "client_max_window_bits"))
+				{
+					if (value.empty())
+						clientmaxbits = 15;
+					else
+						valid = ParseWindowBits(value, clientmaxbits);
+				}
+				else
+					valid = false; // Unknown parameter.
+			}
+
+			if (!valid)
+				continue;
+
+			// Find the largest window that fits within the memory limit. We can only
+			// limit the window the client uses if it offered client_max_window_bits.
+			for (int windowbits = 15; windowbits >= 9; --windowbits)
+			{
+				const int deflatebits = servermaxbits ? std::min(windowbits, servermaxbits) : windowbits;
+				const int memlevel = std::max(1, deflatebits - 7);
+				const int clientbits = clientmaxbits ? std::min(windowbits, clientmaxbits) : 15;
+				const int inflatebits = std::max(9, clientbits);
+				if (GetDeflateMemory(deflatebits, memlevel) + GetInflateMemory(inflatebits) > config.memory)
+					continue;
+
+				DeflateCompressor* compressor = new DeflateCompressor(servernocontext);
+				if (!compressor->Init(config.level, deflatebits, memlevel, inflatebits))
+				{
+					delete compressor;
+					return NULL;
+				}
+
+				// RFC 7692 section 7.1.2.1 requires server_max_window_bits to be
+				// echoed back when the client offered it.
+				response = "permessage-deflate";
+				if (servernocontext)
+					response.append("; server_no_context_takeover");
+				if (servermaxbits)
+					response.append("; server_max_window_bits=").append(ConvToStr(deflatebits));
+				if (clientmaxbits)
+					response.append("; client_max_window_bits=").append(ConvToStr(clientbits));
+				return compressor;
+			}
+		}
+		return NULL;
+	}
+};
+
+class ModuleWebSocketDeflate : public Module
+{
+ private:
+	DeflateProvider deflateprov;
+
+ public:
+	ModuleWebSocketDeflate()
+		: deflateprov(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("websocket");
+
+		DeflateConfig config;
+		config.level = tag->getUInt("deflatelevel", 6, 1, 9);
+		config.memory = tag->getUInt("deflatememory", 131072, 16384);
+		deflateprov.config = config;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Allows WebSocket clients to compress messages with the permessage-deflate extension.", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleWebSocketDeflate)
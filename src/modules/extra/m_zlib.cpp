@@ -0,0 +1,324 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/// $CompilerFlags: find_compiler_flags("zlib" "")
+/// $LinkerFlags: find_linker_flags("zlib" "-lz")
+
+/// $PackageInfo: require_system("alpine") zlib-dev pkgconf
+/// $PackageInfo: require_system("arch") pkgconf zlib
+/// $PackageInfo: require_system("centos") pkgconfig zlib-devel
+/// $PackageInfo: require_system("darwin") pkg-config zlib
+/// $PackageInfo: require_system("debian") pkg-config zlib1g-dev
+/// $PackageInfo: require_system("ubuntu") pkg-config zlib1g-dev
+
+
+#include "inspircd.h"
+#include "iohook.h"
+#include "modules/compress.h"
+
+#include <zlib.h>
+
+// The amount of space to grow the output buffer by when inflating data.
+static const size_t INFLATE_CHUNK_SIZE = 16384;
+
+class ZlibHookProvider : public IOHookProvider
+{
+ public:
+	// The compression level to use for new connections.
+	int level;
+
+	// The maximum amount of decompressed data which may be waiting to be processed.
+	unsigned long recvqmax;
+
+	ZlibHookProvider(Module* mod)
+		: IOHookProvider(mod, "zlib", IOHookProvider::IOH_COMPRESSION, true)
+		, level(6)
+		, recvqmax(1048576)
+	{
+	}
+
+	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE;
+	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE;
+};
+
+class ZlibHook : public CompressIOHook
+{
+ private:
+	// The compression state.
+	z_stream deflater;
+
+	// The decompression state.
+	z_stream inflater;
+
+	// The number of bytes at the start of the upper send queue which are sent before compression starts.
+	size_t plainbytes;
+
+	// The maximum size of the upper receive queue.
+	const size_t recvqmax;
+
+	// Whether there is compressed data in the receive queue of this hook which is waiting to be decompressed.
+	bool pending;
+
+	/** Compresses some data and appends it to an output buffer.
+	 * @param data The data to compress.
+	 * @param len The length of the data to compress.
+	 * @param flush The zlib flush mode to use.
+	 * @param out The location to append the compressed data to.
+	 * @return True if the data was compressed; otherwise, false.
+	 */
+	bool Deflate(const char* data, size_t len, int flush, std::string& out)
+	{
+		deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		deflater.avail_in = len;
+		do
+		{
+			// The output of deflate is only slightly larger than its input in the worst case.
+			const size_t outpos = out.length();
+			const size_t outsize = deflateBound(&deflater, deflater.avail_in) + 16;
+			out.resize(outpos + outsize);
+			deflater.next_out = reinterpret_cast<Bytef*>(&out[outpos]);
+			deflater.avail_out = outsize;
+
+			const int ret = deflate(&deflater, flush);
+			out.resize(out.length() - deflater.avail_out);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return false;
+		}
+		while (deflater.avail_in || !deflater.avail_out);
+		return true;
+	}
+
+	/** Decompresses the data in the receive queue of this hook and appends it to an output
+	 * buffer. Once the output holds more than the receive queue limit decompression stops
+	 * and the rest of the input is left until the socket has processed the output, so a
+	 * small amount of input can not inflate to an unbounded amount of memory.
+	 * @param sock The socket the data was read from.
+	 * @param out The location to append the decompressed data to.
+	 * @return True if the data was decompressed; otherwise, false.
+	 */
+	bool Inflate(StreamSocket* sock, std::string& out)
+	{
+		// If the socket did not process any of the output from last time then it is
+		// waiting for a line which is longer than the limit.
+		if (out.length() >= recvqmax)
+		{
+			sock->SetError("RecvQ exceeded while decompressing");
+			return false;
+		}
+
+		const uint64_t starttime = InspIRCd::MonotonicTime();
+		const size_t startlen = out.length();
+		const bool resumed = pending;
+
+		std::string& in = GetRecvQ();
+		inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+		inflater.avail_in = in.length();
+		do
+		{
+			if (out.length() >= recvqmax && inflater.avail_in)
+				break; // The rest of the input is decompressed on a later read.
+
+			const size_t outpos = out.length();
+			out.resize(outpos + INFLATE_CHUNK_SIZE);
+			inflater.next_out = reinterpret_cast<Bytef*>(&out[outpos]);
+			inflater.avail_out = INFLATE_CHUNK_SIZE;
+
+			const int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			out.resize(outpos + INFLATE_CHUNK_SIZE - inflater.avail_out);
+			if (ret == Z_BUF_ERROR)
+				break; // All of the input has been consumed.
+
+			if (ret != Z_OK)
+			{
+				// The stream is never ended by the sender so Z_STREAM_END is an error too.
+				sock->SetError("Decompression error");
+				return false;
+			}
+		}
+		while (inflater.avail_in || !inflater.avail_out);
+
+		const size_t consumed = in.length() - inflater.avail_in;
+		in.erase(0, consumed);
+		pending = !in.empty();
+
+		// Ask to be called again to decompress the rest of the input. Nothing was read from
+		// the hooks below while we had input left over so they are given a turn too.
+		if (pending || resumed)
+			SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_READ);
+
+		stats.compressedin += consumed;
+		stats.rawin += out.length() - startlen;
+		stats.decompresstime += InspIRCd::MonotonicTime() - starttime;
+		return true;
+	}
+
+ public:
+	ZlibHook(IOHookProvider* hookprov, StreamSocket* sock, int level, size_t maxrecvq)
+		: CompressIOHook(hookprov)
+		, plainbytes(0)
+		, recvqmax(maxrecvq)
+		, pending(false)
+	{
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+		if (deflateInit(&deflater, level) != Z_OK || inflateInit(&inflater) != Z_OK)
+			sock->SetError("Unable to initialise zlib");
+		sock->AddIOHook(this);
+	}
+
+	~ZlibHook()
+	{
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+	}
+
+	void StartCompressing(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		if (compressing)
+			return;
+
+		compressing = true;
+		plainbytes = sock->GetSendQ().bytes();
+	}
+
+	bool StartDecompressing(StreamSocket* sock, std::string& recvq, std::string::size_type pos) CXX11_OVERRIDE
+	{
+		if (decompressing)
+			return true;
+
+		decompressing = true;
+		if (pos >= recvq.length())
+			return true;
+
+		// Everything after pos was read before the hook knew it was compressed.
+		GetRecvQ().insert(0, recvq, pos, std::string::npos);
+		recvq.erase(pos);
+		return Inflate(sock, recvq);
+	}
+
+	int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& uppersendq) CXX11_OVERRIDE
+	{
+		StreamSocket::SendQueue& mysendq = GetSendQ();
+		if (!compressing)
+		{
+			mysendq.moveall(uppersendq);
+			return 1;
+		}
+
+		// Send the data which was queued before compression was started as-is.
+		while (plainbytes && !uppersendq.empty())
+		{
+			const StreamSocket::SendQueue::Element& elem = uppersendq.front();
+			if (elem.length() > plainbytes)
+			{
+				mysendq.push_back(StreamSocket::SendQueue::Element(elem.data(), plainbytes));
+				uppersendq.erase_front(plainbytes);
+				plainbytes = 0;
+				break;
+			}
+			plainbytes -= elem.length();
+			mysendq.push_back(elem);
+			uppersendq.pop_front();
+		}
+
+		if (uppersendq.empty())
+			return 1;
+
+		// Compress everything that is queued and flush once at the end so a burst of
+		// writes within one iteration of the main loop is compressed together.
+		const uint64_t starttime = InspIRCd::MonotonicTime();
+		std::string compressed;
+		for (StreamSocket::SendQueue::const_iterator elem = uppersendq.begin(); elem != uppersendq.end(); ++elem)
+		{
+			StreamSocket::SendQueue::const_iterator next = elem;
+			const int flush = (++next == uppersendq.end()) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+			if (!Deflate(elem->data(), elem->length(), flush, compressed))
+			{
+				sock->SetError("Compression error");
+				return -1;
+			}
+		}
+
+		stats.rawout += uppersendq.bytes();
+		stats.compressedout += compressed.length();
+		stats.compresstime += InspIRCd::MonotonicTime() - starttime;
+
+		uppersendq.clear();
+		mysendq.push_back(compressed);
+		return 1;
+	}
+
+	int OnStreamSocketRead(StreamSocket* sock, std::string& destrecvq) CXX11_OVERRIDE
+	{
+		std::string& myrecvq = GetRecvQ();
+		if (!decompressing)
+		{
+			destrecvq.append(myrecvq);
+			myrecvq.clear();
+			return 1;
+		}
+
+		return Inflate(sock, destrecvq) ? 1 : -1;
+	}
+
+	bool HasPendingRead() const CXX11_OVERRIDE
+	{
+		return pending;
+	}
+
+	void OnStreamSocketClose(StreamSocket* sock) CXX11_OVERRIDE
+	{
+	}
+};
+
+void ZlibHookProvider::OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
+{
+	new ZlibHook(this, sock, level, recvqmax);
+}
+
+void ZlibHookProvider::OnConnect(StreamSocket* sock)
+{
+	// BufferedSocket leaves setting up the events of hooked outgoing connections to the
+	// hooks. This does nothing special so use the same events as an unhooked socket.
+	SocketEngine::ChangeEventMask(sock, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+	new ZlibHook(this, sock, level, recvqmax);
+}
+
+class ModuleZlib : public Module
+{
+ private:
+	reference<ZlibHookProvider> hookprov;
+
+ public:
+	ModuleZlib()
+		: hookprov(new ZlibHookProvider(this))
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("zlib");
+		hookprov->level = tag->getUInt("level", 6, 1, 9);
+		hookprov->recvqmax = tag->getUInt("recvq", 1048576, 65536);
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides the zlib IO hook which compresses server links.", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZlib)
@@ -252,7 +252,7 @@ class CommandCheck : public Command
 		else if (targetchan)
 		{
 			/* /check on a channel */
-			context.Write("createdat", targetchan->age);
+			context.Write("createdat", targetchan->GetAge());
 
 			if (!targetchan->topic.empty())
 			{
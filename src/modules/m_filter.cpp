@@ -201,7 +201,25 @@ class ModuleFilter
 	bool dirty;
 	std::string filterconf;
 	RegexFactory* factory;
+
+	/** All of the filters compiled into a single set or NULL if the regex engine does not support sets. */
+	RegexSet* filterset;
+
+	/** Whether filterset is up to date with the filter list. */
+	bool filtersetvalid;
+
+	/** Whether any of the filters in filterset match against text with the formatting stripped. */
+	bool filtersetstrip;
+
+	/** The indices of the filters in filterset which matched the last message. */
+	std::vector<size_t> setmatches;
+
+	/** The indices of the filters in filterset which matched the last message with the formatting stripped. */
+	std::vector<size_t> strippedsetmatches;
+
 	void FreeFilters();
+	void InvalidateFilterSet();
+	bool SetMatch(User* user, const std::string& text, int flags, FilterResult*& result);
 
  public:
 	CommandFilter filtcommand;
@@ -358,6 +376,9 @@ ModuleFilter::ModuleFilter()
 	, Timer(0, true)
 	, initing(true)
 	, dirty(false)
+	, filterset(NULL)
+	, filtersetvalid(false)
+	, filtersetstrip(false)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -381,6 +402,14 @@ void ModuleFilter::FreeFilters()
 
 	filters.clear();
 	dirty = true;
+	InvalidateFilterSet();
+}
+
+void ModuleFilter::InvalidateFilterSet()
+{
+	delete filterset;
+	filterset = NULL;
+	filtersetvalid = false;
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -759,8 +788,90 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 	}
 }
 
+bool ModuleFilter::SetMatch(User* user, const std::string& text, int flgs, FilterResult*& result)
+{
+	if (!filtersetvalid)
+	{
+		filtersetvalid = true;
+		filtersetstrip = false;
+
+		std::vector<std::string> patterns;
+		patterns.reserve(filters.size());
+		for (std::vector<FilterResult>::const_iterator i = filters.begin(); i != filters.end(); ++i)
+		{
+			patterns.push_back(i->freeform);
+			filtersetstrip |= i->flag_strip_color;
+		}
+
+		try
+		{
+			if (!patterns.empty() && RegexEngine)
+				filterset = RegexEngine->CreateSet(patterns);
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to compile filters into a set, falling back to matching them individually: %s", e.GetReason().c_str());
+		}
+	}
+
+	if (!filterset || !filterset->Matches(text, setmatches))
+		return false;
+
+	result = NULL;
+	if (filtersetstrip)
+	{
+		std::string stripped_text(text);
+		InspIRCd::StripColor(stripped_text);
+		if (stripped_text == text)
+			strippedsetmatches = setmatches;
+		else if (!filterset->Matches(stripped_text, strippedsetmatches))
+			return false;
+	}
+	else
+	{
+		strippedsetmatches.clear();
+	}
+
+	if (setmatches.empty() && strippedsetmatches.empty())
+		return true;
+
+	// Find the first filter that applies to this user and matched the text it is checked
+	// against. Only the filters which matched need their flags checking.
+	std::vector<size_t>::const_iterator plain = setmatches.begin();
+	std::vector<size_t>::const_iterator stripped = strippedsetmatches.begin();
+	while (plain != setmatches.end() || stripped != strippedsetmatches.end())
+	{
+		size_t index;
+		if (stripped == strippedsetmatches.end() || (plain != setmatches.end() && *plain < *stripped))
+			index = *plain++;
+		else if (plain == setmatches.end() || *stripped < *plain)
+			index = *stripped++;
+		else
+		{
+			index = *plain++;
+			stripped++;
+		}
+
+		FilterResult* filter = &filters[index];
+		if (!AppliesToMe(user, filter, flgs))
+			continue;
+
+		const std::vector<size_t>& matches = filter->flag_strip_color ? strippedsetmatches : setmatches;
+		if (std::binary_search(matches.begin(), matches.end(), index))
+		{
+			result = filter;
+			break;
+		}
+	}
+	return true;
+}
+
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
+	FilterResult* result;
+	if (SetMatch(user, text, flgs, result))
+		return result;
+
 	static std::string stripped_text;
 	stripped_text.clear();
 
@@ -794,6 +905,7 @@ bool ModuleFilter::DeleteFilter(const std::string& freeform, std::string& reason
 			delete i->regex;
 			filters.erase(i);
 			dirty = true;
+			InvalidateFilterSet();
 			return true;
 		}
 	}
@@ -814,6 +926,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, config));
 		dirty = true;
+		InvalidateFilterSet();
 	}
 	catch (ModuleException &e)
 	{
@@ -873,6 +986,7 @@ void ModuleFilter::ReadFilters()
 			removedfilters.insert(filter->freeform);
 			delete filter->regex;
 			filter = filters.erase(filter);
+			InvalidateFilterSet();
 			continue;
 		}
 
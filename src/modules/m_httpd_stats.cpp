@@ -124,6 +124,37 @@ namespace Stats
 		return data << "</isupport>";
 	}
 
+	void DumpDurations(std::ostream& data, const DurationStats& ds)
+	{
+		data << "<calls>" << ds.calls << "</calls><totalns>" << ds.totaltime
+			<< "</totalns><p50ns>" << ds.GetPercentile(50) << "</p50ns><p95ns>" << ds.GetPercentile(95)
+			<< "</p95ns><p99ns>" << ds.GetPercentile(99) << "</p99ns><maxns>" << ds.maxtime
+			<< "</maxns>";
+	}
+
+	std::ostream& MainLoop(std::ostream& data)
+	{
+		const MainLoopStats& ls = ServerInstance->LoopStats;
+		data << "<mainloop>";
+		for (int phase = 0; phase != MainLoopStats::PHASE_END; ++phase)
+		{
+			data << "<phase><name>" << MainLoopStats::GetPhaseName(static_cast<MainLoopStats::Phase>(phase)) << "</name>";
+			DumpDurations(data, ls.phases[phase]);
+			data << "</phase>";
+		}
+
+		data << "<busy>";
+		DumpDurations(data, ls.busy);
+		data << "</busy><events><iterations>" << ls.events.calls << "</iterations><total>" << ls.events.totaltime
+			<< "</total><p50>" << ls.events.GetPercentile(50) << "</p50><p99>" << ls.events.GetPercentile(99)
+			<< "</p99><max>" << ls.events.maxtime << "</max></events>";
+
+		data << "<slowthresholdns>" << ls.slowthreshold << "</slowthresholdns><slowcount>" << ls.slowcount << "</slowcount>";
+		if (ls.slowcount)
+			data << "<lastslow><time>" << ls.lastslowtime << "</time><description>" << Sanitize(ls.lastslow) << "</description></lastslow>";
+		return data << "</mainloop>";
+	}
+
 	std::ostream& General(std::ostream& data)
 	{
 		data << "<general>";
@@ -136,6 +167,7 @@ namespace Stats
 		data << "<currenttime>" << ServerInstance->Time() << "</currenttime>";
 
 		data << ISupport;
+		data << MainLoop;
 		return data << "</general>";
 	}
 
@@ -162,6 +194,22 @@ namespace Stats
 		return data << "</xlines>";
 	}
 
+	void DumpHookStats(std::ostream& data, const DurationStats* hookstats)
+	{
+		data << "<hooks>";
+		for (int event = 0; event != I_END; ++event)
+		{
+			const DurationStats& hs = hookstats[event];
+			if (!hs.calls)
+				continue;
+
+			data << "<hook><event>" << ModuleManager::GetEventName(static_cast<Implementation>(event)) << "</event>";
+			DumpDurations(data, hs);
+			data << "</hook>";
+		}
+		data << "</hooks>";
+	}
+
 	std::ostream& Modules(std::ostream& data)
 	{
 		data << "<modulelist>";
@@ -170,7 +218,10 @@ namespace Stats
 		for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
 		{
 			Version v = i->second->GetVersion();
-			data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
+			data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description>";
+			if (i->second->hookstats)
+				DumpHookStats(data, i->second->hookstats);
+			data << "</module>";
 		}
 		return data << "</modulelist>";
 	}
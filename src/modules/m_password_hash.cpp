@@ -85,14 +85,423 @@ class CommandMkpasswd : public Command
 	}
 };
 
+class HashWorker;
+
+struct PendingCheck
+{
+	// An object which handles the result of the comparison.
+	PasswordCheck* check;
+
+	// The name of the hash provider to compare with.
+	std::string hashtype;
+
+	// The password from the server config.
+	std::string data;
+
+	// The password which was provided.
+	std::string input;
+
+	PendingCheck(PasswordCheck* c, const std::string& ht, const std::string& d, const std::string& i)
+		: check(c)
+		, hashtype(ht)
+		, data(d)
+		, input(i)
+	{
+	}
+};
+
+typedef std::deque<PendingCheck> CheckQueue;
+
+/** Compares passwords against expensive hashes in the background.
+ */
+class PasswordCheckPool : public PasswordCheckAPIBase
+{
+ private:
+	// The workers which compare passwords.
+	std::vector<HashWorker*> workers;
+
+	// Comparisons which are waiting for a worker.
+	CheckQueue queue;
+
+	// Whether a comparison has been rejected since the queue was last empty.
+	bool overloaded;
+
+	void Finish(const PendingCheck& item, bool match)
+	{
+		if (item.check)
+		{
+			item.check->OnResult(match);
+			delete item.check;
+		}
+	}
+
+ public:
+	// The maximum number of comparisons which can wait for a worker.
+	size_t maxqueue;
+
+	PasswordCheckPool(Module* mod)
+		: PasswordCheckAPIBase(mod)
+		, overloaded(false)
+		, maxqueue(100)
+	{
+	}
+
+	~PasswordCheckPool()
+	{
+		Stop();
+	}
+
+	/** Determines whether any comparisons are done in the background. */
+	bool HasWorkers() const { return !workers.empty(); }
+
+	void SetWorkers(size_t count);
+	void Stop();
+	void Dispatch();
+	void OnResult(HashWorker* worker, bool match);
+	void RemoveChecks(Module* mod);
+	void OnProviderDel(ServiceProvider& prov);
+	bool IsBackground(const std::string& hashtype) CXX11_OVERRIDE;
+	void Compare(PasswordCheck* check, Extensible* ex, const std::string& data, const std::string& input, const std::string& hashtype) CXX11_OVERRIDE;
+};
+
+class HashWorker : public SocketThread
+{
+ private:
+	PasswordCheckPool* const pool;
+
+	// The provider to compare with. MUST HOLD MUTEX
+	HashProvider* provider;
+
+	// The passwords to compare. MUST HOLD MUTEX
+	std::string data;
+	std::string input;
+
+	// Whether a comparison is waiting to be started. MUST HOLD MUTEX
+	bool pending;
+
+	// Whether a comparison has finished and the result of it. MUST HOLD MUTEX
+	bool done;
+	bool match;
+
+ public:
+	// Whether the worker has been given a comparison. Main thread only.
+	bool busy;
+
+	// The provider the worker is comparing with. Main thread only.
+	HashProvider* busyprovider;
+
+	// The comparison the worker is doing. Its check is NULL if the module that submitted
+	// it has been unloaded. Main thread only.
+	PendingCheck inprogress;
+
+	HashWorker(PasswordCheckPool* p)
+		: pool(p)
+		, provider(NULL)
+		, pending(false)
+		, done(false)
+		, match(false)
+		, busy(false)
+		, busyprovider(NULL)
+		, inprogress(NULL, "", "", "")
+	{
+	}
+
+	/** Hands a comparison to the worker. Called from the main thread. */
+	void Execute(HashProvider* hp, const PendingCheck& item)
+	{
+		busy = true;
+		busyprovider = hp;
+		inprogress = item;
+		this->LockQueue();
+		provider = hp;
+		data = item.data;
+		input = item.input;
+		pending = true;
+		this->UnlockQueueWakeup();
+	}
+
+	/** Takes the result of the last comparison from the worker. Called from the main thread.
+	 * @return True if the comparison has finished; otherwise, false.
+	 */
+	bool TakeResult(bool& result)
+	{
+		this->LockQueue();
+		const bool finished = done;
+		result = match;
+		done = false;
+		this->UnlockQueue();
+		return finished;
+	}
+
+	/** Takes back the comparison the worker has been given if it has not been started or waits for
+	 * it to finish if it has. Called from the main thread.
+	 * @return True if the comparison was taken back; otherwise, false.
+	 */
+	bool Reclaim()
+	{
+		// The worker holds the mutex while it compares so this waits for it to finish.
+		this->LockQueue();
+		const bool reclaimed = pending;
+		pending = false;
+		this->UnlockQueue();
+		return reclaimed;
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (pending)
+			{
+				// The mutex is deliberately held while comparing so that the main thread can
+				// wait for the provider to stop being used before it is deleted.
+				pending = false;
+				match = provider->Compare(input, data);
+				done = true;
+				input.clear();
+				NotifyParent();
+			}
+			else
+			{
+				this->WaitForQueue();
+			}
+		}
+		this->UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		bool result;
+		if (TakeResult(result))
+			pool->OnResult(this, result);
+	}
+};
+
+void PasswordCheckPool::Stop()
+{
+	SetWorkers(0);
+
+	CheckQueue failed;
+	failed.swap(queue);
+	for (CheckQueue::const_iterator i = failed.begin(); i != failed.end(); ++i)
+		Finish(*i, false);
+}
+
+void PasswordCheckPool::SetWorkers(size_t count)
+{
+	while (workers.size() < count)
+	{
+		HashWorker* worker = new HashWorker(this);
+		ServerInstance->Threads.Start(worker);
+		workers.push_back(worker);
+	}
+
+	if (workers.size() <= count)
+		return;
+
+	// Ask every worker which is being removed to stop before waiting for any of them.
+	for (size_t i = count; i < workers.size(); ++i)
+		workers[i]->SetExitFlag();
+
+	std::vector<HashWorker*> removed(workers.begin() + count, workers.end());
+	workers.resize(count);
+	for (std::vector<HashWorker*>::const_iterator i = removed.begin(); i != removed.end(); ++i)
+	{
+		HashWorker* worker = *i;
+		worker->join();
+
+		bool result;
+		if (worker->busy && worker->TakeResult(result))
+			Finish(worker->inprogress, result);
+		else if (worker->busy)
+			queue.push_front(worker->inprogress);
+		delete worker;
+	}
+}
+
+void PasswordCheckPool::Dispatch()
+{
+	for (size_t i = 0; i < workers.size() && !queue.empty(); ++i)
+	{
+		HashWorker* worker = workers[i];
+		while (!worker->busy && !queue.empty())
+		{
+			PendingCheck item = queue.front();
+			queue.pop_front();
+
+			// The provider may have been unloaded while the comparison was queued.
+			HashProvider* hp = ServerInstance->Modules->FindDataService<HashProvider>("hash/" + item.hashtype);
+			if (hp)
+				worker->Execute(hp, item);
+			else
+				Finish(item, false);
+		}
+	}
+
+	if (queue.empty())
+		overloaded = false;
+}
+
+void PasswordCheckPool::OnResult(HashWorker* worker, bool match)
+{
+	PendingCheck item = worker->inprogress;
+	worker->busy = false;
+	worker->busyprovider = NULL;
+	worker->inprogress.check = NULL;
+
+	Finish(item, match);
+	Dispatch();
+}
+
+void PasswordCheckPool::RemoveChecks(Module* mod)
+{
+	for (std::vector<HashWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		// The result will be discarded when the worker finishes comparing.
+		HashWorker* worker = *i;
+		if (worker->busy && worker->inprogress.check && worker->inprogress.check->creator == mod)
+		{
+			delete worker->inprogress.check;
+			worker->inprogress.check = NULL;
+		}
+	}
+
+	for (size_t j = queue.size(); j > 0; j--)
+	{
+		size_t k = j - 1;
+		if (queue[k].check->creator == mod)
+		{
+			delete queue[k].check;
+			queue.erase(queue.begin() + k);
+		}
+	}
+}
+
+void PasswordCheckPool::OnProviderDel(ServiceProvider& prov)
+{
+	bool requeued = false;
+	for (std::vector<HashWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		HashWorker* worker = *i;
+		if (!worker->busy || worker->busyprovider != &prov)
+			continue;
+
+		// If the comparison has already been started this waits for it to finish so that
+		// the provider can be deleted safely. Its result is handled as normal.
+		if (worker->Reclaim())
+		{
+			queue.push_front(worker->inprogress);
+			worker->busy = false;
+			worker->busyprovider = NULL;
+			worker->inprogress.check = NULL;
+			requeued = true;
+		}
+	}
+
+	// The provider has already been removed so the reclaimed comparisons will use
+	// a replacement for it or fail.
+	if (requeued)
+		Dispatch();
+}
+
+bool PasswordCheckPool::IsBackground(const std::string& hashtype)
+{
+	// HMAC only needs a few hashes to be computed so it is always compared on the main thread.
+	if (workers.empty() || !hashtype.compare(0, 5, "hmac-", 5))
+		return false;
+
+	HashProvider* hp = ServerInstance->Modules->FindDataService<HashProvider>("hash/" + hashtype);
+	return hp && hp->IsExpensive();
+}
+
+void PasswordCheckPool::Compare(PasswordCheck* check, Extensible* ex, const std::string& data, const std::string& input, const std::string& hashtype)
+{
+	if (!IsBackground(hashtype))
+	{
+		check->OnResult(ServerInstance->PassCompare(ex, data, input, hashtype));
+		delete check;
+		return;
+	}
+
+	if (queue.size() >= maxqueue)
+	{
+		if (!overloaded)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Too many passwords are waiting to be compared; rejecting new attempts until the queue has emptied");
+			overloaded = true;
+		}
+		check->OnResult(false);
+		delete check;
+		return;
+	}
+
+	queue.push_back(PendingCheck(check, hashtype, data, input));
+	Dispatch();
+}
+
+/** The results of comparing the password a connecting user sent against the passwords of the connect classes. */
+struct ClassPasswords
+{
+	// The number of comparisons which have not finished yet.
+	unsigned int pending;
+
+	// The results of the comparisons which have finished, keyed by ClassPasswords::Key.
+	std::map<std::string, bool> results;
+
+	ClassPasswords()
+		: pending(0)
+	{
+	}
+
+	static std::string Key(const std::string& data, const std::string& input, const std::string& hashtype)
+	{
+		std::string key(hashtype);
+		key.append(1, '\0').append(data).append(1, '\0').append(input);
+		return key;
+	}
+};
+
+class ClassPasswordCheck : public PasswordCheck
+{
+ private:
+	SimpleExtItem<ClassPasswords>& ext;
+	const std::string uuid;
+	const std::string key;
+
+ public:
+	ClassPasswordCheck(Module* mod, SimpleExtItem<ClassPasswords>& e, LocalUser* user, const std::string& k)
+		: PasswordCheck(mod)
+		, ext(e)
+		, uuid(user->uuid)
+		, key(k)
+	{
+	}
+
+	void OnResult(bool match) CXX11_OVERRIDE
+	{
+		User* user = ServerInstance->FindUUID(uuid);
+		ClassPasswords* passwords = user ? ext.get(user) : NULL;
+		if (!passwords)
+			return;
+
+		passwords->pending--;
+		passwords->results[key] = match;
+	}
+};
+
 class ModulePasswordHash : public Module
 {
  private:
 	CommandMkpasswd cmd;
+	SimpleExtItem<ClassPasswords> classpasswords;
+	PasswordCheckPool pool;
 
  public:
 	ModulePasswordHash()
 		: cmd(this)
+		, classpasswords("classpasswords", ExtensionItem::EXT_USER, this)
+		, pool(this)
 	{
 	}
 
@@ -100,10 +509,88 @@ class ModulePasswordHash : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("mkpasswd");
 		cmd.flags_needed = tag->getBool("operonly") ? 'o' : 0;
+
+		ConfigTag* hashtag = ServerInstance->Config->ConfValue("passwordhash");
+		pool.maxqueue = hashtag->getUInt("maxqueue", 100, 1);
+		pool.SetWorkers(hashtag->getUInt("threads", 2, 0, 64));
+		pool.Dispatch();
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		// Stop the workers while OnServiceDel is still called for this module so a
+		// hash provider can not be deleted while a worker is using it.
+		if (mod == this)
+			pool.Stop();
+		else
+			pool.RemoveChecks(mod);
+	}
+
+	void OnServiceDel(ServiceProvider& service) CXX11_OVERRIDE
+	{
+		if (!service.name.compare(0, 5, "hash/"))
+			pool.OnProviderDel(service);
+	}
+
+	void Prioritize() CXX11_OVERRIDE
+	{
+		// Connect classes can only be matched against the hostname of a user once it has been
+		// looked up so the comparisons are not started until every other module is ready.
+		ServerInstance->Modules->SetPriority(this, I_OnCheckReady, PRIORITY_LAST);
+	}
+
+	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
+	{
+		ClassPasswords* passwords = classpasswords.get(user);
+		if (passwords)
+			return passwords->pending ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+
+		if (user->password.empty() || !pool.HasWorkers())
+			return MOD_RES_PASSTHRU;
+
+		// Start comparing the password against the expensive connect class passwords now so the
+		// connect class can be picked without blocking once the comparisons have finished.
+		passwords = new ClassPasswords;
+		classpasswords.set(user, passwords);
+
+		std::set<std::string> keys;
+		for (ServerConfig::ClassVector::const_iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); ++i)
+		{
+			ConnectClass* c = *i;
+			if (c->password.empty() || !pool.IsBackground(c->passwordhash))
+				continue;
+
+			bool hostmatches = false;
+			for (std::vector<std::string>::const_iterator host = c->GetHosts().begin(); host != c->GetHosts().end(); ++host)
+			{
+				if (InspIRCd::MatchCIDR(user->GetIPString(), *host) || InspIRCd::MatchCIDR(user->GetRealHost(), *host))
+				{
+					hostmatches = true;
+					break;
+				}
+			}
+
+			const std::string key = ClassPasswords::Key(c->password, user->password, c->passwordhash);
+			if (!hostmatches || !keys.insert(key).second)
+				continue;
+
+			passwords->pending++;
+			pool.Compare(new ClassPasswordCheck(this, classpasswords, user, key), user, c->password, user->password, c->passwordhash);
+		}
+		return passwords->pending ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 	}
 
 	ModResult OnPassCompare(Extensible* ex, const std::string &data, const std::string &input, const std::string &hashtype) CXX11_OVERRIDE
 	{
+		// Use the result of a comparison which was done in the background when registering.
+		ClassPasswords* passwords = classpasswords.get(ex);
+		if (passwords)
+		{
+			std::map<std::string, bool>::const_iterator result = passwords->results.find(ClassPasswords::Key(data, input, hashtype));
+			if (result != passwords->results.end())
+				return result->second ? MOD_RES_ALLOW : MOD_RES_DENY;
+		}
+
 		if (!hashtype.compare(0, 5, "hmac-", 5))
 		{
 			std::string type(hashtype, 5);
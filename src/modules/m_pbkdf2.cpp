@@ -134,6 +134,11 @@ class PBKDF2Provider : public HashProvider
 		return raw;
 	}
 
+	bool IsExpensive() const CXX11_OVERRIDE
+	{
+		return true;
+	}
+
 	PBKDF2Provider(Module* mod, HashProvider* hp)
 		: HashProvider(mod, "pbkdf2-hmac-" + hp->name.substr(hp->name.find('/') + 1))
 		, provider(hp)
@@ -142,7 +142,7 @@ static bool WriteDatabase(PermChannel& permchanmode, Module* mod, bool save_list
 		}
 
 		stream << "<permchannels channel=\"" << ServerConfig::Escape(chan->name)
-			<< "\" ts=\"" << chan->age
+			<< "\" ts=\"" << chan->GetAge()
 			<< "\" topic=\"" << ServerConfig::Escape(chan->topic)
 			<< "\" topicts=\"" << chan->topicset
 			<< "\" topicsetby=\"" << ServerConfig::Escape(chan->setby)
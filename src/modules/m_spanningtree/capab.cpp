@@ -26,6 +26,7 @@
 
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "treeserver.h"
 #include "utils.h"
@@ -207,6 +208,11 @@ void TreeSocket::SendCapabilities(int phase)
 	if (eiter != tokens.end())
 		extra.append(" EXTBANS=" + eiter->second);
 
+	// Offer to compress the link if it has a compression hook.
+	CompressIOHook* compress = CompressIOHook::Get(this);
+	if (compress)
+		extra.append(" COMPRESSION=" + compress->prov->name);
+
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
 			" CHANMAX="+ConvToStr(ServerInstance->Config->Limits.ChanMax)+
@@ -416,6 +422,15 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 			}
 		}
 
+		// If both sides have the same compression hook then everything we send from now on is compressed.
+		CompressIOHook* compress = CompressIOHook::Get(this);
+		std::map<std::string,std::string>::iterator c = this->capab->CapKeys.find("COMPRESSION");
+		if ((compress) && (!compress->IsCompressing()) && (c != this->capab->CapKeys.end()) && (c->second == compress->prov->name))
+		{
+			this->WriteLine("CAPAB COMPRESS :" + compress->prov->name);
+			compress->StartCompressing(this);
+		}
+
 		/* Challenge response, store their challenge for our password */
 		std::map<std::string,std::string>::iterator n = this->capab->CapKeys.find("CHALLENGE");
 		if ((n != this->capab->CapKeys.end()) && (ServerInstance->Modules->FindService(SERVICE_DATA, "hash/sha256")))
@@ -470,6 +485,18 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 	{
 		capab->UserModes = params[1];
 	}
+	else if ((params[0] == "COMPRESS") && (params.size() == 2))
+	{
+		CompressIOHook* compress = CompressIOHook::Get(this);
+		if ((!compress) || (compress->IsDecompressing()) || (params[1] != compress->prov->name))
+		{
+			this->SendError("CAPAB negotiation failed: Unexpected compression method " + params[1]);
+			return false;
+		}
+
+		// The rest of the recvq is decompressed by OnDataReady once this line has been processed.
+		capab->decompress = true;
+	}
 	else if ((params[0] == "CAPABILITIES") && (params.size() == 2))
 	{
 		irc::spacesepstream capabs(params[1]);
@@ -38,6 +38,9 @@ void TreeSocket::WriteLineNoCompat(const std::string& line)
 
 void TreeSocket::WriteLine(const std::string& original_line)
 {
+	if (burst)
+		CheckBurstLine(original_line);
+
 	if (LinkState == CONNECTED)
 	{
 		if (proto_version != PROTO_NEWEST)
@@ -78,7 +81,7 @@ void TreeSocket::WriteLine(const std::string& original_line)
 							return;
 
 						line.push_back(' ');
-						line.append(ConvToStr(chan->age));
+						line.append(ConvToStr(chan->GetAge()));
 						line.append(" + ,");
 					}
 					else
@@ -332,6 +335,29 @@ void TreeSocket::WriteLine(const std::string& original_line)
 	WriteLineNoCompat(original_line);
 }
 
+void TreeSocket::WriteLine(const std::string& line, reference<SendQueue::SharedBuffer>& shared)
+{
+	if ((LinkState == CONNECTED) && (proto_version != PROTO_NEWEST))
+	{
+		WriteLine(line);
+		return;
+	}
+
+	if (burst)
+		CheckBurstLine(line);
+
+	if (!shared)
+	{
+		std::string data;
+		data.reserve(line.length() + 1);
+		data.append(line).push_back('\n');
+		shared = new SendQueue::SharedBuffer(data);
+	}
+
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+	this->WriteData(shared);
+}
+
 namespace
 {
 	bool InsertCurrentChannelTS(CommandBase::Params& params, unsigned int chanindex = 0, unsigned int pos = 1)
@@ -341,7 +367,7 @@ namespace
 			return false;
 
 		// Insert the current TS of the channel after the pos-th parameter
-		params.insert(params.begin()+pos, ConvToStr(chan->age));
+		params.insert(params.begin()+pos, ConvToStr(chan->GetAge()));
 		return true;
 	}
 }
@@ -470,7 +496,7 @@ bool TreeSocket::PreProcessOldProtocolMessage(User*& who, std::string& cmd, Comm
 
 		cmd = "FJOIN";
 		Channel* chan = ServerInstance->FindChan(params[0]);
-		params.push_back(ConvToStr(chan ? chan->age : ServerInstance->Time()));
+		params.push_back(ConvToStr(chan ? chan->GetAge() : ServerInstance->Time()));
 		params.push_back("+");
 		params.push_back(",");
 		params.back().append(who->uuid);
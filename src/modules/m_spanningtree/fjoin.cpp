@@ -132,7 +132,7 @@ CmdResult CommandFJoin::Handle(User* srcuser, Params& params)
 	}
 	else
 	{
-		time_t ourTS = chan->age;
+		time_t ourTS = chan->GetAge();
 		if (TS != ourTS)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Merge FJOIN received for %s, ourTS: %lu, TS: %lu, difference: %ld",
@@ -281,12 +281,12 @@ void CommandFJoin::LowerTS(Channel* chan, time_t TS, const std::string& newname)
 	{
 		// WriteRemoteNotice is not used here because the message only needs to go to the local server.
 		chan->WriteNotice(InspIRCd::Format("Creation time of %s changed from %s to %s", newname.c_str(),
-			InspIRCd::TimeString(chan->age).c_str(), InspIRCd::TimeString(TS).c_str()));
+			InspIRCd::TimeString(chan->GetAge()).c_str(), InspIRCd::TimeString(TS).c_str()));
 	}
 
 	// While the name is equal in case-insensitive compare, it might differ in case; use the remote version
 	chan->name = newname;
-	chan->age = TS;
+	chan->SetAge(TS);
 
 	// Clear all modes
 	CommandFJoin::RemoveStatus(chan);
@@ -302,7 +302,7 @@ void CommandFJoin::LowerTS(Channel* chan, time_t TS, const std::string& newname)
 CommandFJoin::Builder::Builder(Channel* chan, TreeServer* source)
 	: CmdBuilder(source, "FJOIN")
 {
-	push(chan->name).push_int(chan->age).push_raw(" +");
+	push(chan->name).push_int(chan->GetAge()).push_raw(" +");
 	pos = str().size();
 	push_raw(chan->ChanModes(true)).push_raw(" :");
 }
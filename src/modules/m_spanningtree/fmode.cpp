@@ -36,7 +36,7 @@ CmdResult CommandFMode::Handle(User* who, Params& params)
 		return CMD_FAILURE;
 
 	// Extract the TS of the channel in question
-	time_t ourTS = chan->age;
+	time_t ourTS = chan->GetAge();
 
 	/* If the TS is greater than ours, we drop the mode and don't pass it anywhere.
 	 */
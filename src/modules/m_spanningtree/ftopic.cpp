@@ -32,7 +32,7 @@ CmdResult CommandFTopic::Handle(User* user, Params& params)
 	if (!c)
 		return CMD_FAILURE;
 
-	if (c->age < ServerCommand::ExtractTS(params[1]))
+	if (c->GetAge() < ServerCommand::ExtractTS(params[1]))
 		// Our channel TS is older, nothing to do
 		return CMD_FAILURE;
 
@@ -76,7 +76,7 @@ CommandFTopic::Builder::Builder(Channel* chan)
 	: CmdBuilder("FTOPIC")
 {
 	push(chan->name);
-	push_int(chan->age);
+	push_int(chan->GetAge());
 	push_int(chan->topicset);
 	push(chan->setby);
 	push_last(chan->topic);
@@ -87,7 +87,7 @@ CommandFTopic::Builder::Builder(User* user, Channel* chan)
 	: CmdBuilder(user, "FTOPIC")
 {
 	push(chan->name);
-	push_int(chan->age);
+	push_int(chan->GetAge());
 	push_int(chan->topicset);
 	push_last(chan->topic);
 }
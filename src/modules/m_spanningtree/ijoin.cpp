@@ -43,7 +43,7 @@ CmdResult CommandIJoin::HandleRemote(RemoteUser* user, Params& params)
 	if (params.size() > 3)
 	{
 		time_t RemoteTS = ServerCommand::ExtractTS(params[2]);
-		apply_modes = (RemoteTS <= chan->age);
+		apply_modes = (RemoteTS <= chan->GetAge());
 	}
 	else
 		apply_modes = false;
@@ -39,6 +39,7 @@ class Link : public refcountbase
 	std::vector<std::string> AllowMasks;
 	bool HiddenFromStats;
 	std::string Hook;
+	std::string Compress;
 	unsigned int Timeout;
 	std::string Bind;
 	bool Hidden;
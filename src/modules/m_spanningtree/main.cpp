@@ -364,7 +364,7 @@ void ModuleSpanningTree::OnUserInvite(User* source, User* dest, Channel* channel
 		CmdBuilder params(source, "INVITE");
 		params.push(dest->uuid);
 		params.push(channel->name);
-		params.push_int(channel->age);
+		params.push_int(channel->GetAge());
 		params.push(ConvToStr(expiry));
 		params.Broadcast();
 	}
@@ -521,7 +521,7 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 		params.push_int(memb->id);
 		if (!memb->modes.empty())
 		{
-			params.push(ConvToStr(memb->chan->age));
+			params.push(ConvToStr(memb->chan->GetAge()));
 			params.push(memb->modes);
 		}
 		params.Broadcast();
@@ -789,7 +789,7 @@ void ModuleSpanningTree::OnMode(User* source, User* u, Channel* c, const Modes::
 	{
 		CmdBuilder params(source, "FMODE");
 		params.push(c->name);
-		params.push_int(c->age);
+		params.push_int(c->GetAge());
 		params.push(ClientProtocol::Messages::Mode::ToModeLetters(modes));
 		params.push_raw(Translate::ModeChangeListToParams(modes.getlist()));
 		params.Broadcast();
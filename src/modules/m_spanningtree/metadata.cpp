@@ -47,7 +47,7 @@ CmdResult CommandMetadata::Handle(User* srcuser, Params& params)
 			return CMD_FAILURE;
 
 		time_t ChanTS = ServerCommand::ExtractTS(params[1]);
-		if (c->age < ChanTS)
+		if (c->GetAge() < ChanTS)
 			// Their TS is newer than ours, discard this command and do not propagate
 			return CMD_FAILURE;
 
@@ -87,7 +87,7 @@ CommandMetadata::Builder::Builder(Channel* chan, const std::string& key, const s
 	: CmdBuilder("METADATA")
 {
 	push(chan->name);
-	push_int(chan->age);
+	push_int(chan->GetAge());
 	push(key);
 	push_last(val);
 }
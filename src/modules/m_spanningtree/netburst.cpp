@@ -46,7 +46,7 @@ class FModeBuilder : public CmdBuilder
 	FModeBuilder(Channel* chan)
 		: CmdBuilder("FMODE"), modes(0)
 	{
-		push(chan->name).push_int(chan->age).push_raw(" +");
+		push(chan->name).push_int(chan->GetAge()).push_raw(" +");
 		startpos = str().size();
 	}
 
@@ -95,8 +95,82 @@ class FModeBuilder : public CmdBuilder
 
 struct TreeSocket::BurstState
 {
+	/** The parts of a netburst in the order they are sent. */
+	enum Stage
+	{
+		STAGE_USERS,
+		STAGE_CHANNELS,
+		STAGE_XLINES,
+		STAGE_DONE
+	};
+
 	SpanningTreeProtocolInterface::Server server;
-	BurstState(TreeSocket* sock) : server(sock) { }
+
+	/** The part of the burst which is being sent. */
+	Stage stage;
+
+	/** The UUIDs of the users which have not been sent yet. These are looked up again when
+	 * they are sent as they may have quit since the burst started.
+	 */
+	std::set<std::string> users;
+
+	/** The names of the channels which have not been sent yet. */
+	std::set<std::string> channels;
+
+	/** The X-line types which the current stage has to send. */
+	std::vector<std::string> pending;
+
+	/** The index in pending of the next item to send. */
+	size_t position;
+
+	/** The mask of the last X-line which was sent of the type at pending[position]. */
+	std::string lastxline;
+
+	/** Whether the lines being written are part of the burst. */
+	bool sending;
+
+	BurstState(TreeSocket* sock)
+		: server(sock)
+		, stage(STAGE_USERS)
+		, position(0)
+		, sending(false)
+	{
+	}
+
+	/** Moves on to the next stage of the burst and finds what it has to send. */
+	void NextStage()
+	{
+		pending.clear();
+		position = 0;
+		switch (stage)
+		{
+			case STAGE_USERS:
+				stage = STAGE_CHANNELS;
+				break;
+			case STAGE_CHANNELS:
+				stage = STAGE_XLINES;
+				lastxline.clear();
+				pending = ServerInstance->XLines->GetAllTypes();
+				break;
+			default:
+				stage = STAGE_DONE;
+				break;
+		}
+	}
+
+	/** Checks whether the current stage has nothing left to send. */
+	bool StageDone() const
+	{
+		switch (stage)
+		{
+			case STAGE_USERS:
+				return users.empty();
+			case STAGE_CHANNELS:
+				return channels.empty();
+			default:
+				return position >= pending.size();
+		}
+	}
 };
 
 /** This function is called when we want to send a netburst to a local
@@ -115,24 +189,187 @@ void TreeSocket::DoBurst(TreeServer* s)
 	// Introduce all servers behind us
 	this->SendServers(Utils->TreeRoot, s);
 
-	BurstState bs(this);
-	// Introduce all users
-	this->SendUsers(bs);
+	// Users who register and channels which are created after this point are
+	// introduced by the UID and FJOIN sent when that happens so only the ones
+	// which exist now need to be burst.
+	burst = new BurstState(this);
+	const user_hash& users = ServerInstance->Users->GetUsers();
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			burst->users.insert(i->second->uuid);
+	}
 
-	// Sync all channels
 	const chan_hash& chans = ServerInstance->GetChans();
 	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-		SyncChannel(i->second, bs);
+		burst->channels.insert(i->second->name);
+
+	ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	BurstState& bs = *burst;
+	bs.sending = true;
+
+	unsigned int sent = 0;
+	while ((bs.stage != BurstState::STAGE_DONE) && (sent < Utils->BurstBatch) && (getSendQSize() < Utils->BurstSendQ))
+	{
+		if (bs.StageDone())
+		{
+			bs.NextStage();
+			continue;
+		}
+
+		switch (bs.stage)
+		{
+			case BurstState::STAGE_USERS:
+			{
+				const std::string uuid = *bs.users.begin();
+				if (SendBurstUser(uuid))
+					sent++;
+				break;
+			}
+
+			case BurstState::STAGE_CHANNELS:
+			{
+				const std::string name = *bs.channels.begin();
+				Channel* chan = ServerInstance->FindChan(name);
+				if ((chan) && (chan->name == name))
+				{
+					SendBurstChannel(chan);
+					sent++;
+				}
+				else
+				{
+					// The channel has been removed since the burst started.
+					bs.channels.erase(name);
+				}
+				break;
+			}
+
+			case BurstState::STAGE_XLINES:
+				sent += SendXLines(bs, Utils->BurstBatch - sent);
+				break;
+
+			case BurstState::STAGE_DONE:
+				break;
+		}
+	}
+
+	bs.sending = false;
+	if (bs.stage != BurstState::STAGE_DONE)
+	{
+		// Ask for level triggered write events so that the socket engine wakes us
+		// up as soon as there is room in the socket for more of the burst. An edge
+		// triggered event may never arrive if the sendq was emptied in one write.
+		SocketEngine::ChangeEventMask(this, FD_WANT_POLL_WRITE);
+		return;
+	}
 
-	// Send all xlines
-	this->SendXLines();
 	FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncNetwork, (bs.server));
 	this->WriteLine(CmdBuilder("ENDBURST"));
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \002"+ s->GetName()+"\002.");
+	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \002"+ MyRoot->GetName()+"\002.");
 
+	StopBurst();
 	this->burstsent = true;
 }
 
+bool TreeSocket::SendBurstUser(const std::string& uuid)
+{
+	if (!burst->users.erase(uuid))
+		return false;
+
+	User* user = ServerInstance->FindUUID(uuid);
+	if ((!user) || (user->registered != REG_ALL))
+		return false;
+
+	SendUser(user, *burst);
+	return true;
+}
+
+void TreeSocket::SendBurstChannel(Channel* chan)
+{
+	if (!burst->channels.erase(chan->name))
+		return;
+
+	// The other server ignores members of an FJOIN which it does not know about.
+	const Channel::MemberMap& members = chan->GetUsers();
+	for (Channel::MemberMap::const_iterator i = members.begin(); i != members.end(); ++i)
+		SendBurstUser(i->first->uuid);
+
+	SyncChannel(chan, *burst);
+}
+
+void TreeSocket::StopBurst()
+{
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::CheckBurstLine(const std::string& line)
+{
+	BurstState& bs = *burst;
+	if ((bs.sending) || (bs.stage > BurstState::STAGE_CHANNELS))
+		return;
+
+	// Skip the tags and the source to find the command.
+	std::string::size_type pos = 0;
+	if (line[pos] == '@')
+		pos = line.find(' ') + 1;
+	std::string::size_type cmdpos = pos;
+	if (line[cmdpos] == ':')
+		cmdpos = line.find(' ', cmdpos) + 1;
+
+	// A user who is introduced outside of the burst, e.g. because a server behind
+	// us split and relinked while we were bursting, must not be sent again.
+	if (!line.compare(cmdpos, 4, "UID "))
+	{
+		bs.users.erase(line.substr(cmdpos + 4, UIDGenerator::UUID_LENGTH));
+		return;
+	}
+
+	// Send any user or channel which the line refers to that has not been sent yet
+	// so that the other server does not drop the line. Members of an FJOIN are in
+	// the form [modes],<uuid>[:<membid>].
+	bs.sending = true;
+	irc::spacesepstream stream(line.substr(pos));
+	for (std::string word; stream.GetToken(word); )
+	{
+		if ((!word.empty()) && (word[0] == ':'))
+			word.erase(0, 1);
+		if (word.empty())
+			continue;
+
+		if (word[0] == '#')
+		{
+			Channel* chan = bs.channels.empty() ? NULL : ServerInstance->FindChan(word);
+			if (chan)
+				SendBurstChannel(chan);
+			continue;
+		}
+
+		if (bs.users.empty())
+			continue;
+
+		std::string::size_type ubegin = word.find(',');
+		ubegin = (ubegin == std::string::npos ? 0 : ubegin + 1);
+		if (word.length() - ubegin >= UIDGenerator::UUID_LENGTH)
+			SendBurstUser(word.substr(ubegin, UIDGenerator::UUID_LENGTH));
+	}
+	bs.sending = false;
+}
+
+void TreeSocket::OnEventHandlerWrite()
+{
+	BufferedSocket::OnEventHandlerWrite();
+
+	// Queueing the next part of the burst after the sendq has been flushed
+	// means there is always something left to write until it has finished.
+	if ((burst) && (getError().empty()) && (getSendQSize() < Utils->BurstSendQ))
+		ContinueBurst();
+}
+
 void TreeSocket::SendServerInfo(TreeServer* from)
 {
 	// Send public version string
@@ -190,31 +427,44 @@ void TreeSocket::SendFJoins(Channel* c)
 	this->WriteLine(fjoin.finalize());
 }
 
-/** Send all XLines we know about */
-void TreeSocket::SendXLines()
+/** Send the XLines of the current type, continuing after the last one sent */
+unsigned int TreeSocket::SendXLines(BurstState& bs, unsigned int max)
 {
-	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
+	/* Expired lines are removed in XLineManager::GetAll() */
+	XLineLookup* lookup = ServerInstance->XLines->GetAll(bs.pending[bs.position]);
 
-	for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+	/* The type may have been removed since the burst started */
+	if (!lookup)
 	{
-		/* Expired lines are removed in XLineManager::GetAll() */
-		XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+		bs.position++;
+		bs.lastxline.clear();
+		return 0;
+	}
 
-		/* lookup cannot be NULL in this case but a check won't hurt */
-		if (lookup)
+	unsigned int sent = 0;
+	LookupIter i = bs.lastxline.empty() ? lookup->begin() : lookup->upper_bound(bs.lastxline);
+	for (; (i != lookup->end()) && (sent < max) && (getSendQSize() < Utils->BurstSendQ); ++i)
+	{
+		/* Is it burstable? this is better than an explicit check for type 'K'.
+		 * We skip the type as NONE of the items in this group are worth iterating.
+		 */
+		if (!i->second->IsBurstable())
 		{
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-			{
-				/* Is it burstable? this is better than an explicit check for type 'K'.
-				 * We break the loop as NONE of the items in this group are worth iterating.
-				 */
-				if (!i->second->IsBurstable())
-					break;
-
-				this->WriteLine(CommandAddLine::Builder(i->second));
-			}
+			i = lookup->end();
+			break;
 		}
+
+		this->WriteLine(CommandAddLine::Builder(i->second));
+		bs.lastxline = i->first;
+		sent++;
 	}
+
+	if (i == lookup->end())
+	{
+		bs.position++;
+		bs.lastxline.clear();
+	}
+	return sent;
 }
 
 void TreeSocket::SendListModes(Channel* chan)
@@ -278,36 +528,28 @@ void TreeSocket::SyncChannel(Channel* chan)
 	SyncChannel(chan, bs);
 }
 
-/** Send all users and their state, including oper and away status and global metadata */
-void TreeSocket::SendUsers(BurstState& bs)
+/** Send a user and their state, including oper and away status and global metadata */
+void TreeSocket::SendUser(User* user, BurstState& bs)
 {
-	const user_hash& users = ServerInstance->Users->GetUsers();
-	for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
-	{
-		User* user = u->second;
-		if (user->registered != REG_ALL)
-			continue;
-
-		this->WriteLine(CommandUID::Builder(user));
-
-		if (user->IsOper())
-			this->WriteLine(CommandOpertype::Builder(user));
+	this->WriteLine(CommandUID::Builder(user));
 
-		if (user->IsAway())
-			this->WriteLine(CommandAway::Builder(user));
+	if (user->IsOper())
+		this->WriteLine(CommandOpertype::Builder(user));
 
-		if (user->uniqueusername) // TODO: convert this to BooleanExtItem in v4.
-			this->WriteLine(CommandMetadata::Builder(user, "uniqueusername", "1"));
+	if (user->IsAway())
+		this->WriteLine(CommandAway::Builder(user));
 
-		const Extensible::ExtensibleStore& exts = user->GetExtList();
-		for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->ToNetwork(u->second, i->second);
-			if (!value.empty())
-				this->WriteLine(CommandMetadata::Builder(user, item->name, value));
-		}
+	if (user->uniqueusername) // TODO: convert this to BooleanExtItem in v4.
+		this->WriteLine(CommandMetadata::Builder(user, "uniqueusername", "1"));
 
-		FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncUser, (user, bs.server));
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->ToNetwork(user, i->second);
+		if (!value.empty())
+			this->WriteLine(CommandMetadata::Builder(user, item->name, value));
 	}
+
+	FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncUser, (user, bs.server));
 }
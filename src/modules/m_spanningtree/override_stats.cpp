@@ -21,6 +21,7 @@
 
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "main.h"
 #include "utils.h"
@@ -57,5 +58,24 @@ ModResult ModuleSpanningTree::OnStats(Stats::Context& stats)
 		}
 		return MOD_RES_DENY;
 	}
+	else if (stats.GetSymbol() == 'X')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			CompressIOHook* compress = CompressIOHook::Get((*i)->GetSocket());
+			if (!compress)
+				continue;
+
+			const CompressIOHook::Stats& cs = compress->GetStats();
+			stats.AddRow(249, InspIRCd::Format("%s %s sent %lu/%lu bytes (%.1f%%) in %.0fus received %lu/%lu bytes (%.1f%%) in %.0fus",
+				(*i)->GetName().c_str(), compress->prov->name.c_str(),
+				static_cast<unsigned long>(cs.compressedout), static_cast<unsigned long>(cs.rawout),
+				cs.rawout ? 100.0 * cs.compressedout / cs.rawout : 100.0, cs.compresstime / 1000.0,
+				static_cast<unsigned long>(cs.compressedin), static_cast<unsigned long>(cs.rawin),
+				cs.rawin ? 100.0 * cs.compressedin / cs.rawin : 100.0, cs.decompresstime / 1000.0));
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
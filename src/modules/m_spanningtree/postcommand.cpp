@@ -40,6 +40,15 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, CommandBase* thiscm
 	if (routing.type == ROUTE_TYPE_LOCALONLY)
 		return;
 
+	if ((routing.type == ROUTE_TYPE_BROADCAST) || (routing.type == ROUTE_TYPE_OPT_BCAST))
+	{
+		// Don't build a broadcast which would only be sent back to where it came from. This
+		// is the case for almost everything a server receives while it is a leaf.
+		const TreeServer::ChildServers& children = TreeRoot->GetChildren();
+		if ((children.empty()) || ((children.size() == 1) && (children.front() == origin)))
+			return;
+	}
+
 	const bool encap = ((routing.type == ROUTE_TYPE_OPT_BCAST) || (routing.type == ROUTE_TYPE_OPT_UCAST));
 	CmdBuilder params(user, encap ? "ENCAP" : command.c_str());
 	params.push_tags(parameters.GetTags());
@@ -80,6 +80,7 @@ struct CapabData
 	int capab_phase;			/* Have sent CAPAB already */
 	bool auth_fingerprint;			/* Did we auth using SSL certificate fingerprint */
 	bool auth_challenge;			/* Did we auth using challenge/response */
+	bool decompress;			/* Received CAPAB COMPRESS, rest of the recvq is compressed */
 	irc::sockets::sockaddrs remotesa; /* The remote socket address. */
 
 	// Data saved from incoming SERVER command, for later use when our credentials have been accepted by the other party
@@ -109,6 +110,21 @@ class TreeSocket : public BufferedSocket
 	 */
 	bool burstsent;
 
+	/** The part of our netburst which has yet to be sent or NULL if we are not bursting.
+	 */
+	BurstState* burst;
+
+	/** The parts of the line being processed. These are reused for every line so
+	 * that splitting a line does not allocate once they have grown large enough.
+	 */
+	std::string linetags;
+	std::string lineprefix;
+	std::string linecommand;
+	CommandBase::Params lineparams;
+
+	/** Strings which held the parameters of earlier lines, kept for their capacity. */
+	std::vector<std::string> sparestrings;
+
 	/** Checks if the given servername and sid are both free
 	 */
 	bool CheckDuplicate(const std::string& servername, const std::string& sid);
@@ -120,8 +136,42 @@ class TreeSocket : public BufferedSocket
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan, BurstState& bs);
 
-	/** Send all users and their oper state, away state and metadata */
-	void SendUsers(BurstState& bs);
+	/** Send a user and their oper state, away state and metadata */
+	void SendUser(User* user, BurstState& bs);
+
+	/** Send burstable X-lines until the end of the current type or until the given number have been sent.
+	 * @return The number of X-lines which were sent.
+	 */
+	unsigned int SendXLines(BurstState& bs, unsigned int max);
+
+	/** Queue the next part of our netburst. This stops when the sendq reaches the size configured in
+	 * \<performance:burstsendq> or \<performance:burstbatch> objects have been sent, whichever is
+	 * first, and finishes the burst once there is nothing left to send.
+	 */
+	void ContinueBurst();
+
+	/** Send a user as part of our netburst if they have not been sent yet.
+	 * @param uuid The UUID of the user to send.
+	 * @return True if the user was sent; otherwise, false.
+	 */
+	bool SendBurstUser(const std::string& uuid);
+
+	/** Send a channel and any of its members who have not been sent yet as part of our
+	 * netburst if the channel has not been sent yet.
+	 * @param chan The channel to send.
+	 */
+	void SendBurstChannel(Channel* chan);
+
+	/** Check a line which is not part of our netburst before it is sent. Any user or channel
+	 * which it refers to that has not been sent yet is sent first and any user which it
+	 * introduces is not sent again by the burst.
+	 * @param line The line which is being sent.
+	 */
+	void CheckBurstLine(const std::string& line);
+
+	/** Free the state of our netburst, if any.
+	 */
+	void StopBurst();
 
 	/** Send all additional info about the given server to this server */
 	void SendServerInfo(TreeServer* from);
@@ -265,9 +315,6 @@ class TreeSocket : public BufferedSocket
 	 */
 	void SendFJoins(Channel* c);
 
-	/** Send G-, Q-, Z- and E-lines */
-	void SendXLines();
-
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan);
 
@@ -275,9 +322,17 @@ class TreeSocket : public BufferedSocket
 	 * server. There is a set order we must do this, because for example
 	 * users require their servers to exist, and channels require their
 	 * users to exist. You get the idea.
+	 * The servers are sent immediately but everything else is sent in parts
+	 * as the sendq of the link drains so the server stays responsive while
+	 * bursting to a large network. Users and channels which live traffic
+	 * refers to are sent before it.
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Flush the sendq and queue more of our netburst if there is room.
+	 */
+	void OnEventHandlerWrite() CXX11_OVERRIDE;
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -287,6 +342,14 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line which is also being sent to other servers. Unless the line has to be
+	 * translated for an older protocol the same buffer is queued on all of them.
+	 * @param line The line to send without a new line character at the end.
+	 * @param shared The buffer which is shared between the servers the line is sent to. This
+	 * is created by the first server which can use it and should be NULL initially.
+	 */
+	void WriteLine(const std::string& line, reference<SendQueue::SharedBuffer>& shared);
+
 	/** Handle ERROR command */
 	void Error(CommandBase::Params& params);
 
@@ -298,13 +361,20 @@ class TreeSocket : public BufferedSocket
 	 */
 	bool Inbound_Server(CommandBase::Params& params);
 
-	/** Handle IRC line split
+	/** Handle IRC line split. The line is parsed where it is in the buffer and its
+	 * parts are copied into linetags, lineprefix, linecommand and lineparams.
+	 * @param buffer The buffer which contains the line.
+	 * @param start The position of the start of the line.
+	 * @param end The position of the end of the line.
 	 */
-	void Split(const std::string& line, std::string& tags, std::string& prefix, std::string& command, CommandBase::Params& params);
+	void Split(const std::string& buffer, std::string::size_type start, std::string::size_type end);
 
 	/** Process complete line from buffer
+	 * @param buffer The buffer which contains the line.
+	 * @param start The position of the start of the line.
+	 * @param end The position of the end of the line.
 	 */
-	void ProcessLine(std::string &line);
+	void ProcessLine(const std::string& buffer, std::string::size_type start, std::string::size_type end);
 
 	/** Process message tags received from a remote server. */
 	void ProcessTag(User* source, const std::string& tag, ClientProtocol::TagMap& tags);
@@ -25,6 +25,7 @@
 
 #include "inspircd.h"
 #include "iohook.h"
+#include "modules/compress.h"
 
 #include "main.h"
 #include "utils.h"
@@ -44,12 +45,14 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const irc::sockets::sockad
 	, MyRoot(NULL)
 	, proto_version(0)
 	, burstsent(false)
+	, burst(NULL)
 	, age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->link = link;
 	capab->ac = myac;
 	capab->capab_phase = 0;
+	capab->decompress = false;
 	capab->remotesa = dest;
 
 	irc::sockets::sockaddrs bind;
@@ -86,10 +89,12 @@ TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* cl
 	, MyRoot(NULL)
 	, proto_version(0)
 	, burstsent(false)
+	, burst(NULL)
 	, age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
+	capab->decompress = false;
 	capab->remotesa = *client;
 
 	for (ListenSocket::IOHookProvList::iterator i = via->iohookprovs.begin(); i != via->iohookprovs.end(); ++i)
@@ -132,6 +137,7 @@ CullResult TreeSocket::cull()
 TreeSocket::~TreeSocket()
 {
 	delete capab;
+	StopBurst();
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -144,6 +150,18 @@ void TreeSocket::OnConnected()
 {
 	if (this->LinkState == CONNECTING)
 	{
+		// The compression hook has to be added first so it sits above the TLS hook.
+		if (!capab->link->Compress.empty())
+		{
+			ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, capab->link->Compress);
+			if (!prov || static_cast<IOHookProvider*>(prov)->type != IOHookProvider::IOH_COMPRESSION)
+			{
+				SetError("Could not find compression hook '" + capab->link->Compress + "' for connection to " + linkID);
+				return;
+			}
+			static_cast<IOHookProvider*>(prov)->OnConnect(this);
+		}
+
 		if (!capab->link->Hook.empty())
 		{
 			ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, "ssl/" + capab->link->Hook);
@@ -210,13 +228,24 @@ CmdResult CommandSQuit::HandleServer(TreeServer* server, CommandBase::Params& pa
 void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
-	std::string line;
-	while (GetNextLine(line))
+
+	// The position within the recvq of the start of the current line. Lines
+	// are parsed where they are in the recvq instead of being copied out and
+	// all of the consumed lines are removed at once when we are done.
+	std::string::size_type linestart = 0;
+	for (;;)
 	{
-		std::string::size_type rline = line.find('\r');
-		if (rline != std::string::npos)
-			line.erase(rline);
-		if (line.find('\0') != std::string::npos)
+		const std::string::size_type eolpos = recvq.find('\n', linestart);
+		if (eolpos == std::string::npos)
+			break;
+
+		// Everything after a \r is ignored.
+		const char* const cr = static_cast<const char*>(memchr(recvq.data() + linestart, '\r', eolpos - linestart));
+		const std::string::size_type start = linestart;
+		const std::string::size_type end = cr ? cr - recvq.data() : eolpos;
+		linestart = eolpos + 1;
+
+		if (memchr(recvq.data() + start, '\0', end - start))
 		{
 			SendError("Read null character from socket");
 			break;
@@ -224,18 +253,31 @@ void TreeSocket::OnDataReady()
 
 		try
 		{
-			ProcessLine(line);
+			ProcessLine(recvq, start, end);
 		}
 		catch (CoreException& ex)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Error while processing: " + line);
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Error while processing: " + recvq.substr(start, end - start));
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason());
 			SendError(ex.GetReason() + " - check the log file for details");
 		}
 
 		if (!getError().empty())
 			break;
+
+		if ((capab) && (capab->decompress))
+		{
+			// Everything the remote server sent after CAPAB COMPRESS is compressed.
+			capab->decompress = false;
+			if (!CompressIOHook::Get(this)->StartDecompressing(this, recvq, linestart))
+			{
+				SendError("Unable to decompress data from the remote server");
+				break;
+			}
+		}
 	}
+	recvq.erase(0, linestart);
+
 	if (LinkState != CONNECTED && recvq.length() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
@@ -41,61 +41,121 @@ void TreeSocket::Error(CommandBase::Params& params)
 	SetError("received ERROR " + msg);
 }
 
-void TreeSocket::Split(const std::string& line, std::string& tags, std::string& prefix, std::string& command, CommandBase::Params& params)
+namespace
 {
-	std::string token;
-	irc::tokenstream tokens(line);
+	/** Finds the next token of a line in the same way as irc::tokenstream does but
+	 * without copying the line or the token.
+	 * @param buffer The buffer which contains the line.
+	 * @param pos The position of the token, updated to the position of the one after it.
+	 * @param end The position of the end of the line.
+	 * @param trailing Whether the token may be a <trailing> parameter.
+	 * @param tokstart Set to the position of the start of the token.
+	 * @return The length of the token or std::string::npos if there are no tokens left.
+	 */
+	std::string::size_type NextToken(const std::string& buffer, std::string::size_type& pos, std::string::size_type end, bool trailing, std::string::size_type& tokstart)
+	{
+		if (pos >= end)
+			return std::string::npos;
+
+		if ((trailing) && (buffer[pos] == ':'))
+		{
+			tokstart = pos + 1;
+			pos = end;
+			return end - tokstart;
+		}
+
+		tokstart = pos;
+		const char* const separator = static_cast<const char*>(memchr(buffer.data() + pos, ' ', end - pos));
+		if (!separator)
+		{
+			pos = end;
+			return end - tokstart;
+		}
+
+		const std::string::size_type seppos = separator - buffer.data();
+		for (pos = seppos; (pos < end) && (buffer[pos] == ' '); ++pos)
+			;
+		return seppos - tokstart;
+	}
+}
 
-	if (!tokens.GetMiddle(token))
+void TreeSocket::Split(const std::string& buffer, std::string::size_type start, std::string::size_type end)
+{
+	// Keep the strings which held the parameters of the previous line so that
+	// the parameters of this one can be copied into them without allocating.
+	for (CommandBase::Params::iterator i = lineparams.begin(); i != lineparams.end(); ++i)
+	{
+		sparestrings.push_back(std::string());
+		sparestrings.back().swap(*i);
+	}
+	lineparams.clear();
+	lineparams.GetTags().clear();
+	linetags.clear();
+	lineprefix.clear();
+	linecommand.clear();
+
+	std::string::size_type pos = start;
+	std::string::size_type tokstart;
+	std::string::size_type toklen = NextToken(buffer, pos, end, false, tokstart);
+	if (toklen == std::string::npos)
 		return;
 
-	if (token[0] == '@')
+	if (buffer[tokstart] == '@')
 	{
-		if (token.length() <= 1)
+		if (toklen <= 1)
 		{
-			this->SendError("BUG: Received a message with empty tags: " + line);
+			this->SendError("BUG: Received a message with empty tags: " + buffer.substr(start, end - start));
 			return;
 		}
 
-		tags.assign(token, 1, std::string::npos);
-		if (!tokens.GetMiddle(token))
+		linetags.assign(buffer, tokstart + 1, toklen - 1);
+		toklen = NextToken(buffer, pos, end, false, tokstart);
+		if (toklen == std::string::npos)
 		{
-			this->SendError("BUG: Received a message with no command: " + line);
+			this->SendError("BUG: Received a message with no command: " + buffer.substr(start, end - start));
 			return;
 		}
 	}
 
-	if (token[0] == ':')
+	if (buffer[tokstart] == ':')
 	{
-		if (token.length() <= 1)
+		if (toklen <= 1)
 		{
-			this->SendError("BUG: Received a message with an empty prefix: " + line);
+			this->SendError("BUG: Received a message with an empty prefix: " + buffer.substr(start, end - start));
 			return;
 		}
 
-		prefix.assign(token, 1, std::string::npos);
-		if (!tokens.GetMiddle(token))
+		lineprefix.assign(buffer, tokstart + 1, toklen - 1);
+		toklen = NextToken(buffer, pos, end, false, tokstart);
+		if (toklen == std::string::npos)
 		{
-			this->SendError("BUG: Received a message with no command: " + line);
+			this->SendError("BUG: Received a message with no command: " + buffer.substr(start, end - start));
 			return;
 		}
 	}
 
-	command.assign(token);
-	while (tokens.GetTrailing(token))
-		params.push_back(token);
+	linecommand.assign(buffer, tokstart, toklen);
+	while ((toklen = NextToken(buffer, pos, end, true, tokstart)) != std::string::npos)
+	{
+		lineparams.push_back(std::string());
+		std::string& param = lineparams.back();
+		if (!sparestrings.empty())
+		{
+			param.swap(sparestrings.back());
+			sparestrings.pop_back();
+		}
+		param.assign(buffer, tokstart, toklen);
+	}
 }
 
-void TreeSocket::ProcessLine(std::string &line)
+void TreeSocket::ProcessLine(const std::string& buffer, std::string::size_type start, std::string::size_type end)
 {
-	std::string tags;
-	std::string prefix;
-	std::string command;
-	CommandBase::Params params;
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] I %.*s", this->GetFd(), static_cast<int>(end - start), buffer.data() + start);
 
-	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] I %s", this->GetFd(), line.c_str());
+	Split(buffer, start, end);
 
-	Split(line, tags, prefix, command, params);
+	std::string& command = linecommand;
+	CommandBase::Params& params = lineparams;
 
 	if (command.empty())
 		return;
@@ -219,7 +279,7 @@ void TreeSocket::ProcessLine(std::string &line)
 			 *  Credentials have been exchanged, we've gotten their 'BURST' (or sent ours).
 			 *  Anything from here on should be accepted a little more reasonably.
 			 */
-			this->ProcessConnectedLine(tags, prefix, command, params);
+			this->ProcessConnectedLine(linetags, lineprefix, command, params);
 		break;
 		case DYING:
 		break;
@@ -379,25 +439,25 @@ void TreeSocket::ProcessConnectedLine(std::string& taglist, std::string& prefix,
 	}
 
 	CmdResult res;
-	ClientProtocol::TagMap tags;
-	std::string tag;
-	irc::sepstream tagstream(taglist, ';');
-	while (tagstream.GetToken(tag))
-		ProcessTag(who, tag, tags);
-
-	CommandBase::Params newparams(params, tags);
+	if (!taglist.empty())
+	{
+		std::string tag;
+		irc::sepstream tagstream(taglist, ';');
+		while (tagstream.GetToken(tag))
+			ProcessTag(who, tag, params.GetTags());
+	}
 
 	if (scmd)
-		res = scmd->Handle(who, newparams);
+		res = scmd->Handle(who, params);
 	else
 	{
-		res = cmd->Handle(who, newparams);
+		res = cmd->Handle(who, params);
 		if (res == CMD_INVALID)
 			throw ProtocolException("Error in command handler");
 	}
 
 	if (res == CMD_SUCCESS)
-		Utils->RouteCommand(server->GetRoute(), cmdbase, newparams, who);
+		Utils->RouteCommand(server->GetRoute(), cmdbase, params, who);
 }
 
 void TreeSocket::OnTimeout()
@@ -184,6 +184,7 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
 	const std::string& FullLine = params.str();
+	reference<StreamSocket::SendQueue::SharedBuffer> shared;
 
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
@@ -192,7 +193,7 @@ void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeSe
 		// Send the line if the route isn't the path to the one to be omitted
 		if (Route != omitroute)
 		{
-			Route->GetSocket()->WriteLine(FullLine);
+			Route->GetSocket()->WriteLine(FullLine, shared);
 		}
 	}
 }
@@ -249,7 +250,10 @@ void SpanningTreeUtilities::ReadConfiguration()
 	HideSplits = security->getBool("hidesplits");
 	AnnounceTSChange = options->getBool("announcets");
 	AllowOptCommon = options->getBool("allowmismatch");
-	quiet_bursts = ServerInstance->Config->ConfValue("performance")->getBool("quietbursts");
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	quiet_bursts = performance->getBool("quietbursts");
+	BurstSendQ = performance->getUInt("burstsendq", 1024 * 1024, 4096);
+	BurstBatch = performance->getUInt("burstbatch", 500, 1);
 	PingWarnTime = options->getDuration("pingwarning", 15);
 	PingFreq = options->getDuration("serverpingfreq", 60, 1);
 
@@ -287,6 +291,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->HiddenFromStats = tag->getBool("statshidden");
 		L->Timeout = tag->getDuration("timeout", 30);
 		L->Hook = tag->getString("sslprofile", tag->getString("ssl"));
+		L->Compress = tag->getString("compress");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
 
@@ -378,12 +383,13 @@ void SpanningTreeUtilities::SendChannelMessage(User* source, Channel* target, co
 		msg.push_last(text);
 
 	TreeSocketSet list;
+	reference<StreamSocket::SendQueue::SharedBuffer> shared;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
-			Sock->WriteLine(msg);
+			Sock->WriteLine(msg, shared);
 	}
 }
 
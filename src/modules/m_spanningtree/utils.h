@@ -50,7 +50,7 @@ class SpanningTreeUtilities : public classbase
 	CacheRefreshTimer RefreshTimer;
 
  public:
-	typedef std::set<TreeSocket*> TreeSocketSet;
+	typedef insp::flat_set<TreeSocket*> TreeSocketSet;
 	typedef std::map<TreeSocket*, std::pair<std::string, unsigned int> > TimeoutList;
 
 	/** Creator module
@@ -80,6 +80,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool quiet_bursts;
 
+	/** The size of the sendq of a server link below which more of a netburst is queued
+	 */
+	unsigned long BurstSendQ;
+
+	/** The maximum number of users, channels or X-lines queued per netburst step
+	 */
+	unsigned int BurstBatch;
+
 	/* Number of seconds that a server can go without ping
 	 * before opers are warned of high latency.
 	 */
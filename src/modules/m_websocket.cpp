@@ -24,14 +24,20 @@
 #include "inspircd.h"
 #include "iohook.h"
 #include "modules/hash.h"
+#include "modules/websocket.h"
 
 #define UTF_CPP_CPLUSPLUS 199711L
 #include <unchecked.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 static const char MagicGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 static const char newline[] = "\r\n";
 static const char whitespace[] = " \t";
 static dynamic_reference_nocheck<HashProvider>* sha1;
+static dynamic_reference_nocheck<WebSocket::CompressorProvider>* deflateprov;
 
 struct WebSocketConfig
 {
@@ -58,6 +64,9 @@ struct WebSocketConfig
 
 	// The IP ranges which send trustworthy X-Real-IP or X-Forwarded-For headers.
 	ProxyRanges proxyranges;
+
+	// Whether to negotiate the permessage-deflate extension with clients.
+	bool deflate;
 };
 
 class WebSocketHookProvider : public IOHookProvider
@@ -145,6 +154,8 @@ class WebSocketHook : public IOHookMiddle
 
 	static const unsigned char WS_MASKBIT = (1 << 7);
 	static const unsigned char WS_FINBIT = (1 << 7);
+	static const unsigned char WS_RSV1BIT = (1 << 6);
+	static const unsigned char WS_CONTROLBIT = (1 << 3);
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_LARGE = 126;
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_HUGE = 127;
 	static const size_t WS_MAX_PAYLOAD_LENGTH_SMALL = 125;
@@ -159,10 +170,19 @@ class WebSocketHook : public IOHookMiddle
 	WebSocketConfig& config;
 	bool sendastext;
 
-	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode)
+	// The permessage-deflate compression state or NULL if it has not been negotiated.
+	WebSocket::Compressor* compressor;
+
+	// Whether the message currently being received is compressed.
+	bool inflating;
+
+	// The amount of data that the message currently being received has inflated to.
+	size_t inflatedsize;
+
+	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode, bool compressed)
 	{
 		size_t pos = 0;
-		outbuf[pos++] = WS_FINBIT | opcode;
+		outbuf[pos++] = WS_FINBIT | (compressed ? WS_RSV1BIT : 0) | opcode;
 
 		if (sendlength <= WS_MAX_PAYLOAD_LENGTH_SMALL)
 		{
@@ -185,12 +205,68 @@ class WebSocketHook : public IOHookMiddle
 		return pos;
 	}
 
-	static StreamSocket::SendQueue::Element PrepareSendQElem(size_t size, OpCode opcode)
+	/** Removes the masking from the payload of a client frame. tools/bench/websocket_unmask.cpp
+	 * has a copy of this which it benchmarks against unmasking a byte at a time.
+	 * @param out The buffer to write the unmasked payload to. This may be the same as in.
+	 * @param in The masked payload.
+	 * @param len The length of the payload.
+	 * @param maskkey The four byte masking key of the frame.
+	 */
+	static void UnmaskPayload(unsigned char* out, const unsigned char* in, size_t len, const unsigned char* maskkey)
+	{
+		// The masking key repeats every four bytes so it can be applied to whole
+		// words at a time as long as each word starts at a multiple of four.
+		size_t pos = 0;
+#ifdef __SSE2__
+		uint32_t key32;
+		memcpy(&key32, maskkey, sizeof(key32));
+		const __m128i key128 = _mm_set1_epi32(key32);
+		for (; pos + sizeof(__m128i) <= len; pos += sizeof(__m128i))
+		{
+			const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + pos), _mm_xor_si128(data, key128));
+		}
+#endif
+
+		uint64_t key64;
+		memcpy(&key64, maskkey, 4);
+		memcpy(reinterpret_cast<unsigned char*>(&key64) + 4, maskkey, 4);
+		for (; pos + sizeof(key64) <= len; pos += sizeof(key64))
+		{
+			uint64_t data;
+			memcpy(&data, in + pos, sizeof(data));
+			data ^= key64;
+			memcpy(out + pos, &data, sizeof(data));
+		}
+
+		for (; pos < len; pos++)
+			out[pos] = in[pos] ^ maskkey[pos % 4];
+	}
+
+	static std::string PrepareSendQElem(size_t size, OpCode opcode, bool compressed = false)
 	{
 		unsigned char header[MAXHEADERSIZE];
-		const size_t n = FillHeader(header, size, opcode);
+		const size_t n = FillHeader(header, size, opcode, compressed);
 
-		return StreamSocket::SendQueue::Element(reinterpret_cast<const char*>(header), n);
+		return std::string(reinterpret_cast<const char*>(header), n);
+	}
+
+	void QueueMessage(const std::string& message, OpCode opcode)
+	{
+		StreamSocket::SendQueue& mysendq = GetSendQ();
+		if (compressor)
+		{
+			std::string compressed;
+			if (compressor->Compress(message, compressed))
+			{
+				mysendq.push_back(PrepareSendQElem(compressed.length(), opcode, true));
+				mysendq.push_back(compressed);
+				return;
+			}
+		}
+
+		mysendq.push_back(PrepareSendQElem(message.length(), opcode));
+		mysendq.push_back(message);
 	}
 
 	int HandleAppData(StreamSocket* sock, std::string& appdataout, bool allowlarge)
@@ -251,16 +327,14 @@ class WebSocketHook : public IOHookMiddle
 		if (myrecvq.length() < payloadstartoffset + len)
 			return 0;
 
-		unsigned int maskkeypos = 0;
-		const std::string::iterator endit = myrecvq.begin() + payloadstartoffset + len;
-		for (std::string::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
+		if (len)
 		{
-			const unsigned char c = (unsigned char)*i;
-			appdataout.push_back(c ^ maskkey[maskkeypos++]);
-			maskkeypos %= 4;
+			const size_t outpos = appdataout.length();
+			appdataout.resize(outpos + len);
+			UnmaskPayload(reinterpret_cast<unsigned char*>(&appdataout[outpos]), reinterpret_cast<const unsigned char*>(cmyrecvq.data() + payloadstartoffset), len, maskkey);
 		}
 
-		myrecvq.erase(myrecvq.begin(), endit);
+		myrecvq.erase(0, payloadstartoffset + len);
 		return 1;
 	}
 
@@ -280,7 +354,7 @@ class WebSocketHook : public IOHookMiddle
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
+		std::string elem = PrepareSendQElem(appdata.length(), OP_PONG);
 		elem.append(appdata);
 		GetSendQ().push_back(elem);
 
@@ -294,23 +368,67 @@ class WebSocketHook : public IOHookMiddle
 			return 0;
 
 		unsigned char opcode = (unsigned char)GetRecvQ().c_str()[0];
+		const bool compressed = compressor && (opcode & WS_RSV1BIT);
+		if (compressed)
+		{
+			// Only the first frame of a data message can be marked as compressed.
+			opcode &= ~WS_RSV1BIT;
+			if ((opcode & WS_CONTROLBIT) || (opcode & ~WS_FINBIT) == OP_CONTINUATION)
+			{
+				CloseConnection(sock, CLOSE_PROTOCOL_ERROR, "WebSocket protocol violation: compressed control or continuation frame");
+				return -1;
+			}
+		}
+
 		switch (opcode & ~WS_FINBIT)
 		{
 			case OP_CONTINUATION:
 			case OP_TEXT:
 			case OP_BINARY:
 			{
-				std::string appdata;
-				const int result = HandleAppData(sock, appdata, true);
-				if (result != 1)
-					return result;
+				const size_t startpos = destrecvq.length();
+				if ((opcode & ~WS_FINBIT) != OP_CONTINUATION)
+				{
+					inflating = compressed;
+					inflatedsize = 0;
+				}
+
+				if (inflating)
+				{
+					std::string appdata;
+					const int result = HandleAppData(sock, appdata, true);
+					if (result != 1)
+						return result;
+
+					// Stop as soon as the message gets too big to avoid decompression bombs.
+					const size_t maxlen = WS_MAX_PAYLOAD_LENGTH_LARGE - inflatedsize;
+					const bool success = compressor && compressor->Decompress(appdata.data(), appdata.length(), opcode & WS_FINBIT, maxlen, destrecvq);
+					inflatedsize += destrecvq.length() - startpos;
+					if (!success)
+					{
+						if (inflatedsize > WS_MAX_PAYLOAD_LENGTH_LARGE)
+							CloseConnection(sock, CLOSE_TOO_LARGE, "WebSocket: Compressed message is too large");
+						else
+							CloseConnection(sock, CLOSE_PROTOCOL_ERROR, "WebSocket protocol violation: invalid compressed data");
+						return -1;
+					}
+				}
+				else
+				{
+					// The payload is unmasked straight onto the end of the recvq.
+					const int result = HandleAppData(sock, destrecvq, true);
+					if (result != 1)
+						return result;
+				}
 
 				// Strip out any CR+LF which may have been erroneously sent.
-				for (std::string::const_iterator iter = appdata.begin(); iter != appdata.end(); ++iter)
+				std::string::iterator newend = destrecvq.begin() + startpos;
+				for (std::string::const_iterator iter = newend; iter != destrecvq.end(); ++iter)
 				{
 					if (*iter != '\r' && *iter != '\n')
-						destrecvq.push_back(*iter);
+						*newend++ = *iter;
 				}
+				destrecvq.erase(newend, destrecvq.end());
 
 				// If we are on the final message of this block append a line terminator.
 				if (opcode & WS_FINBIT)
@@ -485,10 +603,17 @@ class WebSocketHook : public IOHookMiddle
 		std::string key = keyheader.ExtractValue(recvq);
 		key.append(MagicGUID);
 
+		std::string extensions;
+		HTTPHeaderFinder extensionheader;
+		if (config.deflate && *deflateprov && extensionheader.Find(recvq, "Sec-WebSocket-Extensions:", 25, reqend))
+			compressor = (*deflateprov)->Negotiate(extensionheader.ExtractValue(recvq), extensions);
+
 		std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
 		reply.append(BinToBase64((*sha1)->GenerateRaw(key), NULL, '=')).append(newline);
 		if (!selectedproto.empty())
 			reply.append("Sec-WebSocket-Protocol: ").append(selectedproto).append(newline);
+		if (!extensions.empty())
+			reply.append("Sec-WebSocket-Extensions: ").append(extensions).append(newline);
 		reply.append(newline);
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(reply));
 
@@ -506,10 +631,32 @@ class WebSocketHook : public IOHookMiddle
 		, lastpingpong(0)
 		, config(cfg)
 		, sendastext(config.defaultmode != WebSocketConfig::DM_BINARY)
+		, compressor(NULL)
+		, inflating(false)
+		, inflatedsize(0)
 	{
 		sock->AddIOHook(this);
 	}
 
+	~WebSocketHook()
+	{
+		delete compressor;
+	}
+
+	/** Frees the permessage-deflate state. This must be called before the module
+	 * which created it is unloaded.
+	 * @return True if the connection was using permessage-deflate; otherwise, false.
+	 */
+	bool StopCompressing()
+	{
+		if (!compressor)
+			return false;
+
+		delete compressor;
+		compressor = NULL;
+		return true;
+	}
+
 	bool IsHookReady() const CXX11_OVERRIDE
 	{
 		return state == STATE_ESTABLISHED;
@@ -536,15 +683,12 @@ class WebSocketHook : public IOHookMiddle
 						// If we send messages as text then we need to ensure they are valid UTF-8.
 						std::string encoded;
 						utf8::unchecked::replace_invalid(message.begin(), message.end(), std::back_inserter(encoded));
-
-						mysendq.push_back(PrepareSendQElem(encoded.length(), OP_TEXT));
-						mysendq.push_back(encoded);
+						QueueMessage(encoded, OP_TEXT);
 					}
 					else
 					{
 						// Otherwise, send the raw message as a binary frame.
-						mysendq.push_back(PrepareSendQElem(message.length(), OP_BINARY));
-						mysendq.push_back(message);
+						QueueMessage(message, OP_BINARY);
 					}
 					message.clear();
 				}
@@ -598,14 +742,17 @@ void WebSocketHookProvider::OnAccept(StreamSocket* sock, irc::sockets::sockaddrs
 class ModuleWebSocket : public Module
 {
 	dynamic_reference_nocheck<HashProvider> hash;
+	dynamic_reference_nocheck<WebSocket::CompressorProvider> compressorprov;
 	reference<WebSocketHookProvider> hookprov;
 
  public:
 	ModuleWebSocket()
 		: hash(this, "hash/sha1")
+		, compressorprov(this, "websocket/permessage-deflate")
 		, hookprov(new WebSocketHookProvider(this))
 	{
 		sha1 = &hash;
+		deflateprov = &compressorprov;
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -643,6 +790,8 @@ class ModuleWebSocket : public Module
 		for (std::string proxyrange; proxyranges.GetToken(proxyrange); )
 			config.proxyranges.push_back(proxyrange);
 
+		config.deflate = tag->getBool("permessagedeflate");
+
 		// Everything is okay; apply the new config.
 		hookprov->config = config;
 	}
@@ -657,6 +806,24 @@ class ModuleWebSocket : public Module
 			ServerInstance->Users.QuitUser(user, "WebSocket module unloading");
 	}
 
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		if (!compressorprov || compressorprov->creator != mod)
+			return;
+
+		// The compression state was created by the module being unloaded so it
+		// has to be freed now. Clients can not continue without it.
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = users.begin(); i != users.end(); )
+		{
+			// Quitting the user removes them from the list.
+			LocalUser* user = *i++;
+			WebSocketHook* hook = static_cast<WebSocketHook*>(user->eh.GetModHook(this));
+			if (hook && hook->StopCompressing())
+				ServerInstance->Users.QuitUser(user, "WebSocket compression module unloading");
+		}
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Allows WebSocket clients to connect to the IRC server.", VF_VENDOR);
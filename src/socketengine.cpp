@@ -134,6 +134,8 @@ void SocketEngine::DispatchTrialWrites()
 		EventHandler* eh = GetRef(fd);
 		if (!eh)
 			continue;
+
+		MainLoopStats::EventTimer timer(eh);
 		int mask = eh->event_mask;
 		eh->event_mask &= ~(FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
 		if ((mask & (FD_ADD_TRIAL_READ | FD_READ_WILL_BLOCK)) == FD_ADD_TRIAL_READ)
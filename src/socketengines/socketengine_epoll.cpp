@@ -161,8 +161,9 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), GetWaitTimeout());
 	ServerInstance->UpdateTime();
+	ServerInstance->LoopStats.EnterPhase(MainLoopStats::PHASE_EVENTS);
 
 	stats.TotalEvents += i;
 
@@ -176,6 +177,8 @@ int SocketEngine::DispatchEvents()
 		if (fd < 0)
 			continue;
 
+		MainLoopStats::EventTimer timer(eh);
+
 		if (ev.events & EPOLLHUP)
 		{
 			stats.ErrorEvents++;
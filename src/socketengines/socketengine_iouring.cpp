@@ -0,0 +1,478 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "exitcodes.h"
+#include "inspircd.h"
+
+#include <iostream>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/** A specialisation of the SocketEngine class, designed to use Linux io_uring.
+ *
+ * Readiness is requested with one-shot IORING_OP_POLL_ADD operations. Every
+ * poll request that is armed or cancelled while events are being dispatched is
+ * only queued in the submission ring; the whole batch is handed to the kernel
+ * by the same io_uring_enter() call that waits for the next set of events, so
+ * a loop iteration costs a single system call no matter how many sockets
+ * changed their event mask during it.
+ */
+namespace
+{
+	/** The number of entries in the submission ring. If it fills up during an
+	 * iteration then the queued entries are submitted early.
+	 */
+	const unsigned int SubmissionEntries = 1024;
+
+	/** The number of times to try submitting a full ring before giving up. */
+	const unsigned int MaxSubmitAttempts = 16;
+
+	/** The user data that is attached to poll removal requests. */
+	const uint64_t RemoveUserData = ~static_cast<uint64_t>(0);
+
+	/** Holds the state of a file descriptor known to the socket engine. */
+	struct FdState
+	{
+		/** Incremented every time the armed poll request of this fd is abandoned
+		 * so that completions which were already in flight can be ignored.
+		 */
+		uint32_t generation;
+
+		/** The poll(2) events the armed request is waiting for or 0 if none is armed. */
+		unsigned int armed;
+
+		FdState()
+			: generation(0)
+			, armed(0)
+		{
+		}
+	};
+
+	int EngineHandle;
+
+	/** The memory regions shared with the kernel. */
+	void* sqring = MAP_FAILED;
+	size_t sqringsize;
+	void* cqring = MAP_FAILED;
+	size_t cqringsize;
+	struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+	size_t sqessize;
+
+	/** Pointers into the submission ring. */
+	unsigned int* sqhead;
+	unsigned int* sqtail;
+	unsigned int* sqmask;
+	unsigned int* sqarray;
+	unsigned int sqentries;
+
+	/** The tail of the submission ring that has not been published to the kernel yet. */
+	unsigned int sqlocaltail;
+
+	/** Pointers into the completion ring. */
+	unsigned int* cqhead;
+	unsigned int* cqtail;
+	unsigned int* cqmask;
+	struct io_uring_cqe* cqes;
+
+	/** The state of every fd, indexed by the fd number. */
+	std::vector<FdState> fdstates(16);
+
+	/** These are used to hold the completions reaped from the completion ring. */
+	std::vector<struct io_uring_cqe> events(16);
+}
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(unsigned int tosubmit, unsigned int mincomplete, unsigned int flags, const void* arg, size_t argsize)
+{
+	return syscall(__NR_io_uring_enter, EngineHandle, tosubmit, mincomplete, flags, arg, argsize);
+}
+
+static void* MapRing(size_t size, off_t offset)
+{
+	return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, offset);
+}
+
+/** Publishes the locally queued submissions and hands them to the kernel, optionally waiting for completions. */
+static int Submit(unsigned int mincomplete, unsigned int flags, const void* arg, size_t argsize)
+{
+	__atomic_store_n(sqtail, sqlocaltail, __ATOMIC_RELEASE);
+	const unsigned int tosubmit = sqlocaltail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+	if (!tosubmit && !mincomplete)
+		return 0;
+
+	return io_uring_enter(tosubmit, mincomplete, flags, arg, argsize);
+}
+
+/** Hands the queued submissions to the kernel until at least one entry of the submission ring is free. */
+static void MakeRoom()
+{
+	// The kernel may take only part of the ring or fail with a transient error
+	// so keep trying for a while. The entries it has not taken can not be
+	// overwritten without losing poll requests so if it never makes room the
+	// socket engine can not carry on.
+	for (unsigned int attempt = 0; attempt < MaxSubmitAttempts; ++attempt)
+	{
+		if (Submit(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			break;
+
+		if (sqlocaltail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE) < sqentries)
+			return;
+	}
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring_enter() failed to submit a full ring: %s", strerror(errno));
+	std::cerr << con_red << "FATAL ERROR!" << con_reset << " Socket engine failed to submit a full ring. " << strerror(errno) << '.' << std::endl;
+	InspIRCd::QuickExit(EXIT_STATUS_SOCKETENGINE);
+}
+
+static struct io_uring_sqe* GetSQE()
+{
+	if (sqlocaltail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE) >= sqentries)
+		MakeRoom();
+
+	const unsigned int index = sqlocaltail & *sqmask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqarray[index] = index;
+	sqlocaltail++;
+	return sqe;
+}
+
+static uint64_t MakeUserData(int fd, const FdState& state)
+{
+	return (static_cast<uint64_t>(state.generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+static void ArmPoll(int fd, FdState& state, unsigned int pollevents)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	sqe->poll32_events = (pollevents << 16) | (pollevents >> 16);
+#else
+	sqe->poll32_events = pollevents;
+#endif
+	sqe->user_data = MakeUserData(fd, state);
+	state.armed = pollevents;
+}
+
+static void CancelPoll(int fd, FdState& state)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = MakeUserData(fd, state);
+	sqe->user_data = RemoveUserData;
+	state.generation++;
+	state.armed = 0;
+}
+
+static unsigned int mask_to_poll(int event_mask)
+{
+	unsigned int rv = 0;
+	if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+		rv |= POLLIN;
+	if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+		rv |= POLLOUT;
+	return rv;
+}
+
+/** Makes the armed poll request for an fd match the events it currently wants. */
+static void SyncPoll(int fd, int event_mask)
+{
+	FdState& state = fdstates[fd];
+	const unsigned int pollevents = mask_to_poll(event_mask);
+	if (pollevents == state.armed)
+		return;
+
+	if (state.armed)
+		CancelPoll(fd, state);
+	if (pollevents)
+		ArmPoll(fd, state, pollevents);
+}
+
+/** Creates a new ring and maps the memory it shares with the kernel.
+ * @return True if the ring was created; otherwise, false with errno set.
+ */
+static bool CreateRing()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	// Every fd has at most one poll request in flight so size the completion
+	// ring after the fd limit. IORING_SETUP_CLAMP caps it at the kernel maximum.
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = std::max<size_t>(SocketEngine::GetMaxFds(), SubmissionEntries * 2);
+	EngineHandle = io_uring_setup(SubmissionEntries, &params);
+	if (EngineHandle == -1)
+		return false;
+
+	// We need IORING_FEAT_EXT_ARG to wait with a timeout and IORING_FEAT_NODROP
+	// to never lose a completion if the ring overflows.
+	const unsigned int features = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+	if ((params.features & features) != features)
+	{
+		errno = ENOSYS;
+		return false;
+	}
+
+	sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sqringsize = cqringsize = std::max(sqringsize, cqringsize);
+
+	sqring = MapRing(sqringsize, IORING_OFF_SQ_RING);
+	if (sqring == MAP_FAILED)
+		return false;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cqring = sqring;
+	else
+		cqring = MapRing(cqringsize, IORING_OFF_CQ_RING);
+	if (cqring == MAP_FAILED)
+		return false;
+
+	sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe*>(MapRing(sqessize, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED)
+		return false;
+
+	char* const sqbase = static_cast<char*>(sqring);
+	sqhead = reinterpret_cast<unsigned int*>(sqbase + params.sq_off.head);
+	sqtail = reinterpret_cast<unsigned int*>(sqbase + params.sq_off.tail);
+	sqmask = reinterpret_cast<unsigned int*>(sqbase + params.sq_off.ring_mask);
+	sqarray = reinterpret_cast<unsigned int*>(sqbase + params.sq_off.array);
+	sqentries = params.sq_entries;
+	sqlocaltail = *sqtail;
+
+	char* const cqbase = static_cast<char*>(cqring);
+	cqhead = reinterpret_cast<unsigned int*>(cqbase + params.cq_off.head);
+	cqtail = reinterpret_cast<unsigned int*>(cqbase + params.cq_off.tail);
+	cqmask = reinterpret_cast<unsigned int*>(cqbase + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cqbase + params.cq_off.cqes);
+	return true;
+}
+
+/** Unmaps the memory shared with the kernel and closes the ring. */
+static void DestroyRing()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqessize);
+	if (cqring != MAP_FAILED && cqring != sqring)
+		munmap(cqring, cqringsize);
+	if (sqring != MAP_FAILED)
+		munmap(sqring, sqringsize);
+	sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+	cqring = sqring = MAP_FAILED;
+	SocketEngine::Close(EngineHandle);
+}
+
+void SocketEngine::Init()
+{
+	LookupMaxFds();
+	if (!CreateRing())
+		InitError();
+}
+
+void SocketEngine::RecoverFromFork()
+{
+	// The ring belongs to the parent process. Requests it has queued or armed
+	// are tied to the parent's task and are cancelled when it exits so the
+	// child needs a ring of its own with every poll request armed again.
+	DestroyRing();
+	if (!CreateRing())
+		InitError();
+
+	for (size_t fd = 0; fd < fdstates.size(); ++fd)
+	{
+		FdState& state = fdstates[fd];
+		state.generation++;
+		state.armed = 0;
+
+		EventHandler* const eh = GetRef(fd);
+		if (eh)
+			SyncPoll(fd, eh->GetEventMask());
+	}
+}
+
+void SocketEngine::Deinit()
+{
+	DestroyRing();
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d)", fd);
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	while (static_cast<unsigned int>(fd) >= fdstates.size())
+		fdstates.resize(fdstates.size() * 2);
+
+	SyncPoll(fd, event_mask);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	eh->SetEventMask(event_mask);
+	ResizeDouble(events);
+
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstates.size())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SetEvents() on unknown fd: %d", eh->GetFd());
+		return;
+	}
+
+	SyncPoll(fd, new_mask);
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstates.size())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d)", fd);
+		return;
+	}
+
+	// Always bump the generation, even if nothing is armed, as a completion
+	// for this fd may already be waiting to be dispatched in this iteration.
+	FdState& state = fdstates[fd];
+	if (state.armed)
+		CancelPoll(fd, state);
+	else
+		state.generation++;
+
+	SocketEngine::DelFdRef(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents()
+{
+	struct __kernel_timespec timeout;
+	timeout.tv_sec = GetWaitTimeout() / 1000;
+	timeout.tv_nsec = 0;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uintptr_t>(&timeout);
+
+	if (Submit(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != EINTR && errno != ETIME)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "io_uring_enter() failed: %s", strerror(errno));
+	ServerInstance->UpdateTime();
+	ServerInstance->LoopStats.EnterPhase(MainLoopStats::PHASE_EVENTS);
+
+	// Copy the completions out of the ring before dispatching them so that
+	// handlers which add or remove fds can not interfere with reaping.
+	const unsigned int head = *cqhead;
+	const unsigned int count = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE) - head;
+	if (events.size() < count)
+		events.resize(count);
+	for (unsigned int j = 0; j < count; j++)
+		events[j] = cqes[(head + j) & *cqmask];
+	__atomic_store_n(cqhead, head + count, __ATOMIC_RELEASE);
+
+	int processed = 0;
+	for (unsigned int j = 0; j < count; j++)
+	{
+		const struct io_uring_cqe& cqe = events[j];
+		if (cqe.user_data == RemoveUserData)
+			continue;
+
+		// Skip completions for poll requests which have since been abandoned.
+		const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+		const uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+		if (static_cast<unsigned int>(fd) >= fdstates.size() || fdstates[fd].generation != generation)
+			continue;
+
+		EventHandler* const eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		MainLoopStats::EventTimer timer(eh);
+
+		// The poll request was one-shot so nothing is armed for this fd any more.
+		fdstates[fd].armed = 0;
+		processed++;
+
+		if (cqe.res < 0)
+		{
+			stats.ErrorEvents++;
+			eh->OnEventHandlerError(-cqe.res);
+		}
+		else if (cqe.res & POLLHUP)
+		{
+			stats.ErrorEvents++;
+			eh->OnEventHandlerError(0);
+		}
+		else if (cqe.res & POLLERR)
+		{
+			stats.ErrorEvents++;
+			/* Get error number */
+			socklen_t codesize = sizeof(int);
+			int errcode;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->OnEventHandlerError(errcode);
+		}
+		else
+		{
+			int mask = eh->GetEventMask();
+			if (cqe.res & POLLIN)
+				mask &= ~FD_READ_WILL_BLOCK;
+			if (cqe.res & POLLOUT)
+				mask &= ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE);
+			eh->SetEventMask(mask);
+
+			if (cqe.res & POLLIN)
+				eh->OnEventHandlerRead();
+
+			// whoa! we got deleted, better not give out the write event
+			if ((cqe.res & POLLOUT) && eh == GetRef(fd))
+				eh->OnEventHandlerWrite();
+		}
+
+		// Queue a new poll request if the handler is still interested in events.
+		if (eh == GetRef(fd))
+			SyncPoll(fd, eh->GetEventMask());
+	}
+
+	stats.TotalEvents += processed;
+	return processed;
+}
@@ -167,11 +167,12 @@ int SocketEngine::DispatchEvents()
 {
 	struct timespec ts;
 	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_sec = GetWaitTimeout() / 1000;
 
 	int i = kevent(EngineHandle, &changelist.front(), ChangePos, &ke_list.front(), ke_list.size(), &ts);
 	ChangePos = 0;
 	ServerInstance->UpdateTime();
+	ServerInstance->LoopStats.EnterPhase(MainLoopStats::PHASE_EVENTS);
 
 	if (i < 0)
 		return i;
@@ -192,6 +193,8 @@ int SocketEngine::DispatchEvents()
 		if (fd < 0)
 			continue;
 
+		MainLoopStats::EventTimer timer(eh);
+
 		if (kev.flags & EV_EOF)
 		{
 			stats.ErrorEvents++;
@@ -156,9 +156,10 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, GetWaitTimeout());
 	int processed = 0;
 	ServerInstance->UpdateTime();
+	ServerInstance->LoopStats.EnterPhase(MainLoopStats::PHASE_EVENTS);
 
 	for (size_t index = 0; index < CurrentSetSize && processed < i; index++)
 	{
@@ -175,6 +176,8 @@ int SocketEngine::DispatchEvents()
 		if (!eh)
 			continue;
 
+		MainLoopStats::EventTimer timer(eh);
+
 		if (revents & POLLHUP)
 		{
 			eh->OnEventHandlerError(0);
@@ -130,13 +130,14 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 int SocketEngine::DispatchEvents()
 {
 	timeval tval;
-	tval.tv_sec = 1;
+	tval.tv_sec = GetWaitTimeout() / 1000;
 	tval.tv_usec = 0;
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
 	int sresult = select(MaxFD + 1, &rfdset, &wfdset, &errfdset, &tval);
 	ServerInstance->UpdateTime();
+	ServerInstance->LoopStats.EnterPhase(MainLoopStats::PHASE_EVENTS);
 
 	for (int i = 0, j = sresult; i <= MaxFD && j > 0; i++)
 	{
@@ -151,6 +152,8 @@ int SocketEngine::DispatchEvents()
 		if (!ev)
 			continue;
 
+		MainLoopStats::EventTimer timer(ev);
+
 		if (has_error)
 		{
 			stats.ErrorEvents++;
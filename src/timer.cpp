@@ -38,6 +38,7 @@ Timer::Timer(unsigned int secs_from_now, bool repeating)
 	: trigger(ServerInstance->Time() + secs_from_now)
 	, secs(secs_from_now)
 	, repeat(repeating)
+	, slot(NULL)
 {
 }
 
@@ -46,15 +47,53 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
+TimerManager::TimerManager()
+	: lasttick(0)
+{
+}
+
 void TimerManager::TickTimers(time_t TIME)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	// Normally only the slot for the current second needs checking but if the
+	// main loop stalled we have to catch up on the slots that were skipped. If
+	// the clock jumped by more than a full turn of the wheel (or backwards) we
+	// just check every slot once.
+	time_t first = lasttick + 1;
+	if (TIME < first || TIME - first >= static_cast<time_t>(WHEEL_SIZE))
+		first = TIME - WHEEL_SIZE + 1;
+
+	// This has to be updated first so that timers which are added while we are
+	// ticking are not put into a slot that has already been checked.
+	lasttick = TIME;
+	for (time_t slottime = first; slottime <= TIME; ++slottime)
+		TickSlot(wheel[slottime % WHEEL_SIZE], TIME);
+}
+
+void TimerManager::TickSlot(TimerList& list, time_t TIME)
+{
+	// Move the slot to the ticking list so that timers which repeat into the
+	// same slot are not checked again and timers which are deleted by other
+	// timers can still be unlinked.
+	while (!list.empty())
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		Timer* t = list.front();
+		list.pop_front();
+		ticking.push_front(t);
+		t->slot = &ticking;
+	}
 
-		Timers.erase(i++);
+	while (!ticking.empty())
+	{
+		Timer* t = ticking.front();
+		ticking.pop_front();
+		t->slot = NULL;
+
+		// This timer is due on a later turn of the wheel.
+		if (t->GetTrigger() > TIME)
+		{
+			AddTimer(t);
+			continue;
+		}
 
 		if (!t->Tick(TIME))
 			continue;
@@ -69,19 +108,19 @@ void TimerManager::TickTimers(time_t TIME)
 
 void TimerManager::DelTimer(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	if (!t->slot)
+		return;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
-	{
-		if (i->second == t)
-		{
-			Timers.erase(i);
-			break;
-		}
-	}
+	t->slot->erase(t);
+	t->slot = NULL;
 }
 
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	DelTimer(t);
+
+	// Timers which are already due are ticked on the next tick.
+	const time_t slottime = std::max(t->GetTrigger(), lasttick + 1);
+	t->slot = &wheel[slottime % WHEEL_SIZE];
+	t->slot->push_front(t);
 }
@@ -377,44 +377,68 @@ void UserManager::ServerNoticeAll(const char* text, ...)
 	}
 }
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the users, e.g. do
- * ping checks, registration timeouts, etc.
- */
-void UserManager::DoBackgroundUserStuff()
+UserTimer::UserTimer(LocalUser* u)
+	: Timer(1)
+	, user(u)
 {
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); )
-	{
-		// It's possible that we quit the user below due to ping timeout etc. and QuitUser() removes it from the list
-		LocalUser* curr = *i;
-		++i;
+	ServerInstance->Timers.AddTimer(this);
+}
 
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
+void UserTimer::Schedule(time_t when)
+{
+	// Deadlines such as the next ping are only ever checked when the timer
+	// ticks so we only need to do something if the user is due earlier.
+	if (when >= GetTrigger())
+		return;
+
+	SetTrigger(when);
+	ServerInstance->Timers.AddTimer(this);
+}
 
-		switch (curr->registered)
+bool UserTimer::Tick(time_t TIME)
+{
+	if (user->CommandFloodPenalty || user->eh.getSendQSize())
+	{
+		unsigned int rate = user->MyClass->GetCommandRate();
+		if (user->CommandFloodPenalty > rate)
+			user->CommandFloodPenalty -= rate;
+		else
+			user->CommandFloodPenalty = 0;
+		user->eh.OnDataReady();
+	}
+
+	if (!user->quitting)
+	{
+		switch (user->registered)
 		{
 			case REG_ALL:
-				CheckPingTimeout(curr);
+				CheckPingTimeout(user);
 				break;
 
 			case REG_NICKUSER:
-				CheckModulesReady(curr);
+				CheckModulesReady(user);
 				break;
 
 			default:
-				CheckRegistrationTimeout(curr);
+				CheckRegistrationTimeout(user);
 				break;
 		}
 	}
+
+	// The user will be removed soon so there is nothing left to check.
+	if (user->quitting)
+		return true;
+
+	// Users who are registering (modules may be waiting for lookups to finish) or who
+	// are being throttled have to be checked every second. Otherwise we can wait
+	// until it is time to ping them.
+	time_t next = TIME + 1;
+	if (user->registered == REG_ALL && !user->CommandFloodPenalty && !user->eh.getSendQSize())
+		next = std::max(next, user->nextping);
+
+	SetTrigger(next);
+	ServerInstance->Timers.AddTimer(this);
+	return true;
 }
 
 already_sent_t UserManager::NextAlreadySentId()
@@ -39,6 +39,48 @@
 
 ClientProtocol::MessageList LocalUser::sendmsglist;
 
+namespace
+{
+	/** Pools which users are allocated from. Each concrete type of user has its own
+	 * size so users are pooled by their size. There are only ever a few of these.
+	 */
+	class UserPools : public std::vector<insp::object_pool*>
+	{
+	 public:
+		~UserPools()
+		{
+			stdalgo::delete_all(*this);
+		}
+
+		insp::object_pool& Get(size_t size)
+		{
+			for (const_iterator i = begin(); i != end(); ++i)
+			{
+				if ((*i)->object_size() == size)
+					return **i;
+			}
+
+			push_back(new insp::object_pool(size, 32));
+			return *back();
+		}
+	} userpools;
+}
+
+void* User::operator new(size_t size)
+{
+	return userpools.Get(size).allocate();
+}
+
+void User::operator delete(void* ptr, size_t size)
+{
+	userpools.Get(size).deallocate(ptr);
+}
+
+const std::vector<insp::object_pool*>& User::GetPools()
+{
+	return userpools;
+}
+
 bool User::IsNoticeMaskSet(unsigned char sm)
 {
 	if (!isalpha(sm))
@@ -112,9 +154,11 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	, quitting_sendq(false)
 	, lastping(true)
 	, exempt(false)
+	, outputpending(false)
 	, nextping(0)
 	, idle_lastmsg(0)
 	, CommandFloodPenalty(0)
+	, timer(this)
 	, already_sent(0)
 {
 	signon = ServerInstance->Time();
@@ -130,6 +174,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 LocalUser::LocalUser(int myfd, const std::string& uid, Serializable::Data& data)
 	: User(uid, ServerInstance->FakeClient->server, USERTYPE_LOCAL)
 	, eh(this)
+	, timer(this)
 	, already_sent(0)
 {
 	eh.SetFd(myfd);
@@ -272,19 +317,24 @@ void UserIOHandler::OnDataReady()
 	// The position within the recvq of the current character.
 	std::string::size_type qpos;
 
+	// The position within the recvq of the start of the current line. Lines
+	// are not erased from the recvq as they are processed; instead we remove
+	// all of the consumed lines at once when we are done with this batch.
+	std::string::size_type linestart = 0;
+
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
 		// Check the newly received data for an EOL.
-		eolpos = recvq.find('\n', checked_until);
+		eolpos = recvq.find('\n', std::max(linestart, checked_until));
 		if (eolpos == std::string::npos)
 		{
 			checked_until = recvq.length();
-			return;
+			break;
 		}
 
 		// We've found a line! Clean it up and move it to the line buffer.
-		line.reserve(eolpos);
-		for (qpos = 0; qpos < eolpos; ++qpos)
+		line.reserve(eolpos - linestart);
+		for (qpos = linestart; qpos < eolpos; ++qpos)
 		{
 			char c = recvq[qpos];
 			switch (c)
@@ -299,43 +349,77 @@ void UserIOHandler::OnDataReady()
 			line.push_back(c);
 		}
 
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, eolpos + 1);
-		checked_until = 0;
-
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats.Recv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats.Recv += eolpos - linestart;
+		user->bytes_in += eolpos - linestart;
 		user->cmds_in++;
 
+		// Skip past the line we just found.
+		linestart = eolpos + 1;
+
 		ServerInstance->Parser.ProcessBuffer(user, line);
 		if (user->quitting)
-			return;
+			break;
 
 		// clear() does not reclaim memory associated with the string, so our .reserve() call is safe
 		line.clear();
 	}
 
+	// Pull all of the lines we processed out of the recvq in one go.
+	if (linestart)
+	{
+		recvq.erase(0, linestart);
+		checked_until = (checked_until > linestart) ? checked_until - linestart : 0;
+	}
+
+	if (user->quitting)
+		return;
+
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else if (user->CommandFloodPenalty || getSendQSize())
+		user->timer.Schedule(ServerInstance->Time() + 1); // The penalty needs to be reduced and the recvq processed.
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::OnEventHandlerWrite()
+{
+	StreamSocket::OnEventHandlerWrite();
+
+	// Let modules which are sending output in parts queue more now that there is room for it.
+	if (user->outputpending && !user->quitting && getSendQSize() < user->MyClass->GetSendqSoftMax())
+	{
+		user->outputpending = false;
+		FOREACH_MOD(OnUserOutputReady, (user));
+	}
+}
+
+bool UserIOHandler::CheckSendQ(size_t length)
 {
 	if (user->quitting_sendq)
-		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+		return false;
+	if (!user->quitting && getSendQSize() + length > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
-		return;
+		return false;
 	}
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
 
-	WriteData(data);
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (CheckSendQ(data.length()))
+		WriteData(data);
+}
+
+void UserIOHandler::AddWriteBuf(const reference<SendQueue::SharedBuffer>& data)
+{
+	if (CheckSendQ(data->GetData().length()))
+		WriteData(data);
 }
 
 void UserIOHandler::SwapInternals(UserIOHandler& other)
@@ -556,6 +640,7 @@ void LocalUser::CheckClass(bool clone_count)
 
 	this->nextping = ServerInstance->Time() + a->GetPingTime();
 	this->uniqueusername = a->uniqueusername;
+	this->timer.Schedule(this->nextping);
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -813,11 +898,13 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa)
 		FOREACH_MOD(OnSetUserIP, (this));
 }
 
-void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
+void LocalUser::Write(const reference<StreamSocket::SendQueue::SharedBuffer>& serialized)
 {
 	if (!SocketEngine::BoundsCheckFd(&eh))
 		return;
 
+	const std::string& text = serialized->GetData();
+
 	if (ServerInstance->Config->RawLog)
 	{
 		if (text.empty())
@@ -830,7 +917,7 @@ void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
 		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.c_str());
 	}
 
-	eh.AddWriteBuf(text);
+	eh.AddWriteBuf(serialized);
 
 	const size_t bytessent = text.length() + 2;
 	ServerInstance->stats.Sent += bytessent;
@@ -967,12 +1054,12 @@ already_sent_t User::ForEachNeighbor(ForEachNeighborHandler& handler, bool inclu
 	for (IncludeChanList::const_iterator i = include_chans.begin(); i != include_chans.end(); ++i)
 	{
 		Channel* chan = (*i)->chan;
-		const Channel::MemberMap& userlist = chan->GetUsers();
-		for (Channel::MemberMap::const_iterator j = userlist.begin(); j != userlist.end(); ++j)
+		const Channel::LocalMemberList& userlist = chan->GetLocalUsers();
+		for (Channel::LocalMemberList::const_iterator j = userlist.begin(); j != userlist.end(); ++j)
 		{
-			LocalUser* curr = IS_LOCAL(j->first);
+			LocalUser* curr = j->user;
 			// User not yet visited?
-			if ((curr) && (curr->already_sent != newid))
+			if (curr->already_sent != newid)
 			{
 				// Mark as visited and execute function
 				curr->already_sent = newid;
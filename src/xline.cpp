@@ -147,6 +147,261 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+bool XLineIndex::GetCIDR(XLine* line, irc::sockets::cidr_mask& mask)
+{
+	const std::string* hostmask = line->GetHostMask();
+	if (!hostmask)
+		return false;
+
+	// Only masks which are made up entirely of an IP address and an optional
+	// prefix length can be indexed. These are the same checks that MatchCIDR
+	// uses to decide whether a mask is a CIDR range.
+	const std::string::size_type per_pos = hostmask->rfind('/');
+	if (hostmask->find_first_not_of("0123456789abcdefABCDEF.:") < std::min(per_pos, hostmask->length()))
+		return false;
+
+	irc::sockets::sockaddrs sa;
+	if (per_pos == std::string::npos)
+	{
+		// An exact IP address; this is matched textually so it can only match
+		// a user whose IP address or real host parses to the same address.
+		if (!irc::sockets::aptosa(*hostmask, 0, sa))
+			return false;
+
+		mask = irc::sockets::cidr_mask(sa, 128);
+		return true;
+	}
+
+	if ((per_pos == hostmask->length() - 1) || (hostmask->find_first_not_of("0123456789", per_pos + 1) != std::string::npos))
+		return false;
+
+	if (!irc::sockets::aptosa(hostmask->substr(0, per_pos), 0, sa))
+		return false;
+
+	mask = irc::sockets::cidr_mask(*hostmask);
+	return true;
+}
+
+XLineIndex::LiteralType XLineIndex::GetLiteral(XLine* line, std::string& key)
+{
+	const std::string* hostmask = line->GetHostMask();
+	if (!hostmask || hostmask->empty())
+		return LITERAL_NONE;
+
+	// Only masks made up of characters which are the same in every case
+	// mapping can be indexed by their lowercase form.
+	if (hostmask->find_first_not_of("*?-./0123456789:ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz") != std::string::npos)
+		return LITERAL_NONE;
+
+	LiteralType type;
+	const std::string::size_type first = hostmask->find_first_of("*?");
+	const std::string::size_type last = hostmask->find_last_of("*?");
+	if (first == std::string::npos)
+	{
+		type = LITERAL_EXACT;
+		key.assign(*hostmask);
+	}
+	else if (last + 1 < hostmask->length())
+	{
+		// Prefer the end of the mask as that is the most specific part of a hostname.
+		type = LITERAL_SUFFIX;
+		key.assign(*hostmask, last + 1, std::string::npos);
+	}
+	else if (first > 0)
+	{
+		type = LITERAL_PREFIX;
+		key.assign(*hostmask, 0, first);
+	}
+	else
+	{
+		// The mask has no literal text at either end (e.g. * or *foo*).
+		return LITERAL_NONE;
+	}
+
+	for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+		*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+	return type;
+}
+
+XLineIndex::LiteralMap* XLineIndex::GetLiteralMap(LiteralType type)
+{
+	switch (type)
+	{
+		case LITERAL_EXACT:
+			return &exactlines;
+		case LITERAL_PREFIX:
+			return &prefixlines;
+		case LITERAL_SUFFIX:
+			return &suffixlines;
+		case LITERAL_NONE:
+			break;
+	}
+	return NULL;
+}
+
+XLineIndex::PrefixCount* XLineIndex::GetPrefixCount(unsigned char family)
+{
+	switch (family)
+	{
+		case AF_INET:
+			return &v4prefixes;
+		case AF_INET6:
+			return &v6prefixes;
+	}
+	return NULL;
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	irc::sockets::cidr_mask mask;
+	PrefixCount* prefixes;
+	if (GetCIDR(line, mask) && (prefixes = GetPrefixCount(mask.type)))
+	{
+		cidrlines[mask].push_back(line);
+		(*prefixes)[mask.length]++;
+		return;
+	}
+
+	std::string key;
+	LiteralMap* literals = GetLiteralMap(GetLiteral(line, key));
+	if (literals)
+	{
+		literals->lines[key].push_back(line);
+		literals->lengths[key.length()]++;
+		return;
+	}
+
+	unindexed.insert(line);
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	irc::sockets::cidr_mask mask;
+	PrefixCount* prefixes;
+	if (GetCIDR(line, mask) && (prefixes = GetPrefixCount(mask.type)))
+	{
+		CIDRMap::iterator iter = cidrlines.find(mask);
+		if (iter == cidrlines.end() || !stdalgo::vector::swaperase(iter->second, line))
+			return;
+
+		if (iter->second.empty())
+			cidrlines.erase(iter);
+
+		PrefixCount::iterator count = prefixes->find(mask.length);
+		if (count != prefixes->end() && !--count->second)
+			prefixes->erase(count);
+		return;
+	}
+
+	std::string key;
+	LiteralMap* literals = GetLiteralMap(GetLiteral(line, key));
+	if (literals)
+	{
+		LiteralMap::LineMap::iterator iter = literals->lines.find(key);
+		if (iter == literals->lines.end() || !stdalgo::vector::swaperase(iter->second, line))
+			return;
+
+		if (iter->second.empty())
+			literals->lines.erase(iter);
+
+		LiteralMap::LengthCount::iterator count = literals->lengths.find(key.length());
+		if (count != literals->lengths.end() && !--count->second)
+			literals->lengths.erase(count);
+		return;
+	}
+
+	unindexed.erase(line);
+}
+
+void XLineIndex::Clear()
+{
+	cidrlines.clear();
+	v4prefixes.clear();
+	v6prefixes.clear();
+	exactlines.lines.clear();
+	exactlines.lengths.clear();
+	prefixlines.lines.clear();
+	prefixlines.lengths.clear();
+	suffixlines.lines.clear();
+	suffixlines.lengths.clear();
+	unindexed.clear();
+}
+
+void XLineIndex::FindCIDR(const irc::sockets::sockaddrs& sa, LineList& out)
+{
+	PrefixCount* prefixes = GetPrefixCount(sa.family());
+	if (!prefixes)
+		return;
+
+	for (PrefixCount::const_iterator i = prefixes->begin(); i != prefixes->end(); ++i)
+	{
+		CIDRMap::const_iterator iter = cidrlines.find(irc::sockets::cidr_mask(sa, i->first));
+		if (iter != cidrlines.end())
+			out.insert(out.end(), iter->second.begin(), iter->second.end());
+	}
+}
+
+void XLineIndex::FindLiteral(const std::string& host, LineList& out)
+{
+	std::string lhost(host);
+	for (std::string::iterator i = lhost.begin(); i != lhost.end(); ++i)
+		*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+
+	LiteralMap::LineMap::const_iterator iter = exactlines.lines.find(lhost);
+	if (iter != exactlines.lines.end())
+		out.insert(out.end(), iter->second.begin(), iter->second.end());
+
+	for (LiteralMap::LengthCount::const_iterator i = prefixlines.lengths.begin(); i != prefixlines.lengths.end() && i->first <= lhost.length(); ++i)
+	{
+		iter = prefixlines.lines.find(lhost.substr(0, i->first));
+		if (iter != prefixlines.lines.end())
+			out.insert(out.end(), iter->second.begin(), iter->second.end());
+	}
+
+	for (LiteralMap::LengthCount::const_iterator i = suffixlines.lengths.begin(); i != suffixlines.lengths.end() && i->first <= lhost.length(); ++i)
+	{
+		iter = suffixlines.lines.find(lhost.substr(lhost.length() - i->first));
+		if (iter != suffixlines.lines.end())
+			out.insert(out.end(), iter->second.begin(), iter->second.end());
+	}
+}
+
+void XLineIndex::Find(User* user, LineList& out)
+{
+	const size_t start = out.size();
+	const std::string& realhost = user->GetRealHost();
+	const std::string& ipstring = user->GetIPString();
+	const bool checkrealhost = (realhost != ipstring);
+
+	if (!cidrlines.empty())
+	{
+		FindCIDR(user->client_sa, out);
+
+		// Lines are also checked against the real host which might be an IP
+		// address that is different to the one the user is connecting from.
+		irc::sockets::sockaddrs sa;
+		if (checkrealhost && irc::sockets::aptosa(realhost, 0, sa))
+			FindCIDR(sa, out);
+	}
+
+	if (!exactlines.lines.empty() || !prefixlines.lines.empty() || !suffixlines.lines.empty())
+	{
+		FindLiteral(ipstring, out);
+		if (checkrealhost)
+			FindLiteral(realhost, out);
+	}
+
+	// Remove any lines that were found by both the IP address and the real host.
+	if (checkrealhost)
+	{
+		std::sort(out.begin() + start, out.end());
+		out.erase(std::unique(out.begin() + start, out.end()), out.end());
+	}
+
+	// The buckets above are not ordered with respect to each other.
+	std::sort(out.begin() + start, out.end(), LookupOrder());
+}
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -162,29 +417,45 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
+	XLineIndex::LineList candidates;
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
 	{
 		LocalUser* u = *u2;
 		u->exempt = false;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doesn't trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
+		candidates.clear();
+		FindCandidates("E", u, candidates);
+		for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
+			XLine *e = *i;
 			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
+			{
 				u->exempt = true;
-
-			i = safei;
+				break;
+			}
 		}
 	}
 }
 
+void XLineManager::FindCandidates(const std::string& type, User* user, XLineIndex::LineList& out)
+{
+	std::map<std::string, XLineIndex>::iterator n = line_index.find(type);
+	if (n == line_index.end())
+		return;
+
+	XLineIndex& index = n->second;
+	const size_t start = out.size();
+	index.Find(user, out);
+
+	// Both lists are already in lookup order so the candidates are checked in
+	// the same order as they would be if every line was checked.
+	const XLineIndex::LineSet& unindexed = index.GetUnindexed();
+	const size_t middle = out.size();
+	out.insert(out.end(), unindexed.begin(), unindexed.end());
+	std::inplace_merge(out.begin() + start, out.begin() + middle, out.end(), XLineIndex::LookupOrder());
+}
+
 
 XLineLookup* XLineManager::GetAll(const std::string &type)
 {
@@ -310,6 +581,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	line_index[line->type].Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -343,6 +615,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string& type, std::s
 	y->second->Unset();
 
 	stdalgo::erase(pending_lines, y->second);
+	line_index[type].Remove(y->second);
 
 	delete y->second;
 	x->second.erase(y);
@@ -367,27 +640,23 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 
 	const time_t current = ServerInstance->Time();
 
-	LookupIter safei;
+	XLineIndex::LineList candidates;
+	FindCandidates(type, user, candidates);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
+		XLine* line = *i;
+		if (line->duration && current > line->expiry)
 		{
 			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
+			ExpireLine(x, x->second.find(line->Displayable()));
 			continue;
 		}
 
-		if (i->second->Matches(user))
+		if (line->Matches(user))
 		{
-			return i->second;
+			return line;
 		}
-
-		i = safei;
 	}
 	return NULL;
 }
@@ -442,15 +711,51 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item, bool sil
 	 * -- Brain
 	 */
 	stdalgo::erase(pending_lines, item->second);
+	line_index[container->first].Remove(item->second);
 
 	delete item->second;
 	container->second.erase(item);
 }
 
 
+namespace
+{
+	typedef TR1NS::unordered_map<XLine*, size_t> PositionMap;
+
+	/** Orders pending xlines by the order they were added in. */
+	struct PendingOrder
+	{
+		const PositionMap& positions;
+
+		PendingOrder(const PositionMap& pos)
+			: positions(pos)
+		{
+		}
+
+		bool operator()(XLine* one, XLine* two) const
+		{
+			return positions.find(one)->second < positions.find(two)->second;
+		}
+	};
+}
+
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
+	if (pending_lines.empty())
+		return;
+
+	// Index the pending lines so that each user is only checked against the
+	// lines which might match them rather than every line that was added.
+	XLineIndex pending;
+	PositionMap positions;
+	for (std::vector<XLine*>::const_iterator i = pending_lines.begin(); i != pending_lines.end(); ++i)
+	{
+		pending.Add(*i);
+		positions[*i] = i - pending_lines.begin();
+	}
+
+	XLineIndex::LineList candidates;
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); )
 	{
@@ -460,7 +765,13 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		// Apply the lines in the order they were added.
+		candidates.clear();
+		pending.Find(u, candidates);
+		candidates.insert(candidates.end(), pending.GetUnindexed().begin(), pending.GetUnindexed().end());
+		std::sort(candidates.begin(), candidates.end(), PendingOrder(positions));
+
+		for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 		{
 			XLine *x = *i;
 			if (x->Matches(u))
@@ -770,6 +1081,26 @@ const std::string& QLine::Displayable()
 	return nick;
 }
 
+const std::string* ELine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* KLine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* GLine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* ZLine::GetHostMask()
+{
+	return &ipaddr;
+}
+
 bool KLine::IsBurstable()
 {
 	return false;
@@ -0,0 +1,375 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compares splitting the lines of a server burst into their parts by copying
+ * each line out of the recvq and tokenizing it with irc::tokenstream, as
+ * m_spanningtree used to, against tokenizing them in place in the recvq as it
+ * does now. The burst is fed in as reads of 64 KiB. Only the work done before
+ * a command handler is called is measured; what the handlers allocate to
+ * create the users, channels and memberships is not.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <time.h>
+#include <vector>
+
+static unsigned long allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	void* ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) throw()
+{
+	std::free(ptr);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void* ptr, size_t) throw()
+{
+	std::free(ptr);
+}
+#endif
+
+typedef std::vector<std::string> Params;
+
+/** The parts of a line. The new parser reuses one of these for every line. */
+struct Line
+{
+	std::string tags;
+	std::string prefix;
+	std::string command;
+	Params params;
+	std::vector<std::string> sparestrings;
+};
+
+static unsigned long checksum = 0;
+
+static void Handle(const Line& line)
+{
+	checksum += line.command.length() + line.prefix.length() + line.params.size();
+}
+
+// Keep this in sync with irc::tokenstream in src/hashcomp.cpp.
+class TokenStream
+{
+ private:
+	std::string message;
+	size_t position;
+
+ public:
+	TokenStream(const std::string& msg)
+		: message(msg)
+		, position(0)
+	{
+	}
+
+	bool GetMiddle(std::string& token)
+	{
+		if (position >= message.length())
+		{
+			token.clear();
+			return false;
+		}
+
+		size_t separator = message.find(' ', position);
+		if (separator == std::string::npos)
+		{
+			token.assign(message, position, std::string::npos);
+			position = message.length();
+			return true;
+		}
+
+		token.assign(message, position, separator - position);
+		position = message.find_first_not_of(' ', separator);
+		return true;
+	}
+
+	bool GetTrailing(std::string& token)
+	{
+		if (position >= message.length())
+		{
+			token.clear();
+			return false;
+		}
+
+		if (message[position] == ':')
+		{
+			token.assign(message, position + 1, std::string::npos);
+			position = message.length();
+			return true;
+		}
+
+		return GetMiddle(token);
+	}
+};
+
+/** Splits a line the way TreeSocket::Split did before it parsed lines in place. */
+static void OldSplit(const std::string& text, Line& line)
+{
+	std::string token;
+	TokenStream tokens(text);
+
+	if (!tokens.GetMiddle(token))
+		return;
+
+	if (token[0] == '@')
+	{
+		line.tags.assign(token, 1, std::string::npos);
+		if (!tokens.GetMiddle(token))
+			return;
+	}
+
+	if (token[0] == ':')
+	{
+		line.prefix.assign(token, 1, std::string::npos);
+		if (!tokens.GetMiddle(token))
+			return;
+	}
+
+	line.command.assign(token);
+	while (tokens.GetTrailing(token))
+		line.params.push_back(token);
+}
+
+/** Processes the recvq the way TreeSocket::OnDataReady did before it parsed lines in place. */
+static void OldProcess(std::string& recvq)
+{
+	std::string text;
+	for (;;)
+	{
+		const std::string::size_type eol = recvq.find('\n');
+		if (eol == std::string::npos)
+			break;
+		text.assign(recvq, 0, eol);
+		recvq.erase(0, eol + 1);
+
+		const std::string::size_type cr = text.find('\r');
+		if (cr != std::string::npos)
+			text.erase(cr);
+
+		// ProcessLine declared these for every line and ProcessConnectedLine
+		// copied the parameters again before calling the handler.
+		Line line;
+		OldSplit(text, line);
+		Line copy;
+		copy.params.assign(line.params.begin(), line.params.end());
+		copy.command = line.command;
+		copy.prefix = line.prefix;
+		Handle(copy);
+	}
+}
+
+// Keep this in sync with NextToken in src/modules/m_spanningtree/treesocket2.cpp.
+static std::string::size_type NextToken(const std::string& buffer, std::string::size_type& pos, std::string::size_type end, bool trailing, std::string::size_type& tokstart)
+{
+	if (pos >= end)
+		return std::string::npos;
+
+	if ((trailing) && (buffer[pos] == ':'))
+	{
+		tokstart = pos + 1;
+		pos = end;
+		return end - tokstart;
+	}
+
+	tokstart = pos;
+	const char* const separator = static_cast<const char*>(memchr(buffer.data() + pos, ' ', end - pos));
+	if (!separator)
+	{
+		pos = end;
+		return end - tokstart;
+	}
+
+	const std::string::size_type seppos = separator - buffer.data();
+	for (pos = seppos; (pos < end) && (buffer[pos] == ' '); ++pos)
+		;
+	return seppos - tokstart;
+}
+
+// Keep this in sync with TreeSocket::Split in src/modules/m_spanningtree/treesocket2.cpp.
+static void NewSplit(const std::string& buffer, std::string::size_type start, std::string::size_type end, Line& line)
+{
+	for (Params::iterator i = line.params.begin(); i != line.params.end(); ++i)
+	{
+		line.sparestrings.push_back(std::string());
+		line.sparestrings.back().swap(*i);
+	}
+	line.params.clear();
+	line.tags.clear();
+	line.prefix.clear();
+	line.command.clear();
+
+	std::string::size_type pos = start;
+	std::string::size_type tokstart;
+	std::string::size_type toklen = NextToken(buffer, pos, end, false, tokstart);
+	if (toklen == std::string::npos)
+		return;
+
+	if (buffer[tokstart] == '@')
+	{
+		line.tags.assign(buffer, tokstart + 1, toklen - 1);
+		toklen = NextToken(buffer, pos, end, false, tokstart);
+		if (toklen == std::string::npos)
+			return;
+	}
+
+	if (buffer[tokstart] == ':')
+	{
+		line.prefix.assign(buffer, tokstart + 1, toklen - 1);
+		toklen = NextToken(buffer, pos, end, false, tokstart);
+		if (toklen == std::string::npos)
+			return;
+	}
+
+	line.command.assign(buffer, tokstart, toklen);
+	while ((toklen = NextToken(buffer, pos, end, true, tokstart)) != std::string::npos)
+	{
+		line.params.push_back(std::string());
+		std::string& param = line.params.back();
+		if (!line.sparestrings.empty())
+		{
+			param.swap(line.sparestrings.back());
+			line.sparestrings.pop_back();
+		}
+		param.assign(buffer, tokstart, toklen);
+	}
+}
+
+// Keep this in sync with TreeSocket::OnDataReady in src/modules/m_spanningtree/treesocket1.cpp.
+static void NewProcess(std::string& recvq, Line& line)
+{
+	std::string::size_type linestart = 0;
+	for (;;)
+	{
+		const std::string::size_type eolpos = recvq.find('\n', linestart);
+		if (eolpos == std::string::npos)
+			break;
+
+		const char* const cr = static_cast<const char*>(memchr(recvq.data() + linestart, '\r', eolpos - linestart));
+		const std::string::size_type start = linestart;
+		const std::string::size_type end = cr ? cr - recvq.data() : eolpos;
+		linestart = eolpos + 1;
+
+		NewSplit(recvq, start, end, line);
+		Handle(line);
+	}
+	recvq.erase(0, linestart);
+}
+
+/** Builds a burst of the given number of users spread over one channel for every 30 of them. */
+static std::string MakeBurst(unsigned int users, unsigned int& lines)
+{
+	std::string burst;
+	char buf[512];
+	lines = 0;
+	for (unsigned int i = 0; i < users; ++i)
+	{
+		snprintf(buf, sizeof(buf), ":0AA UID 0AAAA%04u 1700000000 user%u h%u.example.com h%u.example.com ident%u 10.0.%u.%u 1700000000 +iwx :Real Name %u\r\n", i, i, i, i, i, i / 250, i % 250, i);
+		burst.append(buf);
+		snprintf(buf, sizeof(buf), ":0AAAA%04u METADATA 0AAAA%04u accountname :account%u\r\n", i, i, i);
+		burst.append(buf);
+		lines += 2;
+	}
+
+	for (unsigned int c = 0; c * 30 < users; ++c)
+	{
+		snprintf(buf, sizeof(buf), ":0AA FJOIN #channel%u 1700000000 +nt :", c);
+		burst.append(buf);
+		for (unsigned int i = c * 30; i < users && i < (c + 1) * 30; ++i)
+		{
+			snprintf(buf, sizeof(buf), "%s,0AAAA%04u:%u ", (i % 10) ? "" : "o", i, i);
+			burst.append(buf);
+		}
+		burst.append("\r\n");
+		snprintf(buf, sizeof(buf), ":0AA FMODE #channel%u 1700000000 +bbb n%u!*@* m%u!*@* *!*@h%u.example.com\r\n", c, c, c, c);
+		burst.append(buf);
+		lines += 2;
+	}
+	return burst;
+}
+
+static double Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+	static const size_t readsize = 65536;
+	static const unsigned int reps = 50;
+
+	unsigned int lines;
+	const std::string burst = MakeBurst(5000, lines);
+
+	// The recvqs and the reused line are warmed up first so that only the
+	// allocations made for every line are counted.
+	std::string oldrecvq;
+	oldrecvq.reserve(burst.length());
+	std::string newrecvq;
+	newrecvq.reserve(burst.length());
+	Line line;
+	for (size_t pos = 0; pos < burst.length(); pos += readsize)
+	{
+		newrecvq.append(burst, pos, readsize);
+		NewProcess(newrecvq, line);
+	}
+
+	unsigned long oldallocs = allocations;
+	double start = Now();
+	for (unsigned int r = 0; r < reps; ++r)
+	{
+		for (size_t pos = 0; pos < burst.length(); pos += readsize)
+		{
+			oldrecvq.append(burst, pos, readsize);
+			OldProcess(oldrecvq);
+		}
+	}
+	const double oldtime = Now() - start;
+	oldallocs = allocations - oldallocs;
+
+	unsigned long newallocs = allocations;
+	start = Now();
+	for (unsigned int r = 0; r < reps; ++r)
+	{
+		for (size_t pos = 0; pos < burst.length(); pos += readsize)
+		{
+			newrecvq.append(burst, pos, readsize);
+			NewProcess(newrecvq, line);
+		}
+	}
+	const double newtime = Now() - start;
+	newallocs = allocations - newallocs;
+
+	const double total = static_cast<double>(lines) * reps;
+	std::printf("%u lines (%lu bytes) read %lu bytes at a time, %u times\n", lines, static_cast<unsigned long>(burst.length()), static_cast<unsigned long>(readsize), reps);
+	std::printf("%-28s %12s %18s\n", "", "ns per line", "allocs per line");
+	std::printf("%-28s %12.1f %18.2f\n", "copy and tokenstream", oldtime / total, oldallocs / total);
+	std::printf("%-28s %12.1f %18.2f\n", "in place", newtime / total, newallocs / total);
+	return checksum ? 0 : 1;
+}
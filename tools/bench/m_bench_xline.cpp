@@ -0,0 +1,174 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "xline.h"
+
+/** Compares looking up the G-lines which match a user with XLineIndex against
+ * checking every line. The users are fake users with a spread of IP addresses
+ * and hostnames; the lines are a mix of suffix, prefix, CIDR and exact host
+ * masks plus a few which can not be indexed.
+ */
+class CommandXLineBench : public Command
+{
+ private:
+	static void CreateUsers(unsigned int count, std::vector<User*>& users)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			FakeUser* user = new FakeUser(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server);
+			user->ident = "bench";
+
+			irc::sockets::sockaddrs sa;
+			if (i % 10)
+				irc::sockets::aptosa(InspIRCd::Format("3.%u.%u.9", i % 250, i / 250), 0, sa);
+			else
+				irc::sockets::aptosa(InspIRCd::Format("1.%u.7.9", i % 250), 0, sa);
+			user->SetClientIP(sa);
+			user->ChangeRealHost(InspIRCd::Format("h%u.dom%u.example.com", i, i * 37), true);
+			users.push_back(user);
+		}
+	}
+
+	static void CreateLines(unsigned int count, std::vector<XLine*>& lines)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			std::string host;
+			if (i < 5)
+				host = InspIRCd::Format("*bad%u*", i);
+			else if (i % 10 < 4)
+				host = InspIRCd::Format("*.dom%u.example.com", i);
+			else if (i % 10 < 7)
+				host = InspIRCd::Format("1.%u.%u.*", i % 250, i / 250);
+			else if (i % 10 < 9)
+				host = InspIRCd::Format("2.%u.%u.0/24", i % 250, i / 250);
+			else
+				host = InspIRCd::Format("host%u.isp.net", i);
+			lines.push_back(new GLine(ServerInstance->Time(), 0, "bench", "bench", "*", host));
+		}
+	}
+
+	/** Checks that an index keeps lines of different types which have the same mask. */
+	static bool CheckSameMask()
+	{
+		GLine gline(ServerInstance->Time(), 0, "bench", "bench", "*", "*bench*");
+		ELine eline(ServerInstance->Time(), 0, "bench", "bench", "*", "*bench*");
+
+		XLineIndex index;
+		index.Add(&gline);
+		index.Add(&eline);
+		const bool kept = (index.GetUnindexed().size() == 2);
+		index.Remove(&gline);
+		index.Remove(&eline);
+		return kept && index.GetUnindexed().empty();
+	}
+
+ public:
+	CommandXLineBench(Module* Creator)
+		: Command(Creator, "XLINEBENCH", 0, 1)
+	{
+		syntax = "[<users>]";
+		flags_needed = 'o';
+	}
+
+	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE
+	{
+		const unsigned int usercount = parameters.empty() ? 1000 : ConvToNum<unsigned int>(parameters[0]);
+		if (!usercount)
+			return CMD_FAILURE;
+
+		user->WriteNotice(InspIRCd::Format("*** XLINEBENCH: lines of different types with the same mask: %s",
+			CheckSameMask() ? "ok" : "FAILED"));
+
+		std::vector<User*> users;
+		CreateUsers(usercount, users);
+
+		static const unsigned int linecounts[] = { 1000, 10000, 100000 };
+		for (size_t s = 0; s < sizeof(linecounts) / sizeof(linecounts[0]); ++s)
+		{
+			std::vector<XLine*> lines;
+			CreateLines(linecounts[s], lines);
+
+			XLineIndex index;
+			for (std::vector<XLine*>::const_iterator l = lines.begin(); l != lines.end(); ++l)
+				index.Add(*l);
+
+			unsigned long linearhits = 0;
+			const uint64_t linearstart = InspIRCd::MonotonicTime();
+			for (std::vector<User*>::const_iterator u = users.begin(); u != users.end(); ++u)
+			{
+				for (std::vector<XLine*>::const_iterator l = lines.begin(); l != lines.end(); ++l)
+				{
+					if ((*l)->Matches(*u))
+					{
+						linearhits++;
+						break;
+					}
+				}
+			}
+
+			unsigned long indexhits = 0;
+			XLineIndex::LineList candidates;
+			const uint64_t indexstart = InspIRCd::MonotonicTime();
+			for (std::vector<User*>::const_iterator u = users.begin(); u != users.end(); ++u)
+			{
+				candidates.clear();
+				index.Find(*u, candidates);
+				candidates.insert(candidates.end(), index.GetUnindexed().begin(), index.GetUnindexed().end());
+				for (XLineIndex::LineList::const_iterator l = candidates.begin(); l != candidates.end(); ++l)
+				{
+					if ((*l)->Matches(*u))
+					{
+						indexhits++;
+						break;
+					}
+				}
+			}
+			const uint64_t indexend = InspIRCd::MonotonicTime();
+
+			user->WriteNotice(InspIRCd::Format("*** XLINEBENCH: %u lines: linear %.1f us/user, index %.1f us/user, hits %lu/%lu",
+				linecounts[s], (indexstart - linearstart) / 1000.0 / users.size(), (indexend - indexstart) / 1000.0 / users.size(),
+				linearhits, indexhits));
+
+			stdalgo::delete_all(lines);
+		}
+
+		for (std::vector<User*>::const_iterator u = users.begin(); u != users.end(); ++u)
+			ServerInstance->GlobalCulls.AddItem(*u);
+		return CMD_SUCCESS;
+	}
+};
+
+class ModuleBenchXLine : public Module
+{
+ private:
+	CommandXLineBench cmd;
+
+ public:
+	ModuleBenchXLine()
+		: cmd(this)
+	{
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Adds the /XLINEBENCH command which benchmarks the X-line index against a linear scan.");
+	}
+};
+
+MODULE_INIT(ModuleBenchXLine)
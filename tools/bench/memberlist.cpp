@@ -0,0 +1,176 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compares containers for the members of a channel: a map which stores each
+ * Membership inline, a sorted vector of pointers to pooled Memberships and a
+ * map of pointers to pooled Memberships (Channel::MemberMap). Each test joins
+ * every member, looks each one up, iterates over the list and then parts
+ * every member in a channel of 2 to 50000 members.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "compat.h"
+#include "aligned_storage.h"
+#include "flat_map.h"
+#include "object_pool.h"
+
+struct User
+{
+	char data[512];
+};
+
+// Roughly the same size and layout as a real Membership.
+struct Membership
+{
+	User* user;
+	void* chan;
+	std::map<int, int> extensions;
+	std::string modes;
+	uint64_t id;
+	void* node[2];
+	size_t localpos;
+
+	Membership(User* u)
+		: user(u)
+	{
+	}
+};
+
+typedef std::map<User*, insp::aligned_storage<Membership> > InlineMap;
+typedef insp::flat_map<User*, Membership*> PooledFlatMap;
+typedef std::map<User*, Membership*> PooledMap;
+
+struct Timings
+{
+	double join;
+	double part;
+	double lookup;
+	double iterate;
+};
+
+static insp::object_pool pool(sizeof(Membership));
+
+// Stops the compiler from optimising away the lookups and iteration.
+static volatile size_t checksum;
+
+static double Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static Membership* Join(InlineMap& members, User* user)
+{
+	return new(members.insert(std::make_pair(user, insp::aligned_storage<Membership>())).first->second) Membership(user);
+}
+
+template <typename Map>
+static Membership* Join(Map& members, User* user)
+{
+	Membership* memb = new(pool.allocate()) Membership(user);
+	members.insert(std::make_pair(user, memb));
+	return memb;
+}
+
+static void Part(InlineMap& members, InlineMap::iterator it)
+{
+	it->second->~Membership();
+	members.erase(it);
+}
+
+template <typename Map>
+static void Part(Map& members, typename Map::iterator it)
+{
+	Membership* memb = it->second;
+	memb->~Membership();
+	pool.deallocate(memb);
+	members.erase(it);
+}
+
+template <typename Map>
+static void Run(const std::vector<User*>& users, size_t count, Timings& timings)
+{
+	Map members;
+	double start = Now();
+	for (size_t i = 0; i < count; ++i)
+		Join(members, users[i]);
+	timings.join += Now() - start;
+
+	size_t sum = 0;
+	start = Now();
+	for (size_t i = 0; i < count; ++i)
+		sum += members.find(users[(i * 7919) % count])->second->modes.size();
+	timings.lookup += Now() - start;
+
+	start = Now();
+	for (typename Map::const_iterator i = members.begin(); i != members.end(); ++i)
+		sum += i->second->modes.size() + reinterpret_cast<size_t>(i->first);
+	timings.iterate += Now() - start;
+
+	start = Now();
+	for (size_t i = 0; i < count; ++i)
+		Part(members, members.find(users[i]));
+	timings.part += Now() - start;
+
+	checksum += sum;
+}
+
+int main()
+{
+	static const size_t sizes[] = { 2, 10, 100, 1000, 10000, 50000 };
+
+	// Users are created in a random order so that their addresses are not sorted.
+	std::vector<User*> users;
+	for (size_t i = 0; i < 50000; ++i)
+		users.push_back(new User);
+	std::srand(42);
+	std::random_shuffle(users.begin(), users.end());
+
+	std::printf("Nanoseconds per member for the inline map / pooled sorted vector / pooled map:\n");
+	std::printf("%8s %24s %24s %24s %24s\n", "members", "join", "part", "lookup", "iterate");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		const size_t count = sizes[s];
+		const size_t reps = std::max<size_t>(1, 200000 / count);
+
+		Timings timings[3] = { };
+		for (size_t r = 0; r < reps; ++r)
+		{
+			Run<InlineMap>(users, count, timings[0]);
+			Run<PooledFlatMap>(users, count, timings[1]);
+			Run<PooledMap>(users, count, timings[2]);
+		}
+
+		const double ops = static_cast<double>(reps) * count;
+		std::printf("%8lu", static_cast<unsigned long>(count));
+		std::printf(" %7.1f / %6.1f / %6.1f", timings[0].join / ops, timings[1].join / ops, timings[2].join / ops);
+		std::printf(" %7.1f / %6.1f / %6.1f", timings[0].part / ops, timings[1].part / ops, timings[2].part / ops);
+		std::printf(" %7.1f / %6.1f / %6.1f", timings[0].lookup / ops, timings[1].lookup / ops, timings[2].lookup / ops);
+		std::printf(" %7.1f / %6.1f / %6.1f\n", timings[0].iterate / ops, timings[1].iterate / ops, timings[2].iterate / ops);
+	}
+	return 0;
+}
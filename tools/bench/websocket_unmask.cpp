@@ -0,0 +1,126 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compares unmasking WebSocket payloads a byte at a time, as m_websocket used
+ * to, against the word at a time routine it uses now. Both include allocating
+ * the output string.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+// Keep this in sync with WebSocketHook::UnmaskPayload in src/modules/m_websocket.cpp.
+static void UnmaskPayload(unsigned char* out, const unsigned char* in, size_t len, const unsigned char* maskkey)
+{
+	size_t pos = 0;
+#ifdef __SSE2__
+	uint32_t key32;
+	memcpy(&key32, maskkey, sizeof(key32));
+	const __m128i key128 = _mm_set1_epi32(key32);
+	for (; pos + sizeof(__m128i) <= len; pos += sizeof(__m128i))
+	{
+		const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + pos), _mm_xor_si128(data, key128));
+	}
+#endif
+
+	uint64_t key64;
+	memcpy(&key64, maskkey, 4);
+	memcpy(reinterpret_cast<unsigned char*>(&key64) + 4, maskkey, 4);
+	for (; pos + sizeof(key64) <= len; pos += sizeof(key64))
+	{
+		uint64_t data;
+		memcpy(&data, in + pos, sizeof(data));
+		data ^= key64;
+		memcpy(out + pos, &data, sizeof(data));
+	}
+
+	for (; pos < len; pos++)
+		out[pos] = in[pos] ^ maskkey[pos % 4];
+}
+
+static std::string UnmaskBytes(const std::string& in, const unsigned char* maskkey)
+{
+	std::string out;
+	unsigned int maskkeypos = 0;
+	for (std::string::const_iterator i = in.begin(); i != in.end(); ++i)
+	{
+		out.push_back(static_cast<unsigned char>(*i) ^ maskkey[maskkeypos++]);
+		maskkeypos %= 4;
+	}
+	return out;
+}
+
+static std::string UnmaskWords(const std::string& in, const unsigned char* maskkey)
+{
+	std::string out(in.length(), '\0');
+	UnmaskPayload(reinterpret_cast<unsigned char*>(&out[0]), reinterpret_cast<const unsigned char*>(in.data()), in.length(), maskkey);
+	return out;
+}
+
+// Stops the compiler from optimising away the unmasking.
+static volatile size_t checksum;
+
+static double Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+	static const unsigned char maskkey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	static const size_t sizes[] = { 100, 512, 4096, 65535 };
+
+	std::printf("%10s %12s %12s\n", "frame size", "bytes GB/s", "words GB/s");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		std::string in(sizes[s], '\0');
+		for (size_t i = 0; i < in.length(); ++i)
+			in[i] = static_cast<char>(i * 7);
+
+		if (UnmaskBytes(in, maskkey) != UnmaskWords(in, maskkey))
+		{
+			std::printf("%10lu: the unmasked payloads differ\n", static_cast<unsigned long>(sizes[s]));
+			return 1;
+		}
+
+		const size_t iterations = 200000000 / in.length();
+
+		const double bytestart = Now();
+		for (size_t i = 0; i < iterations; ++i)
+			checksum += UnmaskBytes(in, maskkey)[in.length() / 2];
+
+		const double wordstart = Now();
+		for (size_t i = 0; i < iterations; ++i)
+			checksum += UnmaskWords(in, maskkey)[in.length() / 2];
+		const double wordend = Now();
+
+		const double total = static_cast<double>(iterations) * in.length() / 1e9;
+		std::printf("%10lu %12.2f %12.2f\n", static_cast<unsigned long>(sizes[s]), total / (wordstart - bytestart),
+			total / (wordend - wordstart));
+	}
+	return 0;
+}